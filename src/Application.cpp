@@ -166,6 +166,8 @@ void regenerateScene(bool resetTextures)
 	Config::reloaded = true;
 	Config::sceneGeomChanged = false;
 	Pipeline::clearBindingRecord();
+	// GPU BVH building may have taken over the post-processing image unit
+	Pipeline::bindTextureToImage(GLContext::resultTex, UnitPostOut, 0, ImageAccess::WriteOnly, TextureFormat::Col4x32f);
 	integrator->reset({ &GLContext::scene, GLContext::renderSize, ResetLevel::FullReset });
 	rasterViewer->reset({ &GLContext::scene, GLContext::renderSize, ResetLevel::FullReset });
 }
@@ -469,8 +471,32 @@ void renderGUI()
 			}
 			ImGui::Separator();
 
+			ImGui::Text("Accelerator");
+			const char* BuilderNames[] = { "Standard", "Quick", "Linear", "Linear (GPU)", "Spatial" };
+			ImGui::SetNextItemWidth(120.0f);
+			if (ImGui::Combo("BVH builder", &scene.bvhParam.method, BuilderNames, IM_ARRAYSIZE(BuilderNames)))
+				sceneGeomChanged = true;
+			const char* WideNames[] = { "Off", "BVH4", "BVH8" };
+			int wideIndex = (scene.bvhParam.wideWidth == 8) ? 2 : (scene.bvhParam.wideWidth == 4) ? 1 : 0;
+			ImGui::SetNextItemWidth(120.0f);
+			if (ImGui::Combo("Wide BVH", &wideIndex, WideNames, IM_ARRAYSIZE(WideNames)))
+			{
+				const int Widths[] = { 0, 4, 8 };
+				scene.bvhParam.wideWidth = Widths[wideIndex];
+				sceneGeomChanged = true;
+			}
+			ImGui::SetNextItemWidth(120.0f);
+			if (ImGui::SliderInt("Max leaf size", &scene.bvhParam.maxLeafSize, 1, BVH_MAX_LEAF_SIZE))
+				sceneGeomChanged = true;
+			ImGui::SetNextItemWidth(120.0f);
+			if (ImGui::SliderInt("Treelet passes", &scene.bvhParam.treeletPasses, 0, 4))
+				sceneGeomChanged = true;
+			ImGui::Separator();
+
 			ImGui::Text("%s settings", IntegNames[GUI::integIndex]);
 			integrator->renderSettingsGUI();
+			if (integrator->takeGeomChanged())
+				sceneGeomChanged = true;
 			ImGui::EndMenu();
 		}
 
@@ -501,7 +527,14 @@ void renderGUI()
 			
 			if (materialEditor(scene, GUI::matIndex))
 				reset();
-			sceneGeomChanged |= modelEditor(scene, GUI::modelIndex, GUI::meshIndex, GUI::matIndex);
+			if (modelEditor(scene, GUI::modelIndex, GUI::meshIndex, GUI::matIndex))
+			{
+				// Transform edits only refit the TLAS unless a rebuild is pending anyway
+				if (!sceneGeomChanged && scene.refitTransforms())
+					reset();
+				else
+					sceneGeomChanged = true;
+			}
 			//sceneGeomChanged |= lightEditor(scene, GUI::lightIndex);
 
 			rasterViewer->setIndex(GUI::modelIndex, GUI::matIndex);
@@ -511,8 +544,24 @@ void renderGUI()
 		if (ImGui::BeginMenu("Statistics"))
 		{
 			ImGui::Text("BVH nodes:    %d", scene.boxCount);
-			ImGui::Text("Triangles:    %d", scene.triangleCount);
+			int nBlases = static_cast<int>(scene.blases.size());
+			if (nBlases > 0 && scene.bvhStats.cachedTrees == nBlases)
+				ImGui::Text("BVH build:    %.3lf s, cached", scene.bvhStats.buildTime);
+			else if (scene.bvhStats.numThreads > 0)
+				ImGui::Text("BVH build:    %.3lf s, %d thread(s)", scene.bvhStats.buildTime, scene.bvhStats.numThreads);
+			else
+				ImGui::Text("BVH build:    %.3lf s, GPU", scene.bvhStats.buildTime);
+			if (scene.bvhStats.cachedTrees > 0 && scene.bvhStats.cachedTrees < nBlases)
+				ImGui::Text("BVH cached:   %d of %d BLAS(es)", scene.bvhStats.cachedTrees, nBlases);
+			ImGui::Text("BVH SAH cost: %.3f", scene.bvhStats.sahCost);
+			ImGui::Text("BVH walk:     %s", scene.bvhShortStack ? "short stack" : "MTBVH");
+			ImGui::Text("BVH memory:   %.1f B/triangle (%.1f uncompressed)",
+				scene.bvhStats.bytesPerTriangle, scene.bvhStats.bytesPerTriangleUncompressed);
+			ImGui::Text("Instances:    %d of %d BLAS(es)", static_cast<int>(scene.instances.size()), static_cast<int>(scene.blases.size()));
+			ImGui::Text("Triangles:    %d unique, %d instanced", scene.triangleCount, scene.instancedTriangleCount);
 			ImGui::Text("Vertices:     %d", scene.vertexCount);
+			ImGui::Text("Mesh memory:  %.1f MiB (%.1f MiB without sharing)",
+				scene.meshBytes / 1048576.0, scene.meshBytesInstanced / 1048576.0);
 			ImGui::Text("");
 			ImGui::Text("Window size:  %dx%d", windowSize.x, windowSize.y);
 			ImGui::EndMenu();
@@ -1,77 +1,127 @@
 #include "BVH.h"
 #include "../util/Error.h"
+#include "../util/File.h"
 #include "../util/Timer.h"
 
+#include <array>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <tuple>
+
 struct BoxRec
 {
 	AABB vertBox;
 	AABB centExtent;
 };
 
+// Merged some thirty times per node, so the box union is spelled out here where it can be
+// inlined instead of going through AABB.cpp
 struct Bucket
 {
 	Bucket() : count(0) {}
 	Bucket(const Bucket& a, const Bucket& b) :
-		count(a.count + b.count), box(a.box, b.box) {}
+		count(a.count + b.count), box(glm::min(a.box.pMin, b.box.pMin), glm::max(a.box.pMax, b.box.pMax)) {}
+
+	float cost() const
+	{
+		glm::vec3 extent = box.pMax - box.pMin;
+		return count * (2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x));
+	}
+
 	int count;
 	AABB box;
 };
 
-struct BuildRec
-{
-	int offset;
-	AABB nodeExtent;
-	int splitDim;
-	int lRange;
-	int rRange;
-};
+// Ranges smaller than this are built by the task that split them instead of being
+// handed to the pool, and nodes larger than ParallelBinThreshold bin their primitives
+// in chunks of ParallelBinGrain across the pool
+const int SubtreeTaskThreshold = 4096;
+const int ParallelBinThreshold = 65536;
+const int ParallelBinGrain = 16384;
+
+// Beyond about a million primitives, 10 bits per axis leaves too many equal Morton codes
+const size_t LinearBuild64BitThreshold = 1 << 20;
+
+const float SAHTraversalCost = 1.0f;
+const float SAHIntersectionCost = 1.0f;
+
+// Treelets are reshaped over this many leaves, and only rooted where a subtree has at least
+// that many, so every DP runs over the full 3^7 partitions. Roots of equal height own disjoint
+// subtrees and are handed to the pool in chunks of TreeletGrain
+const int TreeletSize = 7;
+const int TreeletGrain = 256;
+
+// Spatial splits are only tried where the best object split's children overlap by more
+// than this fraction of the root's surface area
+const float SpatialSplitAlpha = 1e-5f;
+
+// Rough peak memory of an in-memory build per triangle: the mesh copies, PrimInfo, 2n binary
+// nodes, the hit table and the packed copy. Out-of-core chunks are sized from it
+const size_t OutOfCoreBytesPerTriangle = 256;
+
+// Centroids are counted in 2^(3 * OutOfCoreGridBits) Morton cells, which are then grouped
+// into chunks in curve order
+const int OutOfCoreGridBits = 7;
 
 using RadixSortElement = std::pair<int, int>;
 
-void radixSortLH(std::pair<int, int>* a, int count)
+// Scratch for radixSort16, allocated once per build and reused by every node
+struct SortArena
 {
-	RadixSortElement* b = new RadixSortElement[count];
-	int mIndex[4][256];
+	SortArena(int size) : keys(size), keyScratch(size), prims(size) {}
+
+	std::vector<RadixSortElement> keys;
+	std::vector<RadixSortElement> keyScratch;
+	std::vector<PrimInfo> prims;
+};
+
+// b is scratch of at least count elements
+template<typename KeyType>
+void radixSortLH(std::pair<KeyType, int>* a, std::pair<KeyType, int>* b, int count)
+{
+	constexpr int NumDigits = sizeof(KeyType);
+	static_assert(NumDigits % 2 == 0, "sorted result must end up back in a");
+	int mIndex[NumDigits][256];
 	memset(mIndex, 0, sizeof(mIndex));
 
 	for (int i = 0; i < count; i++)
 	{
-		int u = a[i].first;
-		mIndex[0][uint8_t(u)]++; u >>= 8;
-		mIndex[1][uint8_t(u)]++; u >>= 8;
-		mIndex[2][uint8_t(u)]++; u >>= 8;
-		mIndex[3][uint8_t(u)]++; u >>= 8;
+		KeyType u = a[i].first;
+		for (int j = 0; j < NumDigits; j++)
+		{
+			mIndex[j][uint8_t(u)]++;
+			u >>= 8;
+		}
 	}
 
-	int m[4] = { 0, 0, 0, 0 };
+	int m[NumDigits] = { 0 };
 	for (int i = 0; i < 256; i++)
 	{
-		int n[4] = { mIndex[0][i], mIndex[1][i], mIndex[2][i], mIndex[3][i] };
-		mIndex[0][i] = m[0];
-		mIndex[1][i] = m[1];
-		mIndex[2][i] = m[2];
-		mIndex[3][i] = m[3];
-		m[0] += n[0];
-		m[1] += n[1];
-		m[2] += n[2];
-		m[3] += n[3];
+		for (int j = 0; j < NumDigits; j++)
+		{
+			int n = mIndex[j][i];
+			mIndex[j][i] = m[j];
+			m[j] += n;
+		}
 	}
 
-	for (int j = 0; j < 4; j++)
+	for (int j = 0; j < NumDigits; j++)
 	{
 		for (int i = 0; i < count; i++)
 		{
-			int u = a[i].first;
+			KeyType u = a[i].first;
 			b[mIndex[j][uint8_t(u >> (j << 3))]++] = a[i];
 		}
 		std::swap(a, b);
 	}
-	delete[] b;
 }
 
-void radixSort16(PrimInfo* a, int count, int dim)
+void radixSort16(PrimInfo* a, int count, int dim, SortArena& arena)
 {
-	RadixSortElement* b = new RadixSortElement[count];
+	RadixSortElement* b = arena.keys.data();
 
 	int l = 0, r = count;
 	for (int i = 0; i < count; i++)
@@ -80,67 +130,170 @@ void radixSort16(PrimInfo* a, int count, int dim)
 		if (u & 0x80000000) b[l++] = RadixSortElement(~u, i);
 		else b[--r] = RadixSortElement(u, i);
 	}
-	radixSortLH(b, l);
-	radixSortLH(b + l, count - l);
+	radixSortLH(b, arena.keyScratch.data(), l);
+	radixSortLH(b + l, arena.keyScratch.data(), count - l);
 
-	PrimInfo* c = new PrimInfo[count];
-	memcpy(c, a, count * sizeof(PrimInfo));
+	PrimInfo* c = arena.prims.data();
+	std::copy(a, a + count, c);
 
 	for (int i = 0; i < count; i++)
 	{
 		a[i] = c[b[i].second];
 	}
-	delete[] b;
-	delete[] c;
 }
 
-template<int NumBuckets>
-PrimInfo* partition(PrimInfo* a, int size, float axisMin, float axisMax, int splitDim, int splitPoint)
+uint32_t expandBits(uint32_t v)
+{
+	v &= 0x3ff;
+	v = (v | v << 16) & 0x030000ff;
+	v = (v | v << 8) & 0x0300f00f;
+	v = (v | v << 4) & 0x030c30c3;
+	v = (v | v << 2) & 0x09249249;
+	return v;
+}
+
+uint64_t expandBits(uint64_t v)
+{
+	v &= 0xfffff;
+	v = (v | v << 32) & 0x001f00000000ffff;
+	v = (v | v << 16) & 0x001f0000ff0000ff;
+	v = (v | v << 8) & 0x100f00f00f00f00f;
+	v = (v | v << 4) & 0x10c30c30c30c30c3;
+	v = (v | v << 2) & 0x1249249249249249;
+	return v;
+}
+
+// 30-bit codes for uint32_t keys, 60-bit for uint64_t; p is normalized to the centroid extent
+template<typename KeyType>
+KeyType mortonCode(const glm::vec3& p)
 {
-	auto tmp = new PrimInfo[size];
-	std::copy(a, a + size, tmp);
-	int l = 0;
-	int r = size;
-	for (int i = 0; i < size; i++)
-	{
-		int b = NumBuckets * (tmp[i].centroid[splitDim] - axisMin) / (axisMax - axisMin);
-		b = std::max(std::min(b, NumBuckets - 1), 0);
-		(b <= splitPoint ? a[l++] : a[--r]) = tmp[i];
-	}
-	delete[] tmp;
-	if (r == size)
-		r--;
-	return a + r - 1;
+	constexpr float Scale = (sizeof(KeyType) == 4) ? 1024.0f : 1048576.0f;
+	glm::vec3 q = glm::clamp(p * Scale, glm::vec3(0.0f), glm::vec3(Scale - 1.0f));
+	return (expandBits(static_cast<KeyType>(q.x)) << 2) |
+		(expandBits(static_cast<KeyType>(q.y)) << 1) |
+		expandBits(static_cast<KeyType>(q.z));
 }
 
 PackedBVH BVH::build()
 {
 	Error::bracketLine<0>("BVH building by CPU");
-	primInfo.resize(indices.size() / 3);
+	// Spatial splits clip triangles, which plain boxes don't have
+	if (param.method == BVHBuildParam::Spatial && !primBounds.empty())
+		param.method = BVHBuildParam::Quick;
+
+	size_t memoryBudget = static_cast<size_t>(param.memoryBudget) << 20;
+	if (memoryBudget > 0 && primBounds.empty() && indices.size() / 3 * OutOfCoreBytesPerTriangle > memoryBudget)
+		return outOfCoreBuild();
+
+	primInfo.resize(primBounds.empty() ? indices.size() / 3 : primBounds.size());
 	treeSize = primInfo.size() * 2 - 1;
 	bounds.resize(treeSize);
 	sizeIndices.resize(treeSize);
 
+	ThreadPool pool(param.numThreads);
+	int nPrims = primInfo.size();
+	int nChunks = (nPrims + ParallelBinGrain - 1) / ParallelBinGrain;
+	std::vector<BoxRec> chunkExtents(nChunks);
+
+	pool.parallelFor(nPrims, ParallelBinGrain, [&](int begin, int end)
+	{
+		BoxRec extent;
+		for (int i = begin; i < end; i++)
+		{
+			PrimInfo hInfo;
+			hInfo.bound = primBounds.empty() ?
+				AABB(vertices[indices[i * 3 + 0]], vertices[indices[i * 3 + 1]], vertices[indices[i * 3 + 2]]) :
+				primBounds[i];
+			hInfo.centroid = hInfo.bound.centroid();
+			hInfo.index = i;
+			extent.centExtent.expand(hInfo.centroid);
+			extent.vertBox.expand(hInfo.bound);
+			primInfo[i] = hInfo;
+		}
+		chunkExtents[begin / ParallelBinGrain] = extent;
+	});
+
 	AABB rootCentExtent;
 	AABB rootBox;
-	for (int i = 0; i < primInfo.size(); i++)
+	for (const auto& extent : chunkExtents)
+	{
+		rootCentExtent.expand(extent.centExtent);
+		rootBox.expand(extent.vertBox);
+	}
+	float quickCost = 0.0f;
+	if (param.method == BVHBuildParam::Spatial && param.compareQuick)
 	{
-		PrimInfo hInfo;
-		hInfo.bound = AABB(vertices[indices[i * 3 + 0]], vertices[indices[i * 3 + 1]], vertices[indices[i * 3 + 2]]);
-		hInfo.centroid = hInfo.bound.centroid();
-		hInfo.index = i;
-		rootCentExtent.expand(hInfo.centroid);
-		rootBox.expand(hInfo.bound);
-		primInfo[i] = hInfo;
+		// Build the object-split tree first, untimed, to report what spatial splits gain
+		auto unsorted = primInfo;
+		quickBuild(rootCentExtent, pool);
+		quickCost = computeSAHCost();
+		primInfo.swap(unsorted);
 	}
+
+	const char* MethodNames[] = { "StandardBuild", "QuickBuild", "LinearBuild", "QuickBuild", "SpatialBuild" };
 	Timer timer;
-	//standardBuild(rootCentExtent);
-	quickBuild(rootCentExtent);
-	std::cout << timer.get() * 1e-9 << "\n";
+	if (param.method == BVHBuildParam::Standard)
+		standardBuild(rootCentExtent);
+	else if (param.method == BVHBuildParam::Linear)
+		linearBuild(rootCentExtent, pool);
+	else if (param.method == BVHBuildParam::Spatial)
+		spatialBuild(rootBox);
+	else
+		quickBuild(rootCentExtent, pool);
+	stats.buildTime = timer.get() * 1e-9;
+	bool serial = param.method == BVHBuildParam::Standard || param.method == BVHBuildParam::Spatial;
+	stats.numThreads = serial ? 1 : pool.numThreads();
+	stats.sahCost = computeSAHCost();
+
+	Error::bracketLine<1>(std::string(MethodNames[param.method]) + " " + std::to_string(stats.buildTime) +
+		" s with " + std::to_string(stats.numThreads) + " thread(s), SAH cost " + std::to_string(stats.sahCost));
+	if (param.treeletPasses > 0)
+	{
+		Timer treeletTimer;
+		float initialCost = stats.sahCost;
+		restructureTreelets(pool);
+		double treeletTime = treeletTimer.get() * 1e-9;
+		stats.buildTime += treeletTime;
+		stats.sahCost = computeSAHCost();
+		Error::bracketLine<1>("Treelet restructuring " + std::to_string(param.treeletPasses) + " pass(es) " +
+			std::to_string(treeletTime) + " s, SAH cost " + std::to_string(stats.sahCost) + ", " +
+			std::to_string(100.0f * (initialCost - stats.sahCost) / initialCost) + "% below the initial tree");
+	}
+	// Duplicated references can't be laid out as disjoint ranges of one triangle order
+	primOrder.resize(primInfo.size());
+	std::iota(primOrder.begin(), primOrder.end(), 0);
+	if (param.maxLeafSize > 1 && param.method != BVHBuildParam::Spatial)
+	{
+		size_t binarySize = treeSize;
+		collapseLeaves();
+		stats.sahCost = computeSAHCost();
+		Error::bracketLine<1>("Leaves of up to " + std::to_string(param.maxLeafSize) + " triangles, " +
+			std::to_string(binarySize) + " -> " + std::to_string(treeSize) + " nodes, SAH cost " + std::to_string(stats.sahCost));
+	}
+	if (param.method == BVHBuildParam::Spatial)
+	{
+		int nRefs = (treeSize + 1) / 2;
+		std::string line = std::to_string(nRefs - primInfo.size()) + " references duplicated (" +
+			std::to_string(100.0f * (nRefs - primInfo.size()) / primInfo.size()) + "%)";
+		if (param.compareQuick)
+			line += ", SAH cost " + std::to_string(100.0f * (quickCost - stats.sahCost) / quickCost) +
+				"% below QuickBuild's " + std::to_string(quickCost);
+		Error::bracketLine<1>(line);
+	}
 	std::cout << "\t[" << vertices.size() << " vertices, " << primInfo.size() << " triangles, " << bounds.size() << " nodes]\n";
 
 	buildHitTable();
-	return PackedBVH{ bounds, hitTable };
+	stats.bytesPerTriangle = static_cast<float>(bounds.size() * sizeof(AABB) + hitTable.size() * sizeof(int)) / primInfo.size();
+	stats.bytesPerTriangleUncompressed = static_cast<float>(treeSize * (sizeof(AABB) + 18 * sizeof(int))) / primInfo.size();
+
+	PackedWideBVH wide;
+	if (param.wideWidth > 0)
+	{
+		wide = WideBVH(bounds, sizeIndices, param.wideWidth).collapse();
+		Error::bracketLine<1>("BVH" + std::to_string(wide.width) + " collapsed to " + std::to_string(wide.nodeCount) +
+			" nodes, depth " + std::to_string(wide.maxDepth));
+	}
+	return PackedBVH{ bounds, hitTable, primOrder, stats, wide };
 }
 
 void BVH::standardBuild(const AABB& rootExtent)
@@ -148,8 +301,9 @@ void BVH::standardBuild(const AABB& rootExtent)
 	std::stack<BuildRec> stack;
 	stack.push({ 0, rootExtent, rootExtent.maxExtent(), 0, static_cast<int>(primInfo.size()) - 1 });
 
-	auto prefixes = new BoxRec[primInfo.size()];
-	auto suffixes = new BoxRec[primInfo.size()];
+	std::vector<BoxRec> prefixes(primInfo.size());
+	std::vector<BoxRec> suffixes(primInfo.size());
+	SortArena arena(primInfo.size());
 
 	while (!stack.empty())
 	{
@@ -164,7 +318,7 @@ void BVH::standardBuild(const AABB& rootExtent)
 			continue;
 		}
 		int nBoxes = r - l + 1;
-		radixSort16(primInfo.data() + l, nBoxes, splitDim);
+		radixSort16(primInfo.data() + l, nBoxes, splitDim, arena);
 		if (nBoxes == 2)
 		{
 			bounds[offset] = AABB(primInfo[l].bound, primInfo[r].bound);
@@ -173,8 +327,8 @@ void BVH::standardBuild(const AABB& rootExtent)
 			continue;
 		}
 		
-		auto prefix = prefixes + l;
-		auto suffix = suffixes + l;
+		auto prefix = prefixes.data() + l;
+		auto suffix = suffixes.data() + l;
 		prefix[0] = { primInfo[l].bound, primInfo[l].centroid };
 		suffix[nBoxes - 1] = { primInfo[r].bound, primInfo[r].centroid };
 
@@ -210,17 +364,76 @@ void BVH::standardBuild(const AABB& rootExtent)
 		stack.push({ offset + 2 * (splitPoint - l) + 2, rchCentBox, rchCentBox.maxExtent(), splitPoint + 1, r });
 		stack.push({ offset + 1, lchCentBox, lchCentBox.maxExtent(), l, splitPoint });
 	}
-	delete[] prefixes;
-	delete[] suffixes;
 }
 
-void BVH::quickBuild(const AABB& rootExtent)
+void BVH::quickBuild(const AABB& rootExtent, ThreadPool& pool)
+{
+	int nPrims = primInfo.size();
+	for (auto& centroid : centroids)
+		centroid.resize(nPrims);
+	pool.parallelFor(nPrims, ParallelBinGrain, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			for (int dim = 0; dim < 3; dim++)
+				centroids[dim][i] = primInfo[i].centroid[dim];
+		}
+	});
+
+	BuildRec rootRec = { 0, rootExtent, rootExtent.maxExtent(), 0, nPrims - 1 };
+	pool.enqueue([this, rootRec, &pool]() { quickBuildSubtree(rootRec, pool); });
+	pool.wait();
+
+	for (auto& centroid : centroids)
+		std::vector<float>().swap(centroid);
+}
+
+void BVH::quickBuildSubtree(const BuildRec& rootRec, ThreadPool& pool)
 {
 	std::stack<BuildRec> stack;
-	stack.push({ 0, rootExtent, rootExtent.maxExtent(), 0, static_cast<int>(primInfo.size()) - 1 });
+	stack.push(rootRec);
 
 	constexpr int NumBuckets = 16;
 
+	// Bucket of each primitive in the task's range, kept from binning for the partition.
+	// Every node below the task root is a subrange, so this is the only allocation
+	int base = rootRec.lRange;
+	std::vector<uint8_t> bins(rootRec.rRange - rootRec.lRange + 1);
+
+	auto swapPrims = [&](int a, int b)
+	{
+		std::swap(primInfo[a], primInfo[b]);
+		for (auto& centroid : centroids)
+			std::swap(centroid[a], centroid[b]);
+	};
+
+	// Min-max sweeps over the SoA centroids rather than AABB::expand, so they vectorize
+	auto centroidExtent = [&](int begin, int end)
+	{
+		AABB extent;
+		for (int dim = 0; dim < 3; dim++)
+		{
+			const float* centroid = centroids[dim].data();
+			float lo = extent.pMin[dim], hi = extent.pMax[dim];
+			for (int i = begin; i < end; i++)
+			{
+				lo = std::min(lo, centroid[i]);
+				hi = std::max(hi, centroid[i]);
+			}
+			extent.pMin[dim] = lo;
+			extent.pMax[dim] = hi;
+		}
+		return extent;
+	};
+
+	auto pushRec = [&](const BuildRec& rec)
+	{
+		if (rec.rRange - rec.lRange + 1 >= SubtreeTaskThreshold)
+			pool.enqueue([this, rec, &pool]() { quickBuildSubtree(rec, pool); });
+		else
+			stack.push(rec);
+	};
+
 	while (!stack.empty())
 	{
 		auto [offset, nodeExtent, splitDim, l, r] = stack.top();
@@ -238,7 +451,7 @@ void BVH::quickBuild(const AABB& rootExtent)
 		{
 			bounds[offset] = AABB(primInfo[l].bound, primInfo[r].bound);
 			if (primInfo[l].centroid[splitDim] > primInfo[r].centroid[splitDim])
-				std::swap(primInfo[l], primInfo[r]);
+				swapPrims(l, r);
 			stack.push({ offset + 2, primInfo[r].centroid, 0, r, r });
 			stack.push({ offset + 1, primInfo[l].centroid, 0, l, l });
 			continue;
@@ -251,13 +464,44 @@ void BVH::quickBuild(const AABB& rootExtent)
 		Bucket prefix[NumBuckets];
 		Bucket suffix[NumBuckets];
 
-		for (int i = l; i <= r; i++)
+		// Bucket indices come from a contiguous centroid array in a loop of their own, then
+		// the boxes are gathered into the buckets
+		auto binPrims = [&](int begin, int end, Bucket* target)
+		{
+			const float* centroid = centroids[splitDim].data();
+			uint8_t* bin = bins.data() - base;
+			for (int i = begin; i < end; i++)
+			{
+				int b = NumBuckets * (centroid[i] - axisMin) / (axisMax - axisMin);
+				bin[i] = std::max(std::min(b, NumBuckets - 1), 0);
+			}
+			for (int i = begin; i < end; i++)
+			{
+				auto& bucket = target[bin[i]];
+				bucket.count++;
+				bucket.box.pMin = glm::min(bucket.box.pMin, primInfo[i].bound.pMin);
+				bucket.box.pMax = glm::max(bucket.box.pMax, primInfo[i].bound.pMax);
+			}
+		};
+
+		if (nBoxes >= ParallelBinThreshold)
 		{
-			int b = NumBuckets * (primInfo[i].centroid[splitDim] - axisMin) / (axisMax - axisMin);
-			b = std::max(std::min(b, NumBuckets - 1), 0);
-			buckets[b].count++;
-			buckets[b].box.expand(primInfo[i].bound);
+			// Count and box unions don't depend on the order chunks are merged in,
+			// so the tree comes out identical to the serial binning
+			int nChunks = (nBoxes + ParallelBinGrain - 1) / ParallelBinGrain;
+			std::vector<std::array<Bucket, NumBuckets>> chunkBuckets(nChunks);
+			pool.parallelFor(nBoxes, ParallelBinGrain, [&](int begin, int end)
+			{
+				binPrims(l + begin, l + end, chunkBuckets[begin / ParallelBinGrain].data());
+			});
+			for (const auto& chunk : chunkBuckets)
+			{
+				for (int i = 0; i < NumBuckets; i++)
+					buckets[i] = Bucket(buckets[i], chunk[i]);
+			}
 		}
+		else
+			binPrims(l, r + 1, buckets);
 
 		prefix[0] = buckets[0];
 		suffix[NumBuckets - 1] = buckets[NumBuckets - 1];
@@ -269,30 +513,760 @@ void BVH::quickBuild(const AABB& rootExtent)
 		bounds[offset] = prefix[NumBuckets - 1].box;
 
 		int splitPoint = 0;
-		float minCost = prefix[0].count * prefix[0].box.surfaceArea() +
-			suffix[1].count * suffix[1].box.surfaceArea();
+		float minCost = prefix[0].cost() + suffix[1].cost();
 		for (int i = 1; i < NumBuckets - 1; i++)
 		{
-			float cost = prefix[i].count * prefix[i].box.surfaceArea() +
-				suffix[i + 1].count * suffix[i + 1].box.surfaceArea();
+			float cost = prefix[i].cost() + suffix[i + 1].cost();
 			if (cost < minCost)
 			{
 				minCost = cost;
 				splitPoint = i;
 			}
 		}
-		auto itr = partition<NumBuckets>(&primInfo[l], nBoxes, axisMin, axisMax, splitDim, splitPoint);
-		splitPoint = itr - &primInfo[0];
+		// In-place partition on the stored buckets. The bucket of a swapped pair is never
+		// read again, so only the primitives move
+		const uint8_t* bin = bins.data() - base;
+		int i = l, j = r;
+		while (true)
+		{
+			while (i <= j && bin[i] <= splitPoint)
+				i++;
+			while (i <= j && bin[j] > splitPoint)
+				j--;
+			if (i >= j)
+				break;
+			swapPrims(i++, j--);
+		}
+		// The first bucket always holds the lowest centroid, so only an empty right side
+		// needs fixing
+		splitPoint = std::min(i, r) - 1;
 
-		AABB lchCentBox, rchCentBox;
-		for (int i = l; i <= splitPoint; i++)
-			lchCentBox.expand(primInfo[i].centroid);
-		for (int i = splitPoint + 1; i <= r; i++)
-			rchCentBox.expand(primInfo[i].centroid);
+		AABB lchCentBox = centroidExtent(l, splitPoint + 1);
+		AABB rchCentBox = centroidExtent(splitPoint + 1, r + 1);
 
-		stack.push({ offset + 2 * (splitPoint - l) + 2, rchCentBox, rchCentBox.maxExtent(), splitPoint + 1, r });
-		stack.push({ offset + 1, lchCentBox, lchCentBox.maxExtent(), l, splitPoint });
+		pushRec({ offset + 2 * (splitPoint - l) + 2, rchCentBox, rchCentBox.maxExtent(), splitPoint + 1, r });
+		pushRec({ offset + 1, lchCentBox, lchCentBox.maxExtent(), l, splitPoint });
+	}
+}
+
+void BVH::linearBuild(const AABB& rootExtent, ThreadPool& pool)
+{
+	if (primInfo.size() < LinearBuild64BitThreshold)
+		linearBuild<uint32_t>(rootExtent, pool);
+	else
+		linearBuild<uint64_t>(rootExtent, pool);
+}
+
+template<typename KeyType>
+void BVH::linearBuild(const AABB& rootExtent, ThreadPool& pool)
+{
+	int nPrims = primInfo.size();
+	glm::vec3 extent = rootExtent.pMax - rootExtent.pMin;
+	glm::vec3 scale(
+		extent.x > 0.0f ? 1.0f / extent.x : 0.0f,
+		extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+		extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
+
+	std::vector<std::pair<KeyType, int>> keys(nPrims);
+	pool.parallelFor(nPrims, ParallelBinGrain, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+			keys[i] = { mortonCode<KeyType>((primInfo[i].centroid - rootExtent.pMin) * scale), i };
+	});
+	{
+		std::vector<std::pair<KeyType, int>> keyScratch(nPrims);
+		radixSortLH(keys.data(), keyScratch.data(), nPrims);
+	}
+
+	std::vector<PrimInfo> sortedInfo(nPrims);
+	std::vector<KeyType> codes(nPrims);
+	pool.parallelFor(nPrims, ParallelBinGrain, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			sortedInfo[i] = primInfo[keys[i].second];
+			codes[i] = keys[i].first;
+		}
+	});
+	primInfo.swap(sortedInfo);
+
+	std::function<void(int, int, int)> buildSubtree = [&](int rootOffset, int rootL, int rootR)
+	{
+		std::stack<std::tuple<int, int, int>> stack;
+		stack.push({ rootOffset, rootL, rootR });
+
+		while (!stack.empty())
+		{
+			auto [offset, l, r] = stack.top();
+			stack.pop();
+			int size = (r - l) * 2 + 1;
+			sizeIndices[offset] = (size == 1) ? (primInfo[l].index | BVH_LEAF_MASK) : size;
+
+			if (l == r)
+			{
+				bounds[offset] = primInfo[l].bound;
+				continue;
+			}
+
+			// Split where the highest bit that differs across the range flips from 0 to 1,
+			// or in the middle if all codes in the range are equal
+			int splitPoint = (l + r) / 2;
+			KeyType diff = codes[l] ^ codes[r];
+			if (diff != 0)
+			{
+				KeyType highBit = 1;
+				while (diff >>= 1)
+					highBit <<= 1;
+				splitPoint = std::partition_point(codes.begin() + l, codes.begin() + r + 1,
+					[highBit](KeyType code) { return (code & highBit) == 0; }) - codes.begin() - 1;
+			}
+
+			std::tuple<int, int, int> children[] =
+			{
+				{ offset + 2 * (splitPoint - l) + 2, splitPoint + 1, r },
+				{ offset + 1, l, splitPoint }
+			};
+			for (const auto& child : children)
+			{
+				auto [childOffset, childL, childR] = child;
+				if (childR - childL + 1 >= SubtreeTaskThreshold)
+					pool.enqueue([&buildSubtree, child]() { std::apply(buildSubtree, child); });
+				else
+					stack.push(child);
+			}
+		}
+	};
+	pool.enqueue([&]() { buildSubtree(0, 0, nPrims - 1); });
+	pool.wait();
+
+	// Children always sit after their parent in the DFS layout, so a reverse sweep
+	// sees both children's bounds before the parent's
+	for (int k = treeSize - 1; k >= 0; k--)
+	{
+		if (sizeIndices[k] & BVH_LEAF_MASK)
+			continue;
+		int lSize = (sizeIndices[k + 1] & BVH_LEAF_MASK) ? 1 : sizeIndices[k + 1];
+		bounds[k] = AABB(bounds[k + 1], bounds[k + 1 + lSize]);
+	}
+}
+
+void BVH::restructureTreelets(ThreadPool& pool)
+{
+	constexpr int NumSubsets = 1 << TreeletSize;
+	int nNodes = treeSize;
+	if (nNodes < TreeletSize * 2 - 1)
+		return;
+
+	// Work on explicit child links; the pre-order layout is rebuilt at the end
+	std::vector<int> lChild(nNodes, -1), rChild(nNodes, -1);
+	for (int k = 0; k < nNodes; k++)
+	{
+		if (sizeIndices[k] & BVH_LEAF_MASK)
+			continue;
+		int lSize = (sizeIndices[k + 1] & BVH_LEAF_MASK) ? 1 : sizeIndices[k + 1];
+		lChild[k] = k + 1;
+		rChild[k] = k + 1 + lSize;
+	}
+	auto isLeaf = [&](int k) { return lChild[k] == -1; };
+	auto bitIndex = [](int bit) { int i = 0; while (bit >>= 1) i++; return i; };
+
+	// Unnormalized SAH cost of each subtree, matching computeSAHCost's unit costs
+	std::vector<float> cost(nNodes);
+	std::vector<int> order, height(nNodes), leafCount(nNodes);
+	order.reserve(nNodes);
+
+	auto restructure = [&](int root)
+	{
+		int leaves[TreeletSize] = { lChild[root], rChild[root] };
+		int internals[TreeletSize - 2];
+		int nLeaves = 2, nInternals = 0;
+
+		// Grow the treelet by opening its largest interior leaf
+		while (nLeaves < TreeletSize)
+		{
+			int best = -1;
+			float bestArea = -1.0f;
+			for (int i = 0; i < nLeaves; i++)
+			{
+				if (isLeaf(leaves[i]))
+					continue;
+				float area = bounds[leaves[i]].surfaceArea();
+				if (area > bestArea)
+					best = i, bestArea = area;
+			}
+			if (best == -1)
+				break;
+			int opened = leaves[best];
+			internals[nInternals++] = opened;
+			leaves[best] = lChild[opened];
+			leaves[nLeaves++] = rChild[opened];
+		}
+
+		AABB boxes[NumSubsets];
+		float areas[NumSubsets];
+		float optCost[NumSubsets];
+		int optSplit[NumSubsets];
+		int full = (1 << nLeaves) - 1;
+
+		// Proper subsets of s are numerically smaller than s, so one increasing sweep suffices
+		for (int s = 1; s <= full; s++)
+		{
+			int lowBit = s & -s;
+			if (s == lowBit)
+			{
+				int leaf = leaves[bitIndex(s)];
+				boxes[s] = bounds[leaf];
+				optCost[s] = cost[leaf];
+				continue;
+			}
+			boxes[s] = AABB(boxes[s ^ lowBit], boxes[lowBit]);
+			areas[s] = boxes[s].surfaceArea();
+
+			float best = std::numeric_limits<float>::max();
+			for (int p = (s - 1) & s; p > 0; p = (p - 1) & s)
+			{
+				// Each unordered partition once, keeping the lowest leaf on the left
+				if (!(p & lowBit))
+					continue;
+				float c = optCost[p] + optCost[s ^ p];
+				if (c < best)
+					best = c, optSplit[s] = p;
+			}
+			optCost[s] = areas[s] + best;
+		}
+		if (optCost[full] >= cost[root])
+			return;
+
+		// Reuse the treelet's interior nodes for the new topology
+		std::pair<int, int> stack[TreeletSize];
+		int top = 0, nextInternal = 0;
+		stack[top++] = { root, full };
+		while (top)
+		{
+			auto [node, s] = stack[--top];
+			int parts[2] = { optSplit[s], s ^ optSplit[s] };
+			int children[2];
+			for (int i = 0; i < 2; i++)
+			{
+				if ((parts[i] & (parts[i] - 1)) == 0)
+					children[i] = leaves[bitIndex(parts[i])];
+				else
+				{
+					children[i] = internals[nextInternal++];
+					bounds[children[i]] = boxes[parts[i]];
+					cost[children[i]] = optCost[parts[i]];
+					stack[top++] = { children[i], parts[i] };
+				}
+			}
+			lChild[node] = children[0];
+			rChild[node] = children[1];
+		}
+		cost[root] = optCost[full];
+	};
+
+	for (int pass = 0; pass < param.treeletPasses; pass++)
+	{
+		// Heights, leaf counts and costs of the current topology, children before parents
+		order.clear();
+		std::stack<int> stack;
+		stack.push(0);
+		while (!stack.empty())
+		{
+			int k = stack.top();
+			stack.pop();
+			order.push_back(k);
+			if (!isLeaf(k))
+			{
+				stack.push(rChild[k]);
+				stack.push(lChild[k]);
+			}
+		}
+
+		int maxHeight = 0;
+		for (int i = nNodes - 1; i >= 0; i--)
+		{
+			int k = order[i];
+			float area = bounds[k].surfaceArea();
+			if (isLeaf(k))
+			{
+				height[k] = 0;
+				leafCount[k] = 1;
+				cost[k] = area;
+				continue;
+			}
+			height[k] = std::max(height[lChild[k]], height[rChild[k]]) + 1;
+			leafCount[k] = leafCount[lChild[k]] + leafCount[rChild[k]];
+			cost[k] = area + cost[lChild[k]] + cost[rChild[k]];
+			maxHeight = std::max(maxHeight, height[k]);
+		}
+
+		std::vector<std::vector<int>> levels(maxHeight + 1);
+		for (int k = 0; k < nNodes; k++)
+		{
+			if (leafCount[k] >= TreeletSize)
+				levels[height[k]].push_back(k);
+		}
+
+		for (const auto& level : levels)
+		{
+			pool.parallelFor(level.size(), TreeletGrain, [&](int begin, int end)
+			{
+				for (int i = begin; i < end; i++)
+				{
+					int root = level[i];
+					// Restructured descendants changed what this node's children cost
+					cost[root] = bounds[root].surfaceArea() + cost[lChild[root]] + cost[rChild[root]];
+					restructure(root);
+				}
+			});
+		}
+	}
+
+	// Lay the restructured tree out in pre-order again
+	std::vector<AABB> newBounds(nNodes);
+	std::vector<int> newSizeIndices(nNodes);
+	std::vector<int> newOffsets(nNodes);
+	std::stack<int> stack;
+	stack.push(0);
+	int offset = 0;
+	order.clear();
+	while (!stack.empty())
+	{
+		int k = stack.top();
+		stack.pop();
+		newOffsets[k] = offset;
+		newBounds[offset] = bounds[k];
+		newSizeIndices[offset] = sizeIndices[k];
+		order.push_back(k);
+		offset++;
+		if (!isLeaf(k))
+		{
+			stack.push(rChild[k]);
+			stack.push(lChild[k]);
+		}
+	}
+	for (int i = nNodes - 1; i >= 0; i--)
+	{
+		int k = order[i];
+		leafCount[k] = isLeaf(k) ? 1 : leafCount[lChild[k]] + leafCount[rChild[k]];
+		if (!isLeaf(k))
+			newSizeIndices[newOffsets[k]] = leafCount[k] * 2 - 1;
+	}
+	bounds = std::move(newBounds);
+	sizeIndices = std::move(newSizeIndices);
+}
+
+bool isEmpty(const AABB& box)
+{
+	return box.pMin.x > box.pMax.x || box.pMin.y > box.pMax.y || box.pMin.z > box.pMax.z;
+}
+
+// Bound of the part of triangle (va, vb, vc) inside box, empty if they don't overlap
+AABB clipTriangle(const glm::vec3& va, const glm::vec3& vb, const glm::vec3& vc, const AABB& box)
+{
+	// Clipping a triangle by six planes leaves at most nine vertices
+	glm::vec3 poly[2][9] = { { va, vb, vc } };
+	int count = 3;
+	int cur = 0;
+
+	for (int plane = 0; plane < 6 && count > 0; plane++)
+	{
+		int dim = plane >> 1;
+		bool isMax = plane & 1;
+		float bound = isMax ? box.pMax[dim] : box.pMin[dim];
+		auto inside = [&](const glm::vec3& p) { return isMax ? p[dim] <= bound : p[dim] >= bound; };
+
+		int next = 0;
+		for (int i = 0; i < count; i++)
+		{
+			const glm::vec3& a = poly[cur][i];
+			const glm::vec3& b = poly[cur][(i + 1) % count];
+			bool aIn = inside(a), bIn = inside(b);
+			if (aIn)
+				poly[cur ^ 1][next++] = a;
+			if (aIn != bIn)
+			{
+				float t = (bound - a[dim]) / (b[dim] - a[dim]);
+				glm::vec3 p = a + (b - a) * t;
+				p[dim] = bound;
+				poly[cur ^ 1][next++] = p;
+			}
+		}
+		count = next;
+		cur ^= 1;
+	}
+
+	AABB ret;
+	for (int i = 0; i < count; i++)
+		ret.expand(AABB(poly[cur][i]));
+	if (count == 0)
+		return ret;
+	// Guard against the clipped points drifting outside the box through rounding
+	ret.pMin = glm::max(ret.pMin, box.pMin);
+	ret.pMax = glm::min(ret.pMax, box.pMax);
+	return ret;
+}
+
+void BVH::spatialBuild(const AABB& rootBox)
+{
+	constexpr int NumBins = 32;
+
+	int nPrims = primInfo.size();
+	int maxRefs = nPrims + static_cast<int>(nPrims * param.spatialBudget);
+	int nRefs = nPrims;
+	float rootArea = rootBox.surfaceArea();
+
+	auto triangle = [&](int index, int i) { return vertices[indices[index * 3 + i]]; };
+
+	// References are emitted in pre-order as they are split, each remembering its parent,
+	// so subtree sizes can be summed up afterwards like the parallel builds do with bounds
+	bounds.clear();
+	sizeIndices.clear();
+	std::vector<int> parents;
+
+	std::stack<std::pair<int, std::vector<PrimInfo>>> stack;
+	stack.push({ -1, primInfo });
+
+	while (!stack.empty())
+	{
+		auto [parent, refs] = std::move(stack.top());
+		stack.pop();
+		int offset = bounds.size();
+		parents.push_back(parent);
+
+		int nBoxes = refs.size();
+		AABB nodeBox, centExtent;
+		for (const auto& ref : refs)
+		{
+			nodeBox.expand(ref.bound);
+			centExtent.expand(ref.centroid);
+		}
+		bounds.push_back(nodeBox);
+
+		if (nBoxes == 1)
+		{
+			sizeIndices.push_back(refs[0].index | BVH_LEAF_MASK);
+			continue;
+		}
+		sizeIndices.push_back(1);
+
+		// Binned object split over all three axes
+		float objectCost = std::numeric_limits<float>::max();
+		int objectDim = -1, objectSplit = 0;
+		AABB objectOverlap;
+
+		for (int dim = 0; dim < 3; dim++)
+		{
+			float axisMin = centExtent.pMin[dim];
+			float axisMax = centExtent.pMax[dim];
+			if (axisMax <= axisMin)
+				continue;
+
+			Bucket buckets[NumBins];
+			for (const auto& ref : refs)
+			{
+				int b = NumBins * (ref.centroid[dim] - axisMin) / (axisMax - axisMin);
+				b = std::max(std::min(b, NumBins - 1), 0);
+				buckets[b].count++;
+				buckets[b].box.expand(ref.bound);
+			}
+
+			Bucket suffix[NumBins];
+			suffix[NumBins - 1] = buckets[NumBins - 1];
+			for (int i = NumBins - 2; i >= 0; i--)
+				suffix[i] = Bucket(suffix[i + 1], buckets[i]);
+
+			Bucket prefix;
+			for (int i = 0; i < NumBins - 1; i++)
+			{
+				prefix = Bucket(prefix, buckets[i]);
+				if (prefix.count == 0 || suffix[i + 1].count == 0)
+					continue;
+				float cost = prefix.box.surfaceArea() * prefix.count + suffix[i + 1].box.surfaceArea() * suffix[i + 1].count;
+				if (cost < objectCost)
+				{
+					objectCost = cost;
+					objectDim = dim;
+					objectSplit = i;
+					objectOverlap = AABB(glm::max(prefix.box.pMin, suffix[i + 1].box.pMin),
+						glm::min(prefix.box.pMax, suffix[i + 1].box.pMax));
+				}
+			}
+		}
+
+		// Spatial split, clipping each reference into every bin it straddles
+		float spatialCost = std::numeric_limits<float>::max();
+		int spatialDim = -1;
+		float spatialPos = 0.0f;
+
+		bool trySpatial = nRefs < maxRefs && (objectDim == -1 ||
+			(!isEmpty(objectOverlap) && objectOverlap.surfaceArea() > SpatialSplitAlpha * rootArea));
+
+		for (int dim = 0; trySpatial && dim < 3; dim++)
+		{
+			float axisMin = nodeBox.pMin[dim];
+			float binWidth = (nodeBox.pMax[dim] - axisMin) / NumBins;
+			if (binWidth <= 0.0f)
+				continue;
+
+			AABB binBoxes[NumBins];
+			int entries[NumBins] = { 0 };
+			int exits[NumBins] = { 0 };
+
+			auto binOf = [&](float x) { return std::max(std::min(static_cast<int>((x - axisMin) / binWidth), NumBins - 1), 0); };
+
+			for (const auto& ref : refs)
+			{
+				int first = binOf(ref.bound.pMin[dim]);
+				int last = binOf(ref.bound.pMax[dim]);
+				entries[first]++;
+				exits[last]++;
+				if (first == last)
+				{
+					binBoxes[first].expand(ref.bound);
+					continue;
+				}
+				for (int b = first; b <= last; b++)
+				{
+					AABB slab = ref.bound;
+					slab.pMin[dim] = std::max(slab.pMin[dim], axisMin + binWidth * b);
+					slab.pMax[dim] = std::min(slab.pMax[dim], axisMin + binWidth * (b + 1));
+					AABB clipped = clipTriangle(triangle(ref.index, 0), triangle(ref.index, 1), triangle(ref.index, 2), slab);
+					if (!isEmpty(clipped))
+						binBoxes[b].expand(clipped);
+				}
+			}
+
+			AABB suffixBoxes[NumBins];
+			int suffixCounts[NumBins];
+			suffixBoxes[NumBins - 1] = binBoxes[NumBins - 1];
+			suffixCounts[NumBins - 1] = exits[NumBins - 1];
+			for (int i = NumBins - 2; i >= 0; i--)
+			{
+				suffixBoxes[i] = AABB(suffixBoxes[i + 1], binBoxes[i]);
+				suffixCounts[i] = suffixCounts[i + 1] + exits[i];
+			}
+
+			AABB prefixBox;
+			int prefixCount = 0;
+			for (int i = 0; i < NumBins - 1; i++)
+			{
+				prefixBox.expand(binBoxes[i]);
+				prefixCount += entries[i];
+				int duplicates = prefixCount + suffixCounts[i + 1] - nBoxes;
+				if (prefixCount == 0 || suffixCounts[i + 1] == 0 || nRefs + duplicates > maxRefs)
+					continue;
+				float cost = prefixBox.surfaceArea() * prefixCount + suffixBoxes[i + 1].surfaceArea() * suffixCounts[i + 1];
+				if (cost < spatialCost)
+				{
+					spatialCost = cost;
+					spatialDim = dim;
+					spatialPos = axisMin + binWidth * (i + 1);
+				}
+			}
+		}
+
+		std::vector<PrimInfo> lRefs, rRefs;
+		if (spatialDim != -1 && spatialCost < objectCost)
+		{
+			int dim = spatialDim;
+			for (const auto& ref : refs)
+			{
+				if (ref.bound.pMax[dim] <= spatialPos)
+					lRefs.push_back(ref);
+				else if (ref.bound.pMin[dim] >= spatialPos)
+					rRefs.push_back(ref);
+				else
+				{
+					AABB lSlab = ref.bound, rSlab = ref.bound;
+					lSlab.pMax[dim] = spatialPos;
+					rSlab.pMin[dim] = spatialPos;
+					glm::vec3 va = triangle(ref.index, 0), vb = triangle(ref.index, 1), vc = triangle(ref.index, 2);
+					AABB lBound = clipTriangle(va, vb, vc, lSlab);
+					AABB rBound = clipTriangle(va, vb, vc, rSlab);
+					if (!isEmpty(lBound))
+						lRefs.push_back({ lBound, lBound.centroid(), ref.index });
+					if (!isEmpty(rBound))
+						rRefs.push_back({ rBound, rBound.centroid(), ref.index });
+				}
+			}
+		}
+		if (lRefs.empty() || rRefs.empty())
+		{
+			lRefs.clear();
+			rRefs.clear();
+			if (objectDim != -1)
+			{
+				float axisMin = centExtent.pMin[objectDim];
+				float axisMax = centExtent.pMax[objectDim];
+				for (const auto& ref : refs)
+				{
+					int b = NumBins * (ref.centroid[objectDim] - axisMin) / (axisMax - axisMin);
+					b = std::max(std::min(b, NumBins - 1), 0);
+					(b <= objectSplit ? lRefs : rRefs).push_back(ref);
+				}
+			}
+			else
+			{
+				// All centroids coincide, so any halving is as good as another
+				lRefs.assign(refs.begin(), refs.begin() + nBoxes / 2);
+				rRefs.assign(refs.begin() + nBoxes / 2, refs.end());
+			}
+		}
+		nRefs += lRefs.size() + rRefs.size() - nBoxes;
+
+		stack.push({ offset, std::move(rRefs) });
+		stack.push({ offset, std::move(lRefs) });
+	}
+
+	treeSize = bounds.size();
+	for (int k = treeSize - 1; k > 0; k--)
+	{
+		if (!(sizeIndices[k] & BVH_LEAF_MASK))
+			sizeIndices[parents[k]] += sizeIndices[k];
+		else
+			sizeIndices[parents[k]]++;
+	}
+}
+
+void BVH::collapseLeaves()
+{
+	// Bottom-up, a subtree becomes one leaf when intersecting all of its triangles costs no
+	// more than the best its subtree can do
+	std::vector<float> cost(treeSize);
+	std::vector<int> count(treeSize), newSize(treeSize);
+	std::vector<bool> collapse(treeSize);
+
+	for (int k = static_cast<int>(treeSize) - 1; k >= 0; k--)
+	{
+		float area = bounds[k].surfaceArea();
+		if (sizeIndices[k] & BVH_LEAF_MASK)
+		{
+			count[k] = 1;
+			cost[k] = area * SAHIntersectionCost;
+			newSize[k] = 1;
+			collapse[k] = true;
+			continue;
+		}
+		int lch = k + 1;
+		int rch = k + 1 + ((sizeIndices[lch] & BVH_LEAF_MASK) ? 1 : sizeIndices[lch]);
+		count[k] = count[lch] + count[rch];
+		cost[k] = area * SAHTraversalCost + cost[lch] + cost[rch];
+		newSize[k] = 1 + newSize[lch] + newSize[rch];
+
+		float leafCost = area * count[k] * SAHIntersectionCost;
+		collapse[k] = count[k] <= std::min(param.maxLeafSize, BVH_MAX_LEAF_SIZE) && leafCost <= cost[k];
+		if (collapse[k])
+		{
+			cost[k] = leafCost;
+			newSize[k] = 1;
+		}
+	}
+
+	// Pre-order is kept, so a collapsed subtree's triangles are the leaves stored in
+	// [k, k + size) and become one contiguous range of primOrder
+	std::vector<AABB> newBounds;
+	std::vector<int> newSizeIndices;
+	newBounds.reserve(newSize[0]);
+	newSizeIndices.reserve(newSize[0]);
+	primOrder.clear();
+
+	std::stack<int> stack;
+	stack.push(0);
+	while (!stack.empty())
+	{
+		int k = stack.top();
+		stack.pop();
+		newBounds.push_back(bounds[k]);
+
+		if (collapse[k])
+		{
+			int first = primOrder.size();
+			int size = (sizeIndices[k] & BVH_LEAF_MASK) ? 1 : sizeIndices[k];
+			for (int i = k; i < k + size; i++)
+			{
+				if (sizeIndices[i] & BVH_LEAF_MASK)
+					primOrder.push_back(sizeIndices[i] & ~BVH_LEAF_MASK);
+			}
+			newSizeIndices.push_back(BVH_LEAF_MASK | (count[k] - 1) << BVH_LEAF_SIZE_SHIFT | first);
+			continue;
+		}
+		newSizeIndices.push_back(newSize[k]);
+		int rch = k + 1 + ((sizeIndices[k + 1] & BVH_LEAF_MASK) ? 1 : sizeIndices[k + 1]);
+		stack.push(rch);
+		stack.push(k + 1);
 	}
+	bounds = std::move(newBounds);
+	sizeIndices = std::move(newSizeIndices);
+	treeSize = bounds.size();
+}
+
+float sahCost(const AABB* bounds, const int* sizeIndices, size_t treeSize)
+{
+	float rootArea = bounds[0].surfaceArea();
+	if (rootArea <= 0.0f)
+		return 0.0f;
+
+	float cost = 0.0f;
+	for (size_t k = 0; k < treeSize; k++)
+	{
+		bool isLeaf = sizeIndices[k] & BVH_LEAF_MASK;
+		cost += bounds[k].surfaceArea() * (isLeaf ? SAHIntersectionCost * bvhLeafCount(sizeIndices[k]) : SAHTraversalCost);
+	}
+	return cost / rootArea;
+}
+
+float BVH::computeSAHCost() const
+{
+	return sahCost(bounds.data(), sizeIndices.data(), treeSize);
+}
+
+void BVH::refit(PackedBVH& bvh, const std::vector<AABB>& primBounds)
+{
+	// Segment 0 of the hit table is sizeIndices in pre-order, so children always come after
+	// their parent and a reverse sweep sees both of them refitted
+	auto& bounds = bvh.bounds;
+	const int* sizeIndices = bvh.hitTable.data();
+	size_t treeSize = bounds.size();
+
+	auto leafBound = [&](int nodeInfo)
+	{
+		AABB bound;
+		int first = bvhLeafFirst(nodeInfo);
+		for (int i = first; i < first + bvhLeafCount(nodeInfo); i++)
+			bound.expand(primBounds[bvh.primOrder[i]]);
+		return bound;
+	};
+
+	for (int k = static_cast<int>(treeSize) - 1; k >= 0; k--)
+	{
+		if (sizeIndices[k] & BVH_LEAF_MASK)
+		{
+			bounds[k] = leafBound(sizeIndices[k]);
+			continue;
+		}
+		int lSize = sizeIndices[k + 1];
+		if (lSize & BVH_LEAF_MASK)
+			lSize = 1;
+		bounds[k] = AABB(bounds[k + 1], bounds[k + 1 + lSize]);
+	}
+	bvh.stats.sahCost = sahCost(bounds.data(), sizeIndices, treeSize);
+
+	if (bvh.wide.nodeCount > 0)
+		WideBVH::refit(bvh.wide, leafBound);
+}
+
+float BVH::nodeAreaRatio(const PackedBVH& bvh)
+{
+	float nodeArea = 0.0f, leafArea = 0.0f;
+	for (size_t k = 0; k < bvh.bounds.size(); k++)
+	{
+		float area = bvh.bounds[k].surfaceArea();
+		nodeArea += area;
+		if (bvh.hitTable[k] & BVH_LEAF_MASK)
+			leafArea += area;
+	}
+	return (leafArea > 0.0f) ? nodeArea / leafArea : 1.0f;
 }
 
 void BVH::buildHitTable()
@@ -307,27 +1281,18 @@ void BVH::buildHitTable()
 		[](const glm::vec3& a, const glm::vec3& b) { return a.z < b.z; }		// Z-
 	};
 
-	hitTable.resize(treeSize * 18);
-
 	auto stack = new size_t[treeSize];
 
-	for (int i = 0; i < 6; i++)
+	// Writes the pre-order threading of face i: order[index] = node offset
+	auto threadTree = [&](int i, int* order)
 	{
-		size_t tableOffset = treeSize * 3 * i;
 		size_t top = 0, index = 0;
 		stack[top++] = 0;
 		while (top)
 		{
 			auto k = stack[--top];
-
-			bool isLeaf = sizeIndices[k] & BVH_LEAF_MASK;
-			int nodeSize = isLeaf ? 1 : sizeIndices[k];
-
-			hitTable[tableOffset + index * 3 + 0] = k;			// nodeIndex
-			hitTable[tableOffset + index * 3 + 1] = isLeaf ? sizeIndices[k] ^ BVH_LEAF_MASK : -1; // primIndex
-			hitTable[tableOffset + index * 3 + 2] = index + nodeSize;	// missIndex
-			index++;
-			if (isLeaf)
+			order[index++] = static_cast<int>(k);
+			if (sizeIndices[k] & BVH_LEAF_MASK)
 				continue;
 
 			int lSize = sizeIndices[k + 1];
@@ -341,6 +1306,273 @@ void BVH::buildHitTable()
 			stack[top++] = rch;
 			stack[top++] = lch;
 		}
+	};
+
+	// Lay the tree out in its X+ threading so that face needs no node indices at all
+	std::vector<int> order(treeSize);
+	threadTree(0, order.data());
+
+	std::vector<AABB> orderedBounds(treeSize);
+	std::vector<int> orderedSizeIndices(treeSize);
+	for (size_t i = 0; i < treeSize; i++)
+	{
+		orderedBounds[i] = bounds[order[i]];
+		orderedSizeIndices[i] = sizeIndices[order[i]];
 	}
+	bounds = std::move(orderedBounds);
+	sizeIndices = std::move(orderedSizeIndices);
+
+	// Segment 0 holds sizeIndices, from which the miss link of a node is index + size.
+	// Segments 1-5 map each face's threading position to a node offset
+	hitTable.resize(treeSize * 6);
+	std::copy(sizeIndices.begin(), sizeIndices.end(), hitTable.begin());
+	for (int i = 1; i < 6; i++)
+		threadTree(i, hitTable.data() + treeSize * i);
+
 	delete[] stack;
-}
\ No newline at end of file
+}
+
+struct ChunkTriangle
+{
+	glm::vec3 v[3];
+	uint32_t index;
+};
+
+PackedBVH BVH::outOfCoreBuild()
+{
+	// Triangles are spilled into spatially coherent chunk files that each fit the budget, every
+	// chunk is built in memory on its own, and the chunk roots get a small SAH tree of their
+	// own on top. Only the finished subtrees, and in the end the output, are held at once
+	Timer timer;
+	size_t nPrims = indices.size() / 3;
+	size_t memoryBudget = static_cast<size_t>(param.memoryBudget) << 20;
+	size_t chunkPrims = std::max<size_t>(memoryBudget / OutOfCoreBytesPerTriangle, 1024);
+	Error::check(nPrims <= BVH_LEAF_FIRST_MASK, "[BVH] too many triangles for the leaf encoding");
+
+	auto triangleCentroid = [&](size_t i)
+	{
+		return AABB(vertices[indices[i * 3 + 0]], vertices[indices[i * 3 + 1]], vertices[indices[i * 3 + 2]]).centroid();
+	};
+
+	AABB centExtent;
+	for (size_t i = 0; i < nPrims; i++)
+		centExtent.expand(triangleCentroid(i));
+	glm::vec3 extentSize = glm::max(centExtent.pMax - centExtent.pMin, glm::vec3(1e-20f));
+
+	auto cellIndex = [&](size_t i)
+	{
+		return mortonCode<uint32_t>((triangleCentroid(i) - centExtent.pMin) / extentSize) >> (30 - 3 * OutOfCoreGridBits);
+	};
+
+	// Count, then turn the counts into each cell's first position along the curve. Cells are
+	// packed into chunks greedily, and a cell bigger than a chunk is cut into several
+	std::vector<size_t> cellStart(size_t(1) << (3 * OutOfCoreGridBits), 0);
+	for (size_t i = 0; i < nPrims; i++)
+		cellStart[cellIndex(i)]++;
+
+	std::vector<size_t> chunkStarts = { 0 };
+	size_t position = 0, chunkFill = 0;
+	for (auto& cell : cellStart)
+	{
+		size_t count = cell;
+		cell = position;
+		if (count == 0)
+			continue;
+		if (chunkFill > 0 && chunkFill + count > chunkPrims)
+		{
+			chunkStarts.push_back(position);
+			chunkFill = 0;
+		}
+		while (chunkFill + count > chunkPrims)
+		{
+			size_t taken = chunkPrims - chunkFill;
+			position += taken;
+			count -= taken;
+			chunkStarts.push_back(position);
+			chunkFill = 0;
+		}
+		chunkFill += count;
+		position += count;
+	}
+	int nChunks = chunkStarts.size();
+	chunkStarts.push_back(nPrims);
+
+	auto tmpDir = File::temp_directory_path() / ("bvh-" + std::to_string(std::random_device()()));
+	File::create_directories(tmpDir);
+	// Chunk files go away however the build ends. Error::check aborts without unwinding, so
+	// failed I/O checks remove them before reporting
+	struct TempDirGuard
+	{
+		File::path path;
+		void remove()
+		{
+			std::error_code err;
+			File::remove_all(path, err);
+		}
+		~TempDirGuard() { remove(); }
+	} tmpDirGuard{ tmpDir };
+	auto checkIO = [&](bool good, const std::string& errMsg)
+	{
+		if (!good)
+			tmpDirGuard.remove();
+		Error::check(good, errMsg);
+	};
+	auto chunkPath = [&](int chunk, const char* ext) { return tmpDir / (std::to_string(chunk) + ext); };
+
+	// A quarter of the budget goes to write buffers, split across the chunks
+	size_t bufferSize = std::max<size_t>(memoryBudget / 4 / (nChunks * sizeof(ChunkTriangle)), 256);
+	std::vector<std::vector<ChunkTriangle>> buffers(nChunks);
+	auto flush = [&](int chunk)
+	{
+		std::ofstream file(chunkPath(chunk, ".tri"), std::ios::binary | std::ios::app);
+		file.write(reinterpret_cast<const char*>(buffers[chunk].data()), sizeof(ChunkTriangle) * buffers[chunk].size());
+		checkIO(file.good(), "[BVH] unable to write out-of-core chunk to " + tmpDir.generic_string());
+		buffers[chunk].clear();
+	};
+
+	for (size_t i = 0; i < nPrims; i++)
+	{
+		size_t slot = cellStart[cellIndex(i)]++;
+		int chunk = std::upper_bound(chunkStarts.begin(), chunkStarts.end(), slot) - chunkStarts.begin() - 1;
+		ChunkTriangle tri = { { vertices[indices[i * 3 + 0]], vertices[indices[i * 3 + 1]], vertices[indices[i * 3 + 2]] },
+			static_cast<uint32_t>(i) };
+		buffers[chunk].push_back(tri);
+		if (buffers[chunk].size() >= bufferSize)
+			flush(chunk);
+	}
+	for (int chunk = 0; chunk < nChunks; chunk++)
+	{
+		if (!buffers[chunk].empty())
+			flush(chunk);
+	}
+	std::vector<std::vector<ChunkTriangle>>().swap(buffers);
+	std::vector<size_t>().swap(cellStart);
+	std::vector<glm::vec3>().swap(vertices);
+	std::vector<uint32_t>().swap(indices);
+	double partitionTime = timer.get() * 1e-9;
+
+	Error::bracketLine<1>("Out-of-core build over " + std::to_string(nChunks) + " chunks of up to " +
+		std::to_string(chunkPrims) + " triangles, partitioned in " + std::to_string(partitionTime) + " s");
+
+	// Subtrees go back to disk as bounds, sizeIndices and primOrder already in input indices
+	struct Subtree
+	{
+		AABB bound;
+		int treeSize;
+		int primCount;
+	};
+	std::vector<Subtree> subtrees(nChunks);
+	BVHBuildParam chunkParam = param;
+	chunkParam.memoryBudget = 0;
+	chunkParam.wideWidth = 0;
+
+	for (int chunk = 0; chunk < nChunks; chunk++)
+	{
+		int count = chunkStarts[chunk + 1] - chunkStarts[chunk];
+		std::vector<ChunkTriangle> tris(count);
+		{
+			std::ifstream file(chunkPath(chunk, ".tri"), std::ios::binary);
+			file.read(reinterpret_cast<char*>(tris.data()), sizeof(ChunkTriangle) * count);
+			checkIO(file.good(), "[BVH] unable to read out-of-core chunk from " + tmpDir.generic_string());
+		}
+		File::remove(chunkPath(chunk, ".tri"));
+
+		std::vector<glm::vec3> chunkVertices(count * 3);
+		std::vector<uint32_t> chunkIndices(count * 3);
+		for (int i = 0; i < count; i++)
+			std::copy(tris[i].v, tris[i].v + 3, chunkVertices.begin() + i * 3);
+		std::iota(chunkIndices.begin(), chunkIndices.end(), 0);
+
+		auto packed = BVH(std::move(chunkVertices), std::move(chunkIndices), chunkParam).build();
+		for (auto& prim : packed.primOrder)
+			prim = tris[prim].index;
+		stats.numThreads = packed.stats.numThreads;
+
+		int chunkTreeSize = packed.bounds.size();
+		std::ofstream file(chunkPath(chunk, ".bvh"), std::ios::binary);
+		file.write(reinterpret_cast<const char*>(packed.bounds.data()), sizeof(AABB) * chunkTreeSize);
+		file.write(reinterpret_cast<const char*>(packed.hitTable.data()), sizeof(int) * chunkTreeSize);
+		file.write(reinterpret_cast<const char*>(packed.primOrder.data()), sizeof(int) * count);
+		checkIO(file.good(), "[BVH] unable to write out-of-core subtree to " + tmpDir.generic_string());
+		subtrees[chunk] = { packed.bounds[0], chunkTreeSize, count };
+	}
+
+	std::vector<AABB> chunkBounds(nChunks);
+	for (int chunk = 0; chunk < nChunks; chunk++)
+		chunkBounds[chunk] = subtrees[chunk].bound;
+	BVHBuildParam topParam;
+	topParam.method = BVHBuildParam::Standard;
+	topParam.numThreads = 1;
+	topParam.wideWidth = 0;
+	topParam.maxLeafSize = 1;
+	auto top = BVH(chunkBounds, topParam).build();
+	const int* topSizeIndices = top.hitTable.data();
+	int topSize = top.bounds.size();
+
+	// Stitched sizes bottom-up; the top tree is pre-order, so children follow their parent
+	std::vector<int> stitchedSize(topSize);
+	for (int k = topSize - 1; k >= 0; k--)
+	{
+		if (topSizeIndices[k] & BVH_LEAF_MASK)
+		{
+			stitchedSize[k] = subtrees[bvhLeafFirst(topSizeIndices[k])].treeSize;
+			continue;
+		}
+		int rch = k + 1 + ((topSizeIndices[k + 1] & BVH_LEAF_MASK) ? 1 : topSizeIndices[k + 1]);
+		stitchedSize[k] = 1 + stitchedSize[k + 1] + stitchedSize[rch];
+	}
+
+	// Chunks take their triangle ranges in the order the top tree reaches them
+	treeSize = stitchedSize[0];
+	bounds.resize(treeSize);
+	sizeIndices.resize(treeSize);
+	primOrder.resize(nPrims);
+	size_t offset = 0;
+	int primBase = 0;
+	for (int k = 0; k < topSize; k++)
+	{
+		if (!(topSizeIndices[k] & BVH_LEAF_MASK))
+		{
+			bounds[offset] = top.bounds[k];
+			sizeIndices[offset] = stitchedSize[k];
+			offset++;
+			continue;
+		}
+		const auto& subtree = subtrees[bvhLeafFirst(topSizeIndices[k])];
+		auto path = chunkPath(bvhLeafFirst(topSizeIndices[k]), ".bvh");
+		{
+			std::ifstream file(path, std::ios::binary);
+			file.read(reinterpret_cast<char*>(bounds.data() + offset), sizeof(AABB) * subtree.treeSize);
+			file.read(reinterpret_cast<char*>(sizeIndices.data() + offset), sizeof(int) * subtree.treeSize);
+			file.read(reinterpret_cast<char*>(primOrder.data() + primBase), sizeof(int) * subtree.primCount);
+			checkIO(file.good(), "[BVH] unable to read out-of-core subtree from " + tmpDir.generic_string());
+		}
+		File::remove(path);
+
+		for (size_t i = offset; i < offset + subtree.treeSize; i++)
+		{
+			if (sizeIndices[i] & BVH_LEAF_MASK)
+				sizeIndices[i] += primBase;
+		}
+		offset += subtree.treeSize;
+		primBase += subtree.primCount;
+	}
+
+	stats.buildTime = timer.get() * 1e-9;
+	stats.sahCost = computeSAHCost();
+	Error::bracketLine<1>("Out-of-core build " + std::to_string(stats.buildTime) + " s, " + std::to_string(nPrims) +
+		" triangles, " + std::to_string(treeSize) + " nodes, SAH cost " + std::to_string(stats.sahCost));
+
+	buildHitTable();
+	stats.bytesPerTriangle = static_cast<float>(bounds.size() * sizeof(AABB) + hitTable.size() * sizeof(int)) / nPrims;
+	stats.bytesPerTriangleUncompressed = static_cast<float>(treeSize * (sizeof(AABB) + 18 * sizeof(int))) / nPrims;
+
+	PackedWideBVH wide;
+	if (param.wideWidth > 0)
+	{
+		wide = WideBVH(bounds, sizeIndices, param.wideWidth).collapse();
+		Error::bracketLine<1>("BVH" + std::to_string(wide.width) + " collapsed to " + std::to_string(wide.nodeCount) +
+			" nodes, depth " + std::to_string(wide.maxDepth));
+	}
+	return PackedBVH{ bounds, hitTable, primOrder, stats, wide };
+}
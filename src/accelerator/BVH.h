@@ -1,19 +1,60 @@
 #pragma once
 
+#include <array>
 #include <vector>
 #include <memory>
 #include <stack>
 
 #include "AABB.h"
+#include "WideBVH.h"
 #include "../core/Buffer.h"
 #include "../core/Model.h"
+#include "../util/ThreadPool.h"
 
 const int BVH_LEAF_MASK = 0x80000000;
 
+// Leaves hold BVH_LEAF_MASK | (count - 1) << BVH_LEAF_SIZE_SHIFT | first, a range of
+// PackedBVH::primOrder
+const int BVH_LEAF_SIZE_SHIFT = 28;
+const int BVH_LEAF_FIRST_MASK = (1 << BVH_LEAF_SIZE_SHIFT) - 1;
+const int BVH_MAX_LEAF_SIZE = 8;
+
+inline int bvhLeafFirst(int nodeInfo) { return nodeInfo & BVH_LEAF_FIRST_MASK; }
+inline int bvhLeafCount(int nodeInfo) { return ((nodeInfo >> BVH_LEAF_SIZE_SHIFT) & (BVH_MAX_LEAF_SIZE - 1)) + 1; }
+
+struct BVHBuildParam
+{
+	enum { Standard = 0, Quick, Linear, LinearGPU, Spatial };
+
+	int method = Quick;
+	int numThreads = 0;	// 0 for all hardware threads
+	bool validate = false;	// LinearGPU: compare SAH cost against the CPU linear build
+	bool compareQuick = false;	// Spatial: also run an untimed QuickBuild to log the SAH cost gained
+	int wideWidth = 0;	// 4 or 8 to collapse into a wide BVH, 0 to skip
+	int maxLeafSize = 4;	// Up to BVH_MAX_LEAF_SIZE, leaves are merged where SAH favours them
+	int treeletPasses = 0;	// Treelet restructuring passes after a CPU build, 0 to skip
+	float spatialBudget = 0.3f;	// Spatial: extra references allowed, as a fraction of the triangle count
+	float refitThreshold = 1.5f;	// Rebuild once a refitted tree degrades past this ratio, see nodeAreaRatio
+	int memoryBudget = 0;	// MiB of build working set; larger meshes are built out of core, 0 for no limit
+};
+
+struct BVHStatistics
+{
+	double buildTime = 0.0;
+	int numThreads = 0;
+	int cachedTrees = 0;	// Trees mapped from a BVHCache instead of built; numThreads covers the rest
+	float sahCost = 0.0f;
+	float bytesPerTriangle = 0.0f;
+	float bytesPerTriangleUncompressed = 0.0f;	// Six full (node, prim, miss) threadings
+};
+
 struct PackedBVH
 {
 	std::vector<AABB> bounds;
 	std::vector<int> hitTable;
+	std::vector<int> primOrder;	// Leaf order to input primitive; triangles should be stored this way
+	BVHStatistics stats;
+	PackedWideBVH wide;
 };
 
 struct PrimInfo
@@ -23,26 +64,62 @@ struct PrimInfo
 	int index;
 };
 
+struct BuildRec
+{
+	int offset;
+	AABB nodeExtent;
+	int splitDim;
+	int lRange;
+	int rRange;
+};
+
 class BVH
 {
 public:
-	BVH(const std::vector<glm::vec3>& vertices, const std::vector<uint32_t>& indices) :
-		vertices(vertices), indices(indices) {}
+	// Takes the mesh by value so callers done with it can move it in instead of copying
+	BVH(std::vector<glm::vec3> vertices, std::vector<uint32_t> indices,
+		const BVHBuildParam& param = BVHBuildParam()) :
+		vertices(std::move(vertices)), indices(std::move(indices)), param(param) {}
+
+	// Builds over arbitrary boxes instead of triangles, e.g. instance bounds for a TLAS
+	BVH(const std::vector<AABB>& primBounds, const BVHBuildParam& param = BVHBuildParam()) :
+		primBounds(primBounds), param(param) {}
 
 	PackedBVH build();
 
+	// Recomputes node bounds bottom-up over new primitive bounds, keeping the topology
+	static void refit(PackedBVH& bvh, const std::vector<AABB>& primBounds);
+
+	// Total node area over total leaf area. Unlike the SAH cost it is not normalized by the
+	// root, so it keeps growing as refits stretch interior nodes and can be compared with
+	// the value right after the build
+	static float nodeAreaRatio(const PackedBVH& bvh);
+
 private:
 	void standardBuild(const AABB& rootExtent);
-	void quickBuild(const AABB& rootExtent);
+	void quickBuild(const AABB& rootExtent, ThreadPool& pool);
+	void quickBuildSubtree(const BuildRec& rootRec, ThreadPool& pool);
+	void linearBuild(const AABB& rootExtent, ThreadPool& pool);
+	template<typename KeyType> void linearBuild(const AABB& rootExtent, ThreadPool& pool);
+	void spatialBuild(const AABB& rootBox);
+	PackedBVH outOfCoreBuild();
+	void restructureTreelets(ThreadPool& pool);
+	void collapseLeaves();
+	float computeSAHCost() const;
 	void buildHitTable();
 
 private:
 	std::vector<glm::vec3> vertices;
 	std::vector<uint32_t> indices;
+	std::vector<AABB> primBounds;
 	std::vector<PrimInfo> primInfo;
+	std::array<std::vector<float>, 3> centroids;	// SoA copy of primInfo centroids, kept during quickBuild
 	std::vector<AABB> bounds;
 	std::vector<int> sizeIndices;
 	std::vector<int> hitTable;
+	std::vector<int> primOrder;
 	size_t treeSize = 0;
+	BVHBuildParam param;
+	BVHStatistics stats;
 };
 
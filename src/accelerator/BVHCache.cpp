@@ -0,0 +1,197 @@
+#include "BVHCache.h"
+#include "../util/Error.h"
+#include "../util/Timer.h"
+
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+// Bump whenever the packed layout or any builder's output changes
+const uint32_t BVHCacheVersion = 2;
+const char BVHCacheMagic[4] = { 'Z', 'B', 'V', 'H' };
+
+struct BVHCacheHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint64_t key;
+	int32_t treeSize;
+	int32_t primCount;
+	int32_t wideWidth;
+	int32_t wideNodeCount;
+	int32_t wideMaxDepth;
+	float sahCost;
+	float bytesPerTriangle;
+	float bytesPerTriangleUncompressed;
+};
+
+// Arrays follow the header in this order, all 4-byte aligned
+size_t payloadSize(const BVHCacheHeader& header)
+{
+	size_t wideSlots = static_cast<size_t>(header.wideNodeCount) * header.wideWidth;
+	return sizeof(AABB) * header.treeSize + sizeof(int) * 6 * header.treeSize +
+		sizeof(int) * header.primCount + sizeof(glm::vec3) * 2 * wideSlots + sizeof(int) * wideSlots;
+}
+
+uint64_t hashBytes(const void* data, size_t size, uint64_t hash)
+{
+	// FNV-1a over 64-bit words, then the tail bytes
+	const uint64_t Prime = 0x100000001b3ull;
+	auto bytes = reinterpret_cast<const uint8_t*>(data);
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8)
+	{
+		uint64_t word;
+		std::memcpy(&word, bytes + i, 8);
+		hash = (hash ^ word) * Prime;
+	}
+	for (; i < size; i++)
+		hash = (hash ^ bytes[i]) * Prime;
+	return hash;
+}
+
+PackedBVHView PackedBVHView::fromPacked(const PackedBVH& bvh)
+{
+	PackedBVHView view;
+	view.treeSize = bvh.bounds.size();
+	view.primCount = bvh.primOrder.size();
+	view.bounds = bvh.bounds.data();
+	view.hitTable = bvh.hitTable.data();
+	view.primOrder = bvh.primOrder.data();
+	view.wideWidth = bvh.wide.width;
+	view.wideNodeCount = bvh.wide.nodeCount;
+	view.wideMaxDepth = bvh.wide.maxDepth;
+	view.wideBounds = bvh.wide.bounds.data();
+	view.wideChildren = bvh.wide.children.data();
+	view.stats = bvh.stats;
+	return view;
+}
+
+uint64_t BVHCache::key(const std::vector<glm::vec3>& vertices, const std::vector<uint32_t>& indices,
+	const BVHBuildParam& param)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	hash = hashBytes(&BVHCacheVersion, sizeof(BVHCacheVersion), hash);
+	hash = hashBytes(vertices.data(), vertices.size() * sizeof(glm::vec3), hash);
+	hash = hashBytes(indices.data(), indices.size() * sizeof(uint32_t), hash);
+
+	// Thread count is left out on purpose: every builder gives the same tree for any of them
+	int32_t params[] = { param.method, param.wideWidth, param.maxLeafSize, param.treeletPasses, param.memoryBudget };
+	hash = hashBytes(params, sizeof(params), hash);
+	if (param.method == BVHBuildParam::Spatial)
+		hash = hashBytes(&param.spatialBudget, sizeof(float), hash);
+
+	// FNV barely mixes the last words into the low bits, finish with a murmur-style avalanche
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdull;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ull;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+File::path BVHCache::filePath(uint64_t key) const
+{
+	std::stringstream ss;
+	ss << std::hex << std::setw(16) << std::setfill('0') << key << ".bvh";
+	return mDirectory / ss.str();
+}
+
+std::optional<PackedBVHView> BVHCache::load(uint64_t key) const
+{
+	auto path = filePath(key);
+	if (!File::exists(path))
+		return std::nullopt;
+
+	Timer timer;
+	auto file = std::make_shared<MappedFile>(path);
+	if (!file->valid() || file->size() < sizeof(BVHCacheHeader))
+		return std::nullopt;
+
+	BVHCacheHeader header;
+	std::memcpy(&header, file->data(), sizeof(header));
+	if (std::memcmp(header.magic, BVHCacheMagic, 4) != 0 || header.version != BVHCacheVersion || header.key != key ||
+		file->size() != sizeof(BVHCacheHeader) + payloadSize(header))
+	{
+		Error::bracketLine<1>("BVH cache " + path.generic_string() + " is stale or damaged, rebuilding");
+		return std::nullopt;
+	}
+
+	auto data = reinterpret_cast<const uint8_t*>(file->data()) + sizeof(BVHCacheHeader);
+	size_t wideSlots = static_cast<size_t>(header.wideNodeCount) * header.wideWidth;
+
+	PackedBVHView view;
+	view.treeSize = header.treeSize;
+	view.primCount = header.primCount;
+	view.bounds = reinterpret_cast<const AABB*>(data);
+	data += sizeof(AABB) * header.treeSize;
+	view.hitTable = reinterpret_cast<const int*>(data);
+	data += sizeof(int) * 6 * header.treeSize;
+	view.primOrder = reinterpret_cast<const int*>(data);
+	data += sizeof(int) * header.primCount;
+	view.wideWidth = header.wideWidth;
+	view.wideNodeCount = header.wideNodeCount;
+	view.wideMaxDepth = header.wideMaxDepth;
+	view.wideBounds = reinterpret_cast<const glm::vec3*>(data);
+	data += sizeof(glm::vec3) * 2 * wideSlots;
+	view.wideChildren = reinterpret_cast<const int*>(data);
+
+	view.stats.sahCost = header.sahCost;
+	view.stats.bytesPerTriangle = header.bytesPerTriangle;
+	view.stats.bytesPerTriangleUncompressed = header.bytesPerTriangleUncompressed;
+	view.stats.buildTime = timer.get() * 1e-9;
+	view.stats.cachedTrees = 1;
+	view.file = file;
+
+	Error::bracketLine<1>("BVH cache hit " + path.generic_string() + ", " + std::to_string(header.primCount) +
+		" triangles mapped in " + std::to_string(view.stats.buildTime) + " s");
+	return view;
+}
+
+void BVHCache::store(uint64_t key, const PackedBVH& bvh) const
+{
+	std::error_code err;
+	File::create_directories(mDirectory, err);
+	auto path = filePath(key);
+
+	BVHCacheHeader header;
+	std::memcpy(header.magic, BVHCacheMagic, 4);
+	header.version = BVHCacheVersion;
+	header.key = key;
+	header.treeSize = bvh.bounds.size();
+	header.primCount = bvh.primOrder.size();
+	header.wideWidth = bvh.wide.width;
+	header.wideNodeCount = bvh.wide.nodeCount;
+	header.wideMaxDepth = bvh.wide.maxDepth;
+	header.sahCost = bvh.stats.sahCost;
+	header.bytesPerTriangle = bvh.stats.bytesPerTriangle;
+	header.bytesPerTriangleUncompressed = bvh.stats.bytesPerTriangleUncompressed;
+
+	// Written under a temporary name first so an interrupted write never looks valid
+	auto tmpPath = path;
+	tmpPath += ".tmp";
+	{
+		std::ofstream file(tmpPath, std::ios::binary);
+		if (!file)
+		{
+			Error::bracketLine<1>("Unable to write BVH cache " + path.generic_string());
+			return;
+		}
+		auto write = [&](const void* data, size_t size) { file.write(reinterpret_cast<const char*>(data), size); };
+		write(&header, sizeof(header));
+		write(bvh.bounds.data(), sizeof(AABB) * bvh.bounds.size());
+		write(bvh.hitTable.data(), sizeof(int) * bvh.hitTable.size());
+		write(bvh.primOrder.data(), sizeof(int) * bvh.primOrder.size());
+		write(bvh.wide.bounds.data(), sizeof(glm::vec3) * bvh.wide.bounds.size());
+		write(bvh.wide.children.data(), sizeof(int) * bvh.wide.children.size());
+		if (!file)
+		{
+			Error::bracketLine<1>("Unable to write BVH cache " + path.generic_string());
+			return;
+		}
+	}
+	File::rename(tmpPath, path, err);
+	if (err)
+		Error::bracketLine<1>("Unable to write BVH cache " + path.generic_string() + ": " + err.message());
+}
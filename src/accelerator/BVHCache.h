@@ -0,0 +1,48 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+
+#include "BVH.h"
+#include "../util/File.h"
+#include "../util/MappedFile.h"
+
+// Read-only view of a packed BVH, pointing either into a PackedBVH or into a mapped
+// cache file, so both can be uploaded the same way without copying
+struct PackedBVHView
+{
+	int treeSize = 0;
+	int primCount = 0;
+	const AABB* bounds = nullptr;
+	const int* hitTable = nullptr;
+	const int* primOrder = nullptr;
+	int wideWidth = 0;
+	int wideNodeCount = 0;
+	int wideMaxDepth = 0;
+	const glm::vec3* wideBounds = nullptr;
+	const int* wideChildren = nullptr;
+	BVHStatistics stats;
+	MappedFilePtr file;
+
+	static PackedBVHView fromPacked(const PackedBVH& bvh);
+};
+
+// Built BVHs on disk, one versioned file per key. The key covers the geometry and every
+// build parameter that changes the result, so a stale file is never picked up
+class BVHCache
+{
+public:
+	BVHCache(const File::path& directory) : mDirectory(directory) {}
+
+	static uint64_t key(const std::vector<glm::vec3>& vertices, const std::vector<uint32_t>& indices,
+		const BVHBuildParam& param);
+
+	std::optional<PackedBVHView> load(uint64_t key) const;
+	void store(uint64_t key, const PackedBVH& bvh) const;
+
+private:
+	File::path filePath(uint64_t key) const;
+
+private:
+	File::path mDirectory;
+};
@@ -0,0 +1,520 @@
+#include "BVHIntersector.h"
+
+#include <cmath>
+#include <cstring>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define BVH_INTERSECTOR_AVX
+#define BVH_INTERSECTOR_SSE
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BVH_INTERSECTOR_SSE
+#endif
+
+// Lanes of the box and triangle tests: several triangles against one ray, or one box or
+// triangle against a packet of rays. Comparisons give all-ones masks; signOf and flipSign
+// move the sign of one value onto another so the determinant can be made positive without
+// branching
+namespace
+{
+#if defined(BVH_INTERSECTOR_AVX)
+	struct Lanes
+	{
+		static const int Width = 8;
+		__m256 v;
+
+		static Lanes load(const float* p) { return { _mm256_loadu_ps(p) }; }
+		static Lanes set(float x) { return { _mm256_set1_ps(x) }; }
+		static Lanes index() { return { _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f) }; }
+	};
+
+	inline Lanes operator + (Lanes a, Lanes b) { return { _mm256_add_ps(a.v, b.v) }; }
+	inline Lanes operator - (Lanes a, Lanes b) { return { _mm256_sub_ps(a.v, b.v) }; }
+	inline Lanes operator * (Lanes a, Lanes b) { return { _mm256_mul_ps(a.v, b.v) }; }
+	inline Lanes operator / (Lanes a, Lanes b) { return { _mm256_div_ps(a.v, b.v) }; }
+	inline Lanes operator < (Lanes a, Lanes b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+	inline Lanes operator <= (Lanes a, Lanes b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; }
+	inline Lanes operator & (Lanes a, Lanes b) { return { _mm256_and_ps(a.v, b.v) }; }
+	inline Lanes min(Lanes a, Lanes b) { return { _mm256_min_ps(a.v, b.v) }; }
+	inline Lanes max(Lanes a, Lanes b) { return { _mm256_max_ps(a.v, b.v) }; }
+	inline Lanes signOf(Lanes a) { return { _mm256_and_ps(a.v, _mm256_set1_ps(-0.0f)) }; }
+	inline Lanes flipSign(Lanes a, Lanes sign) { return { _mm256_xor_ps(a.v, sign.v) }; }
+	inline int laneMask(Lanes a) { return _mm256_movemask_ps(a.v); }
+	inline void store(float* p, Lanes a) { _mm256_storeu_ps(p, a.v); }
+#elif defined(BVH_INTERSECTOR_SSE)
+	struct Lanes
+	{
+		static const int Width = 4;
+		__m128 v;
+
+		static Lanes load(const float* p) { return { _mm_loadu_ps(p) }; }
+		static Lanes set(float x) { return { _mm_set1_ps(x) }; }
+		static Lanes index() { return { _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f) }; }
+	};
+
+	inline Lanes operator + (Lanes a, Lanes b) { return { _mm_add_ps(a.v, b.v) }; }
+	inline Lanes operator - (Lanes a, Lanes b) { return { _mm_sub_ps(a.v, b.v) }; }
+	inline Lanes operator * (Lanes a, Lanes b) { return { _mm_mul_ps(a.v, b.v) }; }
+	inline Lanes operator / (Lanes a, Lanes b) { return { _mm_div_ps(a.v, b.v) }; }
+	inline Lanes operator < (Lanes a, Lanes b) { return { _mm_cmplt_ps(a.v, b.v) }; }
+	inline Lanes operator <= (Lanes a, Lanes b) { return { _mm_cmple_ps(a.v, b.v) }; }
+	inline Lanes operator & (Lanes a, Lanes b) { return { _mm_and_ps(a.v, b.v) }; }
+	inline Lanes min(Lanes a, Lanes b) { return { _mm_min_ps(a.v, b.v) }; }
+	inline Lanes max(Lanes a, Lanes b) { return { _mm_max_ps(a.v, b.v) }; }
+	inline Lanes signOf(Lanes a) { return { _mm_and_ps(a.v, _mm_set1_ps(-0.0f)) }; }
+	inline Lanes flipSign(Lanes a, Lanes sign) { return { _mm_xor_ps(a.v, sign.v) }; }
+	inline int laneMask(Lanes a) { return _mm_movemask_ps(a.v); }
+	inline void store(float* p, Lanes a) { _mm_storeu_ps(p, a.v); }
+#else
+	// Plain loops for other targets, left for the compiler to vectorize. Masks are 1 or 0,
+	// signs are 1 or -1
+	struct Lanes
+	{
+		static const int Width = 4;
+		float v[4];
+
+		static Lanes load(const float* p) { Lanes r; std::memcpy(r.v, p, sizeof(r.v)); return r; }
+		static Lanes set(float x) { return { { x, x, x, x } }; }
+		static Lanes index() { return { { 0.0f, 1.0f, 2.0f, 3.0f } }; }
+	};
+
+	template<typename Op>
+	inline Lanes perLane(Lanes a, Lanes b, Op op)
+	{
+		Lanes r;
+		for (int i = 0; i < Lanes::Width; i++)
+			r.v[i] = op(a.v[i], b.v[i]);
+		return r;
+	}
+
+	inline Lanes operator + (Lanes a, Lanes b) { return perLane(a, b, [](float x, float y) { return x + y; }); }
+	inline Lanes operator - (Lanes a, Lanes b) { return perLane(a, b, [](float x, float y) { return x - y; }); }
+	inline Lanes operator * (Lanes a, Lanes b) { return perLane(a, b, [](float x, float y) { return x * y; }); }
+	inline Lanes operator / (Lanes a, Lanes b) { return perLane(a, b, [](float x, float y) { return x / y; }); }
+	inline Lanes operator < (Lanes a, Lanes b) { return perLane(a, b, [](float x, float y) { return x < y ? 1.0f : 0.0f; }); }
+	inline Lanes operator <= (Lanes a, Lanes b) { return perLane(a, b, [](float x, float y) { return x <= y ? 1.0f : 0.0f; }); }
+	inline Lanes operator & (Lanes a, Lanes b) { return a * b; }
+	inline Lanes min(Lanes a, Lanes b) { return perLane(a, b, [](float x, float y) { return std::min(x, y); }); }
+	inline Lanes max(Lanes a, Lanes b) { return perLane(a, b, [](float x, float y) { return std::max(x, y); }); }
+	inline Lanes signOf(Lanes a) { return perLane(a, a, [](float x, float) { return x < 0.0f ? -1.0f : 1.0f; }); }
+	inline Lanes flipSign(Lanes a, Lanes sign) { return a * sign; }
+	inline void store(float* p, Lanes a) { std::memcpy(p, a.v, sizeof(a.v)); }
+
+	inline int laneMask(Lanes a)
+	{
+		int mask = 0;
+		for (int i = 0; i < Lanes::Width; i++)
+			mask |= (a.v[i] != 0.0f) << i;
+		return mask;
+	}
+#endif
+
+	// Same face numbering as cubemapFace in math.glsl
+	int cubemapFace(const glm::vec3& dir)
+	{
+		glm::vec3 v = glm::abs(dir);
+		int maxDim = (v.x > v.y) ? (v.x > v.z ? 0 : 2) : (v.y > v.z ? 1 : 2);
+		return maxDim * 2 + (dir[maxDim] > 0.0f ? 0 : 1);
+	}
+
+	// Near-zero direction components are nudged instead of special-cased like boxHit does,
+	// which keeps the slab test free of NaNs from 0 * inf
+	glm::vec3 safeInverse(const glm::vec3& dir)
+	{
+		const float eps = 1e-12f;
+		glm::vec3 inv;
+		for (int i = 0; i < 3; i++)
+			inv[i] = 1.0f / (std::abs(dir[i]) < eps ? std::copysign(eps, dir[i]) : dir[i]);
+		return inv;
+	}
+
+	int countLanes(int mask)
+	{
+		int count = 0;
+		for (; mask != 0; mask &= mask - 1)
+			count++;
+		return count;
+	}
+
+	struct LaneTriangle
+	{
+		Lanes ax, ay, az;
+		Lanes bx, by, bz;	// b - a
+		Lanes cx, cy, cz;	// c - a
+	};
+
+	struct LaneRay
+	{
+		Lanes ox, oy, oz;
+		Lanes dx, dy, dz;
+	};
+
+	// Möller-Trumbore, branch-free until the hit mask is known. The tests and epsilon follow
+	// intersectTriangle in intersection.glsl; u and v come back scaled by det
+	inline Lanes triangleHit(const LaneTriangle& tri, const LaneRay& ray, Lanes dist, Lanes& t, Lanes& u, Lanes& v, Lanes& det)
+	{
+		const Lanes eps = Lanes::set(1e-6f);
+		const Lanes zero = Lanes::set(0.0f);
+
+		// p = cross(d, ac), det = dot(ab, p)
+		Lanes px = ray.dy * tri.cz - ray.dz * tri.cy;
+		Lanes py = ray.dz * tri.cx - ray.dx * tri.cz;
+		Lanes pz = ray.dx * tri.cy - ray.dy * tri.cx;
+		det = tri.bx * px + tri.by * py + tri.bz * pz;
+		Lanes sign = signOf(det);
+		det = flipSign(det, sign);
+
+		Lanes aox = ray.ox - tri.ax, aoy = ray.oy - tri.ay, aoz = ray.oz - tri.az;
+		u = flipSign(aox * px + aoy * py + aoz * pz, sign);
+
+		// q = cross(ao, ab); v and t flip with ao
+		Lanes qx = aoy * tri.bz - aoz * tri.by;
+		Lanes qy = aoz * tri.bx - aox * tri.bz;
+		Lanes qz = aox * tri.by - aoy * tri.bx;
+		v = flipSign(ray.dx * qx + ray.dy * qy + ray.dz * qz, sign);
+		t = flipSign(tri.cx * qx + tri.cy * qy + tri.cz * qz, sign) / det;
+
+		return (eps <= det) & (zero <= u) & (u <= det) & (zero <= v) & (u + v <= det) & (zero < t) & (t < dist);
+	}
+
+	// Groups pointing within this cone of their first ray go down the tree as a packet
+	const float PacketMinCosine = 0.9f;
+
+	// A packet is split into single rays once, over a window of visited nodes, fewer than this
+	// fraction of its lanes hit the boxes on average
+	const int PacketCheckInterval = 32;
+	const float PacketMinOccupancy = 0.3f;
+
+	const int BatchGrainSize = 4096;
+}
+
+const int BVHIntersector::SimdWidth = Lanes::Width;
+
+BVHIntersector::BVHIntersector(const PackedBVH& bvh, const std::vector<glm::vec3>& vertices,
+	const std::vector<uint32_t>& indices) :
+	treeSize(bvh.bounds.size()), hitTable(bvh.hitTable), primOrder(bvh.primOrder)
+{
+	nodes.resize(treeSize);
+	for (int i = 0; i < treeSize; i++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			nodes[i].pMin[j] = bvh.bounds[i].pMin[j];
+			nodes[i].pMax[j] = bvh.bounds[i].pMax[j];
+		}
+		nodes[i].pMin[3] = nodes[i].pMax[3] = 0.0f;
+	}
+
+	// The padding keeps full-width loads of the last leaf inside the arrays
+	for (auto& component : triangles)
+		component.resize(primOrder.size() + SimdWidth, 0.0f);
+
+	for (size_t i = 0; i < primOrder.size(); i++)
+	{
+		int prim = primOrder[i];
+		glm::vec3 a = vertices[indices[prim * 3 + 0]];
+		glm::vec3 b = vertices[indices[prim * 3 + 1]];
+		glm::vec3 c = vertices[indices[prim * 3 + 2]];
+		glm::vec3 ab = b - a, ac = c - a;
+		for (int j = 0; j < 3; j++)
+		{
+			triangles[j][i] = a[j];
+			triangles[3 + j][i] = ab[j];
+			triangles[6 + j][i] = ac[j];
+		}
+	}
+}
+
+RayHit BVHIntersector::intersect(const Ray& ray, float tMax) const
+{
+	RayHit hit;
+	hit.dist = tMax;
+	traverse<false>(ray, hit, 0);
+	return hit;
+}
+
+bool BVHIntersector::occluded(const Ray& ray, float tMax) const
+{
+	RayHit hit;
+	hit.dist = tMax;
+	return traverse<true>(ray, hit, 0);
+}
+
+void BVHIntersector::intersect(const std::vector<Ray>& rays, std::vector<RayHit>& hits, ThreadPool& pool, float tMax) const
+{
+	RayHit miss;
+	miss.dist = tMax;
+	hits.assign(rays.size(), miss);
+	pool.parallelFor(rays.size(), BatchGrainSize, [&](int begin, int end)
+	{
+		traceBatch<false>(rays.data() + begin, hits.data() + begin, end - begin);
+	});
+}
+
+void BVHIntersector::occluded(const std::vector<Ray>& rays, const std::vector<float>& tMax, std::vector<uint8_t>& result,
+	ThreadPool& pool) const
+{
+	result.resize(rays.size());
+	pool.parallelFor(rays.size(), BatchGrainSize, [&](int begin, int end)
+	{
+		std::vector<RayHit> hits(end - begin);
+		for (int i = begin; i < end; i++)
+			hits[i - begin].dist = tMax[i];
+		traceBatch<true>(rays.data() + begin, hits.data(), end - begin);
+		for (int i = begin; i < end; i++)
+			result[i] = hits[i - begin].prim != -1;
+	});
+}
+
+template<bool AnyHit>
+void BVHIntersector::traceBatch(const Ray* rays, RayHit* hits, int count) const
+{
+	for (int i = 0; i < count; i += Lanes::Width)
+	{
+		int packetSize = std::min(Lanes::Width, count - i);
+		int face = packetFace(rays + i, packetSize);
+		if (face != -1)
+			tracePacket<AnyHit>(rays + i, hits + i, packetSize, face);
+		else
+		{
+			for (int j = i; j < i + packetSize; j++)
+				traverse<AnyHit>(rays[j], hits[j], 0);
+		}
+	}
+}
+
+int BVHIntersector::packetFace(const Ray* rays, int count) const
+{
+	if (count < 2)
+		return -1;
+	int face = cubemapFace(-rays[0].dir);
+	for (int i = 1; i < count; i++)
+	{
+		if (cubemapFace(-rays[i].dir) != face || glm::dot(rays[i].dir, rays[0].dir) < PacketMinCosine)
+			return -1;
+	}
+	return face;
+}
+
+template<bool AnyHit>
+bool BVHIntersector::traverse(const Ray& ray, RayHit& hit, int k) const
+{
+	int face = cubemapFace(-ray.dir);
+	glm::vec3 inv = safeInverse(ray.dir);
+	bool found = false;
+
+#if defined(BVH_INTERSECTOR_SSE)
+	__m128 ori = _mm_setr_ps(ray.ori.x, ray.ori.y, ray.ori.z, 0.0f);
+	__m128 invDir = _mm_setr_ps(inv.x, inv.y, inv.z, 0.0f);
+#endif
+
+	while (k != treeSize)
+	{
+		int node = (face == 0) ? k : hitTable[face * treeSize + k];
+		int nodeInfo = hitTable[node];
+
+		// Slab test; the fourth lane is padding and left out of the reductions
+		float tNear, tFar;
+#if defined(BVH_INTERSECTOR_SSE)
+		__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(nodes[node].pMin), ori), invDir);
+		__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(nodes[node].pMax), ori), invDir);
+		__m128 vNear = _mm_min_ps(t0, t1);
+		__m128 vFar = _mm_max_ps(t0, t1);
+		__m128 nearYZ = _mm_max_ss(_mm_shuffle_ps(vNear, vNear, _MM_SHUFFLE(1, 1, 1, 1)),
+			_mm_shuffle_ps(vNear, vNear, _MM_SHUFFLE(2, 2, 2, 2)));
+		__m128 farYZ = _mm_min_ss(_mm_shuffle_ps(vFar, vFar, _MM_SHUFFLE(1, 1, 1, 1)),
+			_mm_shuffle_ps(vFar, vFar, _MM_SHUFFLE(2, 2, 2, 2)));
+		tNear = _mm_cvtss_f32(_mm_max_ss(vNear, nearYZ));
+		tFar = _mm_cvtss_f32(_mm_min_ss(vFar, farYZ));
+#else
+		tNear = -1e30f;
+		tFar = 1e30f;
+		for (int i = 0; i < 3; i++)
+		{
+			float t0 = (nodes[node].pMin[i] - ray.ori[i]) * inv[i];
+			float t1 = (nodes[node].pMax[i] - ray.ori[i]) * inv[i];
+			tNear = std::max(tNear, std::min(t0, t1));
+			tFar = std::min(tFar, std::max(t0, t1));
+		}
+#endif
+		if (tFar < 0.0f || tFar < tNear || tNear > hit.dist)
+		{
+			k += (nodeInfo < 0) ? 1 : nodeInfo;
+			continue;
+		}
+		if (nodeInfo < 0 && leafHit<AnyHit>(nodeInfo, ray, hit))
+		{
+			found = true;
+			if (AnyHit)
+				return true;
+		}
+		k++;
+	}
+	return found;
+}
+
+// Lanes::Width triangles of the leaf against one ray at a time
+template<bool AnyHit>
+bool BVHIntersector::leafHit(int nodeInfo, const Ray& ray, RayHit& hit) const
+{
+	int first = bvhLeafFirst(nodeInfo);
+	int end = first + bvhLeafCount(nodeInfo);
+	bool found = false;
+
+	LaneRay lanes =
+	{
+		Lanes::set(ray.ori.x), Lanes::set(ray.ori.y), Lanes::set(ray.ori.z),
+		Lanes::set(ray.dir.x), Lanes::set(ray.dir.y), Lanes::set(ray.dir.z)
+	};
+
+	for (int i = first; i < end; i += Lanes::Width)
+	{
+		LaneTriangle tri =
+		{
+			Lanes::load(&triangles[0][i]), Lanes::load(&triangles[1][i]), Lanes::load(&triangles[2][i]),
+			Lanes::load(&triangles[3][i]), Lanes::load(&triangles[4][i]), Lanes::load(&triangles[5][i]),
+			Lanes::load(&triangles[6][i]), Lanes::load(&triangles[7][i]), Lanes::load(&triangles[8][i])
+		};
+		Lanes t, u, v, det;
+		Lanes valid = (Lanes::index() < Lanes::set(static_cast<float>(end - i))) &
+			triangleHit(tri, lanes, Lanes::set(hit.dist), t, u, v, det);
+
+		int mask = laneMask(valid);
+		if (mask == 0)
+			continue;
+
+		float dists[Lanes::Width], us[Lanes::Width], vs[Lanes::Width], dets[Lanes::Width];
+		store(dists, t);
+		store(us, u);
+		store(vs, v);
+		store(dets, det);
+		for (int lane = 0; lane < Lanes::Width; lane++)
+		{
+			if (!(mask >> lane & 1) || dists[lane] >= hit.dist)
+				continue;
+			hit.dist = dists[lane];
+			hit.prim = primOrder[i + lane];
+			hit.bary = glm::vec2(us[lane], vs[lane]) / dets[lane];
+			found = true;
+			if (AnyHit)
+				return true;
+		}
+	}
+	return found;
+}
+
+// One box or triangle at a time against all rays of the packet. Rays share the face, so
+// they follow the same threading order; a box is entered when any active ray hits it and
+// the others are masked. Each ray still visits every node its own walk would, so results
+// match intersect() and occluded(). As the walk is stackless, the packet can be split into
+// single rays at any k
+template<bool AnyHit>
+void BVHIntersector::tracePacket(const Ray* rays, RayHit* hits, int count, int face) const
+{
+	float lanes[9][Lanes::Width], dists[Lanes::Width];
+	for (int i = 0; i < Lanes::Width; i++)
+	{
+		// Spare lanes repeat the last ray and stay masked
+		int ray = std::min(i, count - 1);
+		glm::vec3 inv = safeInverse(rays[ray].dir);
+		for (int j = 0; j < 3; j++)
+		{
+			lanes[j][i] = rays[ray].ori[j];
+			lanes[3 + j][i] = rays[ray].dir[j];
+			lanes[6 + j][i] = inv[j];
+		}
+		dists[i] = hits[ray].dist;
+	}
+	LaneRay packet =
+	{
+		Lanes::load(lanes[0]), Lanes::load(lanes[1]), Lanes::load(lanes[2]),
+		Lanes::load(lanes[3]), Lanes::load(lanes[4]), Lanes::load(lanes[5])
+	};
+	Lanes invX = Lanes::load(lanes[6]), invY = Lanes::load(lanes[7]), invZ = Lanes::load(lanes[8]);
+	Lanes dist = Lanes::load(dists);
+	Lanes zero = Lanes::set(0.0f);
+
+	int active = (1 << count) - 1;
+	int visited = 0, occupied = 0;
+
+	int k = 0;
+	while (k != treeSize)
+	{
+		int node = (face == 0) ? k : hitTable[face * treeSize + k];
+		int nodeInfo = hitTable[node];
+
+		const Node& box = nodes[node];
+		Lanes t0x = (Lanes::set(box.pMin[0]) - packet.ox) * invX, t1x = (Lanes::set(box.pMax[0]) - packet.ox) * invX;
+		Lanes t0y = (Lanes::set(box.pMin[1]) - packet.oy) * invY, t1y = (Lanes::set(box.pMax[1]) - packet.oy) * invY;
+		Lanes t0z = (Lanes::set(box.pMin[2]) - packet.oz) * invZ, t1z = (Lanes::set(box.pMax[2]) - packet.oz) * invZ;
+		Lanes tNear = max(max(min(t0x, t1x), min(t0y, t1y)), min(t0z, t1z));
+		Lanes tFar = min(min(max(t0x, t1x), max(t0y, t1y)), max(t0z, t1z));
+
+		int boxMask = laneMask((zero <= tFar) & (tNear <= tFar) & (tNear <= dist)) & active;
+		if (boxMask == 0)
+		{
+			k += (nodeInfo < 0) ? 1 : nodeInfo;
+			continue;
+		}
+
+		visited++;
+		occupied += countLanes(boxMask);
+		if (visited == PacketCheckInterval)
+		{
+			if (occupied < PacketMinOccupancy * PacketCheckInterval * Lanes::Width)
+			{
+				for (int lane = 0; lane < count; lane++)
+				{
+					if (active >> lane & 1)
+						traverse<AnyHit>(rays[lane], hits[lane], k);
+				}
+				return;
+			}
+			visited = occupied = 0;
+		}
+
+		if (nodeInfo < 0)
+		{
+			int first = bvhLeafFirst(nodeInfo);
+			for (int i = first; i < first + bvhLeafCount(nodeInfo); i++)
+			{
+				LaneTriangle tri =
+				{
+					Lanes::set(triangles[0][i]), Lanes::set(triangles[1][i]), Lanes::set(triangles[2][i]),
+					Lanes::set(triangles[3][i]), Lanes::set(triangles[4][i]), Lanes::set(triangles[5][i]),
+					Lanes::set(triangles[6][i]), Lanes::set(triangles[7][i]), Lanes::set(triangles[8][i])
+				};
+				Lanes t, u, v, det;
+				int mask = laneMask(triangleHit(tri, packet, dist, t, u, v, det)) & boxMask;
+				if (mask == 0)
+					continue;
+
+				float us[Lanes::Width], vs[Lanes::Width], dets[Lanes::Width];
+				store(dists, t);
+				store(us, u);
+				store(vs, v);
+				store(dets, det);
+				for (int lane = 0; lane < count; lane++)
+				{
+					if (!(mask >> lane & 1))
+						continue;
+					hits[lane].dist = dists[lane];
+					hits[lane].prim = primOrder[i];
+					hits[lane].bary = glm::vec2(us[lane], vs[lane]) / dets[lane];
+				}
+				if (AnyHit)
+				{
+					active &= ~mask;
+					boxMask &= ~mask;
+					if (active == 0)
+						return;
+				}
+				for (int lane = 0; lane < Lanes::Width; lane++)
+					dists[lane] = hits[std::min(lane, count - 1)].dist;
+				dist = Lanes::load(dists);
+			}
+		}
+		k++;
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <array>
+#include <vector>
+
+#include "BVH.h"
+
+struct Ray
+{
+	glm::vec3 ori;
+	glm::vec3 dir;
+};
+
+struct RayHit
+{
+	float dist;
+	int prim = -1;	// Input triangle index, -1 for a miss
+	glm::vec2 bary;	// Weights of the triangle's second and third vertices
+};
+
+// CPU closest-hit and occlusion queries over a triangle PackedBVH, walking the hit table the
+// same way bvhHit/bvhTest do in intersection.glsl. Each box is slab-tested in one SSE
+// register and a leaf's triangles are tested SimdWidth at a time (8 with AVX, 4 with SSE).
+// Triangles are copied into SoA arrays in leaf order with their edges precomputed, so the
+// tree and mesh may be released afterwards. Queries are const and safe from any thread
+class BVHIntersector
+{
+public:
+	static const int SimdWidth;
+
+	BVHIntersector(const PackedBVH& bvh, const std::vector<glm::vec3>& vertices, const std::vector<uint32_t>& indices);
+
+	// Closest hit with distance in (0, tMax)
+	RayHit intersect(const Ray& ray, float tMax = 1e8f) const;
+
+	// Whether anything is hit in (0, tMax), stopping at the first triangle found
+	bool occluded(const Ray& ray, float tMax) const;
+
+	// Batched versions over the pool, for camera rays, picking and shadow rays. Consecutive
+	// groups of SimdWidth rays with normalized directions in a narrow cone are traced as
+	// packets, others one by one. Results are the same as the single-ray queries
+	void intersect(const std::vector<Ray>& rays, std::vector<RayHit>& hits, ThreadPool& pool, float tMax = 1e8f) const;
+	void occluded(const std::vector<Ray>& rays, const std::vector<float>& tMax, std::vector<uint8_t>& result,
+		ThreadPool& pool) const;
+
+private:
+	struct alignas(16) Node
+	{
+		float pMin[4];
+		float pMax[4];
+	};
+
+	template<bool AnyHit> bool traverse(const Ray& ray, RayHit& hit, int k) const;
+	template<bool AnyHit> bool leafHit(int nodeInfo, const Ray& ray, RayHit& hit) const;
+	template<bool AnyHit> void traceBatch(const Ray* rays, RayHit* hits, int count) const;
+	template<bool AnyHit> void tracePacket(const Ray* rays, RayHit* hits, int count, int face) const;
+	int packetFace(const Ray* rays, int count) const;
+
+private:
+	int treeSize;
+	std::vector<Node> nodes;
+	std::vector<int> hitTable;
+	std::vector<int> primOrder;
+	std::array<std::vector<float>, 9> triangles;	// a, b - a, c - a per leaf slot, padded by SimdWidth
+};
@@ -0,0 +1,145 @@
+#include "GPUBVH.h"
+
+#include <algorithm>
+
+#include "../core/Pipeline.h"
+#include "../util/Error.h"
+#include "../util/Timer.h"
+
+const int WorkgroupSize = 256;
+const int MaxWorkgroupsX = 65535;
+
+GPUBVHBuilder::GPUBVHBuilder()
+{
+	glm::ivec3 groupSize(WorkgroupSize, 1, 1);
+	mExtentShader = Shader::createFromText("bvh/lbvh_extent.glsl", groupSize);
+	mMortonShader = Shader::createFromText("bvh/lbvh_morton.glsl", groupSize);
+	mSortShader = Shader::createFromText("bvh/lbvh_sort.glsl", groupSize);
+	mHierarchyShader = Shader::createFromText("bvh/lbvh_hierarchy.glsl", groupSize);
+	mBoundShader = Shader::createFromText("bvh/lbvh_bound.glsl", groupSize);
+	mHitTableShader = Shader::createFromText("bvh/lbvh_hit_table.glsl", groupSize);
+}
+
+GPUBVH GPUBVHBuilder::build(TextureBufferedPtr vertices, TextureBufferedPtr indices, int primBase, int nPrims,
+	BufferPtr boundOut, BufferPtr hitTableOut, int nodeBase, int hitTableSegments, bool computeSAH)
+{
+	Error::bracketLine<0>("BVH building by GPU");
+	Error::check(nPrims >= 2, "[GPUBVHBuilder] need at least two primitives");
+
+	int treeSize = nPrims * 2 - 1;
+	int sortSize = 1;
+	while (sortSize < nPrims)
+		sortSize <<= 1;
+
+	const int IntMax = 0x7fffffff;
+	std::vector<int> initExtent = { IntMax, IntMax, IntMax, -IntMax - 1, -IntMax - 1, -IntMax - 1 };
+	auto extent = TextureBuffered::createFromVector(initExtent, TextureFormat::Col1x32i);
+	auto keys = TextureBuffered::createTyped<uint32_t>(nullptr, sortSize, TextureFormat::Col1x32u);
+	auto values = TextureBuffered::createTyped<int>(nullptr, sortSize, TextureFormat::Col1x32i);
+	auto nodes = TextureBuffered::createTyped<glm::ivec4>(nullptr, treeSize, TextureFormat::Col4x32i);
+	auto parents = TextureBuffered::createTyped<int>(nullptr, treeSize, TextureFormat::Col1x32i);
+	auto visitCount = TextureBuffered::createTyped<int>(nullptr, treeSize, TextureFormat::Col1x32i);
+	visitCount->buffer()->setZero();
+
+	Error::check(boundOut->size() >= static_cast<int64_t>(sizeof(AABB)) * (nodeBase + treeSize) &&
+		hitTableOut->size() >= static_cast<int64_t>(sizeof(int)) * hitTableSegments * (nodeBase + treeSize),
+		"[GPUBVHBuilder] output buffers too small");
+
+	// Outputs are written one scalar at a time through r32 views into the scene's packed
+	// buffers at nodeBase, in the same layout BVH::build emits
+	auto boundImage = TextureBuffered::createTyped<AABB>(nullptr, treeSize, TextureFormat::Col1x32f);
+	auto orderedBoundImage = TextureBuffered::createFromBuffer(boundOut, TextureFormat::Col1x32f);
+	auto hitTableImage = TextureBuffered::createFromBuffer(hitTableOut, TextureFormat::Col1x32i);
+
+	Pipeline::bindTextureToImage(extent, 0, 0, ImageAccess::ReadWrite, TextureFormat::Col1x32i);
+	Pipeline::bindTextureToImage(keys, 1, 0, ImageAccess::ReadWrite, TextureFormat::Col1x32u);
+	Pipeline::bindTextureToImage(values, 2, 0, ImageAccess::ReadWrite, TextureFormat::Col1x32i);
+	Pipeline::bindTextureToImage(nodes, 3, 0, ImageAccess::ReadWrite, TextureFormat::Col4x32i);
+	Pipeline::bindTextureToImage(parents, 4, 0, ImageAccess::ReadWrite, TextureFormat::Col1x32i);
+	Pipeline::bindTextureToImage(visitCount, 5, 0, ImageAccess::ReadWrite, TextureFormat::Col1x32i);
+	Pipeline::bindTextureToImage(boundImage, 6, 0, ImageAccess::ReadWrite, TextureFormat::Col1x32f);
+	Pipeline::bindTextureToImage(hitTableImage, 7, 0, ImageAccess::WriteOnly, TextureFormat::Col1x32i);
+
+	for (auto shader : { mExtentShader, mMortonShader, mBoundShader })
+	{
+		shader->setTexture("uVertices", vertices, 1);
+		shader->setTexture("uIndices", indices, 4);
+	}
+	for (auto shader : { mExtentShader, mMortonShader, mBoundShader })
+		shader->set1i("uPrimBase", primBase);
+	for (auto shader : { mExtentShader, mMortonShader, mHierarchyShader, mBoundShader, mHitTableShader })
+		shader->set1i("uNumPrims", nPrims);
+	mHitTableShader->set1i("uNodeBase", nodeBase);
+	mHitTableShader->set1i("uHitTableSegments", hitTableSegments);
+	mMortonShader->set1i("uSortSize", sortSize);
+	mSortShader->set1i("uSortSize", sortSize);
+
+	glFinish();
+	Timer timer;
+
+	dispatch(mExtentShader, nPrims);
+	Pipeline::memoryBarrier(MemoryBarrierBit::ShaderImageAccess);
+	dispatch(mMortonShader, sortSize);
+	Pipeline::memoryBarrier(MemoryBarrierBit::ShaderImageAccess);
+
+	for (int stage = 2; stage <= sortSize; stage <<= 1)
+	{
+		for (int pass = stage >> 1; pass > 0; pass >>= 1)
+		{
+			mSortShader->set1i("uStage", stage);
+			mSortShader->set1i("uPass", pass);
+			dispatch(mSortShader, sortSize / 2);
+			Pipeline::memoryBarrier(MemoryBarrierBit::ShaderImageAccess);
+		}
+	}
+
+	dispatch(mHierarchyShader, nPrims);
+	Pipeline::memoryBarrier(MemoryBarrierBit::ShaderImageAccess);
+	dispatch(mBoundShader, nPrims);
+	Pipeline::memoryBarrier(MemoryBarrierBit::ShaderImageAccess);
+	// The bottom-up pass is done with the visit counters, so their unit takes the reordered bounds
+	Pipeline::bindTextureToImage(orderedBoundImage, 5, 0, ImageAccess::WriteOnly, TextureFormat::Col1x32f);
+	dispatch(mHitTableShader, treeSize);
+	Pipeline::memoryBarrier(MemoryBarrierBit::ShaderImageAccess | MemoryBarrierBit::TextureFetch);
+
+	glFinish();
+
+	GPUBVH ret;
+	ret.treeSize = treeSize;
+	boundOut->read(sizeof(AABB) * nodeBase, sizeof(AABB), &ret.rootBound);
+	ret.stats.buildTime = timer.get() * 1e-9;
+	ret.stats.numThreads = 0;
+	ret.stats.bytesPerTriangle = static_cast<float>(treeSize * (sizeof(AABB) + hitTableSegments * sizeof(int))) / nPrims;
+	ret.stats.bytesPerTriangleUncompressed = static_cast<float>(treeSize * (sizeof(AABB) + 18 * sizeof(int))) / nPrims;
+
+	if (computeSAH)
+	{
+		std::vector<AABB> bounds(treeSize);
+		boundOut->read(sizeof(AABB) * nodeBase, sizeof(AABB) * treeSize, bounds.data());
+
+		float rootArea = bounds[0].surfaceArea();
+		double sumArea = 0.0;
+		for (const auto& bound : bounds)
+			sumArea += bound.surfaceArea();
+		ret.stats.sahCost = (rootArea > 0.0f) ? static_cast<float>(sumArea / rootArea) : 0.0f;
+	}
+
+	Error::bracketLine<1>("LinearBuildGPU " + std::to_string(ret.stats.buildTime) + " s, " +
+		std::to_string(sortSize) + " sort keys" +
+		(computeSAH ? ", SAH cost " + std::to_string(ret.stats.sahCost) : ""));
+	Error::line("\t[" + std::to_string(nPrims) + " triangles, " + std::to_string(treeSize) + " nodes]");
+	return ret;
+}
+
+GPUBVHBuilderPtr GPUBVHBuilder::create()
+{
+	return std::make_shared<GPUBVHBuilder>();
+}
+
+void GPUBVHBuilder::dispatch(ShaderPtr shader, int nThreads)
+{
+	int nGroups = (nThreads + WorkgroupSize - 1) / WorkgroupSize;
+	int numX = std::min(nGroups, MaxWorkgroupsX);
+	int numY = (nGroups + numX - 1) / numX;
+	Pipeline::dispatchCompute(numX, numY, 1, shader);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <memory>
+
+#include "BVH.h"
+#include "../core/Texture.h"
+#include "../core/Shader.h"
+
+class GPUBVHBuilder;
+using GPUBVHBuilderPtr = std::shared_ptr<GPUBVHBuilder>;
+
+struct GPUBVH
+{
+	int treeSize = 0;
+	AABB rootBound;
+	BVHStatistics stats;
+};
+
+// Linear BVH built entirely with compute shaders: Morton codes, bitonic sort, Karras'
+// hierarchy emission, bottom-up bounds and the six MTBVH threadings. Builds the triangles
+// [primBase, primBase + nPrims) of the index buffer into the output buffers at nodeBase.
+// With one hit table segment only the node info is written, for short-stack traversal
+class GPUBVHBuilder
+{
+public:
+	GPUBVHBuilder();
+
+	GPUBVH build(TextureBufferedPtr vertices, TextureBufferedPtr indices, int primBase, int nPrims,
+		BufferPtr boundOut, BufferPtr hitTableOut, int nodeBase, int hitTableSegments, bool computeSAH);
+
+	static GPUBVHBuilderPtr create();
+
+private:
+	void dispatch(ShaderPtr shader, int nThreads);
+
+private:
+	ShaderPtr mExtentShader;
+	ShaderPtr mMortonShader;
+	ShaderPtr mSortShader;
+	ShaderPtr mHierarchyShader;
+	ShaderPtr mBoundShader;
+	ShaderPtr mHitTableShader;
+};
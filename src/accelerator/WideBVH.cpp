@@ -0,0 +1,115 @@
+#include "WideBVH.h"
+#include "BVH.h"
+#include "../util/Error.h"
+
+#include <queue>
+
+PackedWideBVH WideBVH::collapse()
+{
+	Error::check(width == 4 || width == 8, "[WideBVH] width must be 4 or 8");
+
+	auto isLeaf = [&](int k) { return (sizeIndices[k] & BVH_LEAF_MASK) != 0; };
+	auto rightChild = [&](int k) { return k + 1 + (isLeaf(k + 1) ? 1 : sizeIndices[k + 1]); };
+
+	PackedWideBVH ret;
+	ret.width = width;
+
+	// Nodes are emitted breadth-first, so a child's index is known when its parent is written
+	std::queue<std::pair<int, int>> queue;
+	queue.push({ 0, 1 });
+	int nodeCount = 1;
+
+	std::vector<int> slots;
+	slots.reserve(width);
+
+	while (!queue.empty())
+	{
+		auto [k, depth] = queue.front();
+		queue.pop();
+		ret.maxDepth = std::max(ret.maxDepth, depth);
+
+		slots.clear();
+		if (isLeaf(k))
+			slots.push_back(k);
+		else
+		{
+			slots.push_back(k + 1);
+			slots.push_back(rightChild(k));
+		}
+
+		// Open the interior slot with the largest surface area until the node is full
+		while (static_cast<int>(slots.size()) < width)
+		{
+			int best = -1;
+			float bestArea = -1.0f;
+			for (int i = 0; i < static_cast<int>(slots.size()); i++)
+			{
+				if (isLeaf(slots[i]))
+					continue;
+				float area = binaryBounds[slots[i]].surfaceArea();
+				if (area > bestArea)
+					best = i, bestArea = area;
+			}
+			if (best == -1)
+				break;
+			int opened = slots[best];
+			slots[best] = opened + 1;
+			slots.insert(slots.begin() + best + 1, rightChild(opened));
+		}
+
+		for (int i = 0; i < width; i++)
+		{
+			if (i >= static_cast<int>(slots.size()))
+			{
+				ret.bounds.push_back(glm::vec3(1e8f));
+				ret.bounds.push_back(glm::vec3(-1e8f));
+				ret.children.push_back(WIDE_BVH_EMPTY);
+				continue;
+			}
+			const AABB& bound = binaryBounds[slots[i]];
+			ret.bounds.push_back(bound.pMin);
+			ret.bounds.push_back(bound.pMax);
+
+			if (isLeaf(slots[i]))
+				ret.children.push_back(sizeIndices[slots[i]]);
+			else
+			{
+				ret.children.push_back(nodeCount++);
+				queue.push({ slots[i], depth + 1 });
+			}
+		}
+	}
+	ret.nodeCount = nodeCount;
+	return ret;
+}
+
+void WideBVH::refit(PackedWideBVH& wide, const std::function<AABB(int)>& leafBound)
+{
+	int width = wide.width;
+
+	// Breadth-first order puts children after their parent, so walk the nodes backwards
+	for (int n = wide.nodeCount - 1; n >= 0; n--)
+	{
+		for (int i = 0; i < width; i++)
+		{
+			int child = wide.children[n * width + i];
+			if (child == WIDE_BVH_EMPTY)
+				continue;
+
+			AABB bound;
+			if (child & BVH_LEAF_MASK)
+				bound = leafBound(child);
+			else
+			{
+				for (int j = 0; j < width; j++)
+				{
+					if (wide.children[child * width + j] == WIDE_BVH_EMPTY)
+						continue;
+					bound.expand(AABB(wide.bounds[(child * width + j) * 2 + 0], wide.bounds[(child * width + j) * 2 + 1]));
+				}
+			}
+			wide.bounds[(n * width + i) * 2 + 0] = bound.pMin;
+			wide.bounds[(n * width + i) * 2 + 1] = bound.pMax;
+		}
+	}
+}
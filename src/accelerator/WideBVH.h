@@ -0,0 +1,38 @@
+#pragma once
+
+#include <functional>
+#include <vector>
+
+#include "AABB.h"
+
+const int WIDE_BVH_EMPTY = -1;
+const int WIDE_BVH_STACK_SIZE = 64;	// Must match the traversal stack in intersection.glsl
+
+// Each node stores the bounds of its width children, two texels per child, and one
+// entry per child in children: a node index, BVH_LEAF_MASK | primIndex for a leaf,
+// or WIDE_BVH_EMPTY for an unused trailing slot
+struct PackedWideBVH
+{
+	int width = 0;
+	int nodeCount = 0;
+	int maxDepth = 0;
+	std::vector<glm::vec3> bounds;
+	std::vector<int> children;
+};
+
+class WideBVH
+{
+public:
+	WideBVH(const std::vector<AABB>& bounds, const std::vector<int>& sizeIndices, int width) :
+		binaryBounds(bounds), sizeIndices(sizeIndices), width(width) {}
+
+	PackedWideBVH collapse();
+
+	// leafBound gives the bound of a leaf child from its BVH_LEAF_MASK entry
+	static void refit(PackedWideBVH& wide, const std::function<AABB(int)>& leafBound);
+
+private:
+	const std::vector<AABB>& binaryBounds;
+	const std::vector<int>& sizeIndices;
+	int width;
+};
@@ -31,6 +31,11 @@ void Buffer::read(int64_t offset, int64_t size, void* data)
 	glGetNamedBufferSubData(mId, offset, size, data);
 }
 
+void Buffer::setZero()
+{
+	glClearNamedBufferData(mId, GL_R8UI, GL_RED_INTEGER, GL_UNSIGNED_BYTE, nullptr);
+}
+
 BufferPtr Buffer::create(int64_t size, const void* data, BufferUsage usage)
 {
 	return std::make_shared<Buffer>(size, data, usage);
@@ -31,6 +31,7 @@ public:
 	void allocate(int64_t size, const void* data, BufferUsage usage = BufferUsage::StaticDraw);
 	void write(int64_t offset, int64_t size, const void* data);
 	void read(int64_t offset, int64_t size, void* data);
+	void setZero();
 
 	template<typename T>
 	void write(int64_t offset, const T& data)
@@ -0,0 +1,603 @@
+#include "GLTFLoader.h"
+#include "../util/Json.h"
+#include "../util/MappedFile.h"
+
+#include <glm/gtc/quaternion.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <numeric>
+
+const uint32_t GLBMagic = 0x46546c67;	// "glTF"
+const uint32_t GLBChunkJSON = 0x4e4f534a;
+const uint32_t GLBChunkBIN = 0x004e4942;
+
+const int GLTFUnsignedByte = 5121;
+const int GLTFUnsignedShort = 5123;
+const int GLTFUnsignedInt = 5125;
+const int GLTFFloat = 5126;
+const int GLTFTriangles = 4;
+
+struct GLTFBuffer
+{
+	const uint8_t* data = nullptr;
+	size_t size = 0;
+};
+
+// Keeps the mapped files and decoded data URIs alive while accessors point into them
+struct GLTFStorage
+{
+	std::vector<std::unique_ptr<MappedFile>> files;
+	std::vector<std::vector<uint8_t>> decoded;
+	std::vector<GLTFBuffer> buffers;
+};
+
+struct GLTFAccessor
+{
+	const uint8_t* data;
+	size_t count;
+	size_t stride;
+	int componentType;
+	int components;
+	bool normalized;
+};
+
+// Saturates, so absurd sizes fail the bounds checks instead of wrapping
+static size_t gltfSize(const JsonValue& value)
+{
+	double size = std::max(0.0, value.asNumber());
+	if (size >= static_cast<double>(std::numeric_limits<size_t>::max()))
+		return std::numeric_limits<size_t>::max();
+	return static_cast<size_t>(size);
+}
+
+static int gltfComponentSize(int componentType)
+{
+	switch (componentType)
+	{
+	case 5120: case GLTFUnsignedByte: return 1;
+	case 5122: case GLTFUnsignedShort: return 2;
+	case GLTFUnsignedInt: case GLTFFloat: return 4;
+	default: return 0;
+	}
+}
+
+static int gltfTypeComponents(const std::string& type)
+{
+	const std::map<std::string, int> components = { { "SCALAR", 1 }, { "VEC2", 2 }, { "VEC3", 3 }, { "VEC4", 4 },
+		{ "MAT2", 4 }, { "MAT3", 9 }, { "MAT4", 16 } };
+	auto res = components.find(type);
+	return (res == components.end()) ? 0 : res->second;
+}
+
+static std::string gltfDecodeURI(const std::string& uri)
+{
+	std::string str;
+	for (size_t i = 0; i < uri.size(); i++)
+	{
+		if (uri[i] == '%' && i + 2 < uri.size() && std::isxdigit(static_cast<unsigned char>(uri[i + 1])) &&
+			std::isxdigit(static_cast<unsigned char>(uri[i + 2])))
+		{
+			str += static_cast<char>(std::stoi(uri.substr(i + 1, 2), nullptr, 16));
+			i += 2;
+		}
+		else
+			str += uri[i];
+	}
+	return str;
+}
+
+static bool gltfDecodeBase64(const char* begin, const char* end, std::vector<uint8_t>& out)
+{
+	auto value = [](char c) -> int
+	{
+		if (c >= 'A' && c <= 'Z') return c - 'A';
+		if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+		if (c >= '0' && c <= '9') return c - '0' + 52;
+		if (c == '+') return 62;
+		if (c == '/') return 63;
+		return -1;
+	};
+	uint32_t bits = 0;
+	int nBits = 0;
+	for (auto p = begin; p != end && *p != '='; p++)
+	{
+		int v = value(*p);
+		if (v < 0)
+			return false;
+		bits = bits << 6 | v;
+		nBits += 6;
+		if (nBits >= 8)
+		{
+			nBits -= 8;
+			out.push_back(static_cast<uint8_t>(bits >> nBits));
+		}
+	}
+	return true;
+}
+
+static bool gltfLoadBuffers(const JsonValue& gltf, const File::path& directory, GLTFBuffer glbChunk,
+	GLTFStorage& storage, std::vector<std::string>& log)
+{
+	const auto& buffers = gltf["buffers"];
+	for (size_t i = 0; i < buffers.size(); i++)
+	{
+		const auto& buffer = buffers[i];
+		GLTFBuffer range;
+		if (!buffer.has("uri"))
+		{
+			// Only the first buffer of a GLB may refer to the binary chunk
+			if (i != 0 || glbChunk.data == nullptr)
+			{
+				log.push_back("\t[glTF buffer " + std::to_string(i) + " has no data]");
+				return false;
+			}
+			range = glbChunk;
+		}
+		else
+		{
+			const auto& uri = buffer["uri"].asString();
+			if (uri.compare(0, 5, "data:") == 0)
+			{
+				auto comma = uri.find(',');
+				if (comma == std::string::npos || uri.rfind(";base64", comma) == std::string::npos)
+				{
+					log.push_back("\t[glTF buffer " + std::to_string(i) + " has an unsupported data URI]");
+					return false;
+				}
+				storage.decoded.emplace_back();
+				if (!gltfDecodeBase64(uri.data() + comma + 1, uri.data() + uri.size(), storage.decoded.back()))
+				{
+					log.push_back("\t[glTF buffer " + std::to_string(i) + " has malformed base64 data]");
+					return false;
+				}
+				range = { storage.decoded.back().data(), storage.decoded.back().size() };
+			}
+			else
+			{
+				auto path = directory / gltfDecodeURI(uri);
+				auto file = std::make_unique<MappedFile>(path);
+				if (!file->valid())
+				{
+					log.push_back("\t[glTF unable to map buffer " + path.generic_string() + "]");
+					return false;
+				}
+				range = { reinterpret_cast<const uint8_t*>(file->data()), file->size() };
+				storage.files.push_back(std::move(file));
+			}
+		}
+
+		size_t byteLength = gltfSize(buffer["byteLength"]);
+		if (range.size < byteLength)
+		{
+			log.push_back("\t[glTF buffer " + std::to_string(i) + " is shorter than its byteLength]");
+			return false;
+		}
+		range.size = byteLength;
+		storage.buffers.push_back(range);
+	}
+	return true;
+}
+
+// Bounds-checked view of an accessor inside its buffer. Sparse accessors and ones without a
+// buffer view are not supported
+static std::optional<GLTFAccessor> gltfAccessor(const JsonValue& gltf, const GLTFStorage& storage, int index)
+{
+	const auto& accessor = gltf["accessors"][index];
+	if (index < 0 || !accessor.isObject() || !accessor.has("bufferView") || accessor.has("sparse"))
+		return std::nullopt;
+	const auto& view = gltf["bufferViews"][accessor["bufferView"].asInt(-1)];
+	int buffer = view["buffer"].asInt(-1);
+	if (!view.isObject() || buffer < 0 || buffer >= static_cast<int>(storage.buffers.size()))
+		return std::nullopt;
+
+	GLTFAccessor res;
+	res.componentType = accessor["componentType"].asInt();
+	res.components = gltfTypeComponents(accessor["type"].asString());
+	res.count = gltfSize(accessor["count"]);
+	res.normalized = accessor["normalized"].asBool();
+
+	size_t elementSize = gltfComponentSize(res.componentType) * res.components;
+	res.stride = view.has("byteStride") ? gltfSize(view["byteStride"]) : elementSize;
+	size_t viewOffset = gltfSize(view["byteOffset"]);
+	size_t viewLength = gltfSize(view["byteLength"]);
+	size_t offset = gltfSize(accessor["byteOffset"]);
+	// Bounds are compared by subtraction, no sum or product of file values can wrap around
+	size_t bufferSize = storage.buffers[buffer].size;
+	if (elementSize == 0 || res.stride < elementSize || viewOffset > bufferSize || viewLength > bufferSize - viewOffset ||
+		offset > viewLength)
+		return std::nullopt;
+	if (res.count > 0 && (elementSize > viewLength - offset ||
+		res.count - 1 > (viewLength - offset - elementSize) / res.stride))
+		return std::nullopt;
+
+	res.data = storage.buffers[buffer].data + viewOffset + offset;
+	return res;
+}
+
+// Float vectors, plus normalized unsigned integers as texcoords may be. Tightly packed floats
+// are MeshData's own layout and go in with a single copy
+template<typename Vec>
+static bool gltfReadVectors(const GLTFAccessor& accessor, std::vector<Vec>& out)
+{
+	const int N = Vec::length();
+	if (accessor.components != N)
+		return false;
+	out.resize(accessor.count);
+
+	if (accessor.componentType == GLTFFloat)
+	{
+		if (accessor.stride == sizeof(Vec))
+			std::memcpy(out.data(), accessor.data, sizeof(Vec) * accessor.count);
+		else
+		{
+			for (size_t i = 0; i < accessor.count; i++)
+				std::memcpy(&out[i], accessor.data + accessor.stride * i, sizeof(Vec));
+		}
+		return true;
+	}
+	if (!accessor.normalized)
+		return false;
+
+	if (accessor.componentType == GLTFUnsignedByte)
+	{
+		for (size_t i = 0; i < accessor.count; i++)
+			for (int c = 0; c < N; c++)
+				out[i][c] = accessor.data[accessor.stride * i + c] / 255.0f;
+		return true;
+	}
+	if (accessor.componentType == GLTFUnsignedShort)
+	{
+		for (size_t i = 0; i < accessor.count; i++)
+		{
+			for (int c = 0; c < N; c++)
+			{
+				uint16_t value;
+				std::memcpy(&value, accessor.data + accessor.stride * i + c * sizeof(uint16_t), sizeof(uint16_t));
+				out[i][c] = value / 65535.0f;
+			}
+		}
+		return true;
+	}
+	return false;
+}
+
+template<typename T>
+static void gltfWidenIndices(const GLTFAccessor& accessor, std::vector<uint32_t>& out)
+{
+	for (size_t i = 0; i < accessor.count; i++)
+	{
+		T index;
+		std::memcpy(&index, accessor.data + accessor.stride * i, sizeof(T));
+		out[i] = index;
+	}
+}
+
+static bool gltfReadIndices(const GLTFAccessor& accessor, std::vector<uint32_t>& out)
+{
+	if (accessor.components != 1)
+		return false;
+	out.resize(accessor.count);
+
+	switch (accessor.componentType)
+	{
+	case GLTFUnsignedInt:
+		if (accessor.stride == sizeof(uint32_t))
+			std::memcpy(out.data(), accessor.data, sizeof(uint32_t) * accessor.count);
+		else
+			gltfWidenIndices<uint32_t>(accessor, out);
+		return true;
+	case GLTFUnsignedShort:
+		gltfWidenIndices<uint16_t>(accessor, out);
+		return true;
+	case GLTFUnsignedByte:
+		gltfWidenIndices<uint8_t>(accessor, out);
+		return true;
+	default:
+		return false;
+	}
+}
+
+static MeshDataPtr gltfLoadPrimitive(const JsonValue& gltf, const GLTFStorage& storage, const JsonValue& primitive,
+	std::string& error)
+{
+	const auto& attributes = primitive["attributes"];
+	auto meshData = MeshData::create();
+
+	auto position = gltfAccessor(gltf, storage, attributes["POSITION"].asInt(-1));
+	if (!position || !gltfReadVectors(*position, meshData->positions))
+	{
+		error = "missing or unsupported POSITION";
+		return nullptr;
+	}
+	size_t nVertices = meshData->positions.size();
+
+	if (primitive.has("indices"))
+	{
+		auto indices = gltfAccessor(gltf, storage, primitive["indices"].asInt(-1));
+		if (!indices || !gltfReadIndices(*indices, meshData->indices))
+		{
+			error = "unsupported indices";
+			return nullptr;
+		}
+	}
+	else
+	{
+		meshData->indices.resize(nVertices);
+		std::iota(meshData->indices.begin(), meshData->indices.end(), 0);
+	}
+	meshData->indices.resize(meshData->indices.size() / 3 * 3);
+	if (std::any_of(meshData->indices.begin(), meshData->indices.end(), [&](uint32_t i) { return i >= nVertices; }))
+	{
+		error = "index out of range";
+		return nullptr;
+	}
+
+	if (attributes.has("NORMAL"))
+	{
+		auto normal = gltfAccessor(gltf, storage, attributes["NORMAL"].asInt(-1));
+		if (!normal || !gltfReadVectors(*normal, meshData->normals) || meshData->normals.size() != nVertices)
+		{
+			error = "unsupported NORMAL";
+			return nullptr;
+		}
+	}
+	else
+		meshData->computeSmoothNormals();
+
+	auto texcoord = gltfAccessor(gltf, storage, attributes["TEXCOORD_0"].asInt(-1));
+	if (!texcoord || !gltfReadVectors(*texcoord, meshData->texcoords) || meshData->texcoords.size() != nVertices)
+		meshData->texcoords.assign(nVertices, glm::vec2(0.0f));
+	return meshData;
+}
+
+static MeshDataPtr gltfTransformed(const MeshData& source, const glm::mat4& transform)
+{
+	auto meshData = MeshData::create();
+	glm::mat3 normalTransform = glm::transpose(glm::inverse(glm::mat3(transform)));
+
+	meshData->positions.resize(source.positions.size());
+	for (size_t i = 0; i < source.positions.size(); i++)
+		meshData->positions[i] = glm::vec3(transform * glm::vec4(source.positions[i], 1.0f));
+	meshData->normals.resize(source.normals.size());
+	for (size_t i = 0; i < source.normals.size(); i++)
+		meshData->normals[i] = glm::normalize(normalTransform * source.normals[i]);
+	meshData->texcoords = source.texcoords;
+	meshData->indices = source.indices;
+
+	// Mirroring transforms flip the winding, swap it back so faces keep pointing out
+	if (glm::determinant(glm::mat3(transform)) < 0.0f)
+	{
+		for (size_t i = 0; i < meshData->indices.size(); i += 3)
+			std::swap(meshData->indices[i + 1], meshData->indices[i + 2]);
+	}
+	return meshData;
+}
+
+static glm::mat4 gltfNodeMatrix(const JsonValue& node)
+{
+	if (node.has("matrix"))
+	{
+		glm::mat4 matrix;
+		for (int i = 0; i < 16; i++)
+			matrix[i / 4][i % 4] = node["matrix"][i].asFloat((i % 5 == 0) ? 1.0f : 0.0f);
+		return matrix;
+	}
+	const auto& t = node["translation"];
+	const auto& r = node["rotation"];
+	const auto& s = node["scale"];
+	glm::quat rotation(r[3].asFloat(1.0f), r[0].asFloat(), r[1].asFloat(), r[2].asFloat());
+	return glm::translate(glm::mat4(1.0f), glm::vec3(t[0].asFloat(), t[1].asFloat(), t[2].asFloat())) *
+		glm::mat4_cast(rotation) *
+		glm::scale(glm::mat4(1.0f), glm::vec3(s[0].asFloat(1.0f), s[1].asFloat(1.0f), s[2].asFloat(1.0f)));
+}
+
+static File::path gltfTexturePath(const JsonValue& gltf, const File::path& directory, int texture,
+	std::vector<std::string>& log)
+{
+	if (texture < 0)
+		return File::path();
+	const auto& image = gltf["images"][gltf["textures"][texture]["source"].asInt(-1)];
+	const auto& uri = image["uri"].asString();
+	if (uri.empty() || uri.compare(0, 5, "data:") == 0)
+	{
+		log.push_back("\t[glTF embedded images are not supported, texture " + std::to_string(texture) + " ignored]");
+		return File::path();
+	}
+	return directory / gltfDecodeURI(uri);
+}
+
+bool GLTFLoader::isGLTF(const File::path& path)
+{
+	auto ext = path.extension().generic_string();
+	std::transform(ext.begin(), ext.end(), ext.begin(), [](char c) { return std::tolower(c); });
+	return ext == ".gltf" || ext == ".glb";
+}
+
+ModelInstancePtr GLTFLoader::load(const File::path& path, std::vector<File::path>& texturePaths,
+	std::vector<std::string>& log)
+{
+	MappedFile file(path);
+	if (!file.valid())
+	{
+		log.push_back("\t[glTF unable to map " + path.generic_string() + "]");
+		return nullptr;
+	}
+	auto bytes = reinterpret_cast<const uint8_t*>(file.data());
+	const char* jsonBegin = reinterpret_cast<const char*>(bytes);
+	const char* jsonEnd = jsonBegin + file.size();
+	GLTFBuffer binChunk;
+
+	// GLB: 12-byte header, then the JSON chunk and an optional BIN chunk, each with an 8-byte header
+	uint32_t magic = 0;
+	if (file.size() >= 4)
+		std::memcpy(&magic, bytes, 4);
+	if (magic == GLBMagic)
+	{
+		uint32_t header[3], chunk[2];
+		if (file.size() < 20)
+		{
+			log.push_back("\t[GLB truncated]");
+			return nullptr;
+		}
+		std::memcpy(header, bytes, sizeof(header));
+		std::memcpy(chunk, bytes + 12, sizeof(chunk));
+		if (header[1] != 2 || header[2] > file.size() || chunk[1] != GLBChunkJSON || 20 + size_t(chunk[0]) > header[2])
+		{
+			log.push_back("\t[GLB header invalid or unsupported version]");
+			return nullptr;
+		}
+		jsonBegin = reinterpret_cast<const char*>(bytes + 20);
+		jsonEnd = jsonBegin + chunk[0];
+
+		size_t binOffset = 20 + ((size_t(chunk[0]) + 3) & ~size_t(3));
+		if (binOffset + 8 <= header[2])
+		{
+			std::memcpy(chunk, bytes + binOffset, sizeof(chunk));
+			if (chunk[1] == GLBChunkBIN && binOffset + 8 + chunk[0] <= header[2])
+				binChunk = { bytes + binOffset + 8, chunk[0] };
+		}
+	}
+
+	auto parsed = JsonValue::parse(jsonBegin, jsonEnd);
+	if (!parsed || !parsed->isObject())
+	{
+		log.push_back("\t[glTF JSON is malformed]");
+		return nullptr;
+	}
+	const auto& gltf = *parsed;
+	if (gltf["asset"]["version"].asString().compare(0, 2, "2.") != 0)
+	{
+		log.push_back("\t[glTF version " + gltf["asset"]["version"].asString() + " is not supported]");
+		return nullptr;
+	}
+
+	auto directory = path.parent_path();
+	GLTFStorage storage;
+	if (!gltfLoadBuffers(gltf, directory, binChunk, storage, log))
+		return nullptr;
+
+	auto model = std::make_shared<ModelInstance>();
+	std::vector<File::path> materialTextures;
+	const auto& materials = gltf["materials"];
+	for (size_t i = 0; i < materials.size(); i++)
+	{
+		const auto& pbr = materials[i]["pbrMetallicRoughness"];
+		const auto& factor = pbr["baseColorFactor"];
+		Material mat;
+		mat.type = Material::MetalWorkflow;
+		mat.baseColor = glm::vec3(factor[0].asFloat(1.0f), factor[1].asFloat(1.0f), factor[2].asFloat(1.0f));
+		mat.metallic = pbr["metallicFactor"].asFloat(1.0f);
+		mat.roughness = pbr["roughnessFactor"].asFloat(1.0f);
+		model->materials().push_back(mat);
+		materialTextures.push_back(gltfTexturePath(gltf, directory, pbr["baseColorTexture"]["index"].asInt(-1), log));
+	}
+	int defaultMaterial = -1;
+
+	// Primitives are loaded once and shared by every identity-transformed node using them
+	std::map<std::pair<int, int>, MeshDataPtr> primitiveData;
+	auto addMesh = [&](int meshIndex, const glm::mat4& transform)
+	{
+		const auto& primitives = gltf["meshes"][meshIndex]["primitives"];
+		for (size_t i = 0; i < primitives.size(); i++)
+		{
+			const auto& primitive = primitives[i];
+			if (primitive["mode"].asInt(GLTFTriangles) != GLTFTriangles)
+			{
+				log.push_back("\t[glTF non-triangle primitive skipped]");
+				continue;
+			}
+			auto key = std::make_pair(meshIndex, static_cast<int>(i));
+			auto res = primitiveData.find(key);
+			if (res == primitiveData.end())
+			{
+				std::string error;
+				res = primitiveData.insert({ key, gltfLoadPrimitive(gltf, storage, primitive, error) }).first;
+				if (!res->second)
+					log.push_back("\t[glTF primitive skipped: " + error + "]");
+			}
+			if (!res->second)
+				continue;
+
+			auto meshInstance = MeshInstance::create();
+			meshInstance->meshData = (transform == glm::mat4(1.0f)) ? res->second : gltfTransformed(*res->second, transform);
+			log.push_back("\t[Mesh nVertices = " + std::to_string(meshInstance->meshData->positions.size()) +
+				", nFaces = " + std::to_string(meshInstance->meshData->indices.size() / 3) + "]");
+
+			int material = primitive["material"].asInt(-1);
+			if (material < 0 || material >= static_cast<int>(materialTextures.size()))
+			{
+				if (defaultMaterial == -1)
+				{
+					defaultMaterial = model->materials().size();
+					model->materials().push_back(Material());
+				}
+				meshInstance->matIndex = defaultMaterial;
+				texturePaths.push_back(File::path());
+			}
+			else
+			{
+				meshInstance->matIndex = material;
+				texturePaths.push_back(materialTextures[material]);
+				if (!materialTextures[material].empty())
+					log.push_back("\t\t[Albedo texture " + materialTextures[material].generic_string() + "]");
+			}
+			model->meshInstances().push_back(meshInstance);
+		}
+	};
+
+	// Nodes of the default scene, or every parentless node if the file has no scenes
+	const auto& nodes = gltf["nodes"];
+	std::vector<int> roots;
+	const auto& sceneNodes = gltf["scenes"][gltf["scene"].asInt(0)]["nodes"];
+	if (gltf.has("scenes"))
+	{
+		for (size_t i = 0; i < sceneNodes.size(); i++)
+			roots.push_back(sceneNodes[i].asInt(-1));
+	}
+	else
+	{
+		std::vector<bool> isChild(nodes.size(), false);
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			const auto& children = nodes[i]["children"];
+			for (size_t j = 0; j < children.size(); j++)
+			{
+				int child = children[j].asInt(-1);
+				if (child >= 0 && child < static_cast<int>(nodes.size()))
+					isChild[child] = true;
+			}
+		}
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			if (!isChild[i])
+				roots.push_back(i);
+		}
+	}
+
+	std::vector<std::pair<int, glm::mat4>> stack;
+	for (auto root = roots.rbegin(); root != roots.rend(); root++)
+		stack.push_back({ *root, glm::mat4(1.0f) });
+	std::vector<bool> visited(nodes.size(), false);
+	while (!stack.empty())
+	{
+		auto [index, parent] = stack.back();
+		stack.pop_back();
+		if (index < 0 || index >= static_cast<int>(nodes.size()) || visited[index])
+			continue;
+		visited[index] = true;
+
+		const auto& node = nodes[index];
+		glm::mat4 transform = parent * gltfNodeMatrix(node);
+		if (node.has("mesh"))
+			addMesh(node["mesh"].asInt(-1), transform);
+
+		const auto& children = node["children"];
+		for (size_t i = children.size(); i > 0; i--)
+			stack.push_back({ children[i - 1].asInt(-1), transform });
+	}
+	return model;
+}
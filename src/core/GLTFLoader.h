@@ -0,0 +1,19 @@
+#pragma once
+
+#include "Model.h"
+#include "../util/File.h"
+
+// glTF 2.0 import (.gltf with external or base64 buffers, and .glb) that bypasses Assimp.
+// Buffers are mapped and accessors whose layout already matches MeshData's arrays are copied
+// in bulk. Node transforms are baked, so meshes under identity nodes keep a single MeshData.
+// pbrMetallicRoughness becomes a MetalWorkflow material, its base color texture the albedo
+class GLTFLoader
+{
+public:
+	static bool isGLTF(const File::path& path);
+
+	// Null on failure. texturePaths gets one entry per mesh instance, empty if none, and log
+	// the lines to print once the model is registered
+	static ModelInstancePtr load(const File::path& path, std::vector<File::path>& texturePaths,
+		std::vector<std::string>& log);
+};
@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include <memory>
+#include <utility>
 
 #include "Texture.h"
 #include "Pipeline.h"
@@ -39,13 +40,27 @@ public:
 	void setStatus(const RenderStatus& status) { mStatus = status; }
 	void setShouldReset() { mShouldReset = true; }
 
+	// True once after a settings change that needs the scene's BVH rebuilt
+	bool takeGeomChanged() { return std::exchange(mGeomChanged, false); }
+
 protected:
+	// Scenes build no wide BVH unless asked to, the first wide toggle asks for a 4-wide one
+	void requestWideBVH()
+	{
+		if (mStatus.scene && mStatus.scene->bvhParam.wideWidth == 0)
+		{
+			mStatus.scene->bvhParam.wideWidth = 4;
+			mGeomChanged = true;
+		}
+	}
+
 	bool mRenderFinished = false;
 	bool mPassFinished = false;
 	int mCurSample = 0;
 	int mFreeCounter = 0;
 	RenderStatus mStatus;
 	bool mShouldReset = false;
+	bool mGeomChanged = false;
 
 	double mTime;
 	Timer mTimer;
@@ -63,6 +78,7 @@ struct PathIntegParam
 	bool finiteSample = false;
 	int maxSample = 64;
 	int sampler = 1;
+	bool wideBVH = false;
 };
 
 class NaivePathIntegrator :
@@ -98,6 +114,7 @@ struct LightPathIntegParam
 	int maxSample = 64;
 	int threadBlocksOnePass = 32;
 	float samplePerPixel = 0.0f;
+	bool wideBVH = false;
 };
 
 class LightPathIntegrator :
@@ -140,6 +157,7 @@ struct TriplePathIntegParam
 	int PTSampler = 1;
 	bool limitTime = true;
 	double maxTime = 30.0;
+	bool wideBVH = false;
 };
 
 class TriplePathIntegrator :
@@ -219,6 +237,7 @@ struct QueuedPTParam
 	int maxSample = 64;
 	float samplePerPixel = 0.0f;
 	int sampler = 1;
+	bool wideBVH = false;
 };
 
 class GlobalQueuePathIntegrator :
@@ -38,6 +38,30 @@ void MeshData::render(PipelinePtr ctx, ShaderPtr shader)
 			mIndexBuffer, shader);
 }
 
+size_t MeshData::byteSize() const
+{
+	return positions.size() * sizeof(glm::vec3) + texcoords.size() * sizeof(glm::vec2) +
+		normals.size() * sizeof(glm::vec3) + indices.size() * sizeof(uint32_t);
+}
+
+void MeshData::computeSmoothNormals()
+{
+	normals.assign(positions.size(), glm::vec3(0.0f));
+	for (size_t i = 0; i + 2 < indices.size(); i += 3)
+	{
+		uint32_t ia = indices[i + 0], ib = indices[i + 1], ic = indices[i + 2];
+		glm::vec3 n = glm::cross(positions[ib] - positions[ia], positions[ic] - positions[ia]);
+		normals[ia] += n;
+		normals[ib] += n;
+		normals[ic] += n;
+	}
+	for (auto& n : normals)
+	{
+		float length = glm::length(n);
+		n = (length > 0.0f) ? n / length : glm::vec3(0.0f, 0.0f, 1.0f);
+	}
+}
+
 MeshDataPtr MeshData::create()
 {
 	return std::make_shared<MeshData>();
@@ -34,6 +34,10 @@ public:
 	void createGLContext();
 	GLuint bufferId() const;
 	bool hasGLContext() const { return mHasGLContext; }
+	size_t byteSize() const;
+
+	// Area-weighted vertex normals from positions and indices, as Assimp's GenSmoothNormals
+	void computeSmoothNormals();
 
 	void render(PipelinePtr ctx, ShaderPtr shader);
 
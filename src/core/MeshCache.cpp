@@ -0,0 +1,235 @@
+#include "MeshCache.h"
+#include "../util/MappedFile.h"
+
+#include <cstring>
+#include <fstream>
+#include <type_traits>
+
+// Bump whenever the layout below, MeshData or Material changes
+const uint32_t MeshCacheVersion = 1;
+const char MeshCacheMagic[4] = { 'Z', 'M', 'S', 'H' };
+const size_t MeshCacheAlignment = 16;
+
+static_assert(std::is_trivially_copyable_v<Material>, "Materials are stored as raw bytes");
+
+struct MeshCacheHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t importTag;
+	int32_t meshCount;
+	int64_t sourceTime;
+	uint64_t sourceSize;
+	int32_t materialCount;
+	int32_t texturePathBytes;
+};
+
+struct MeshCacheRecord
+{
+	uint64_t offset;	// Of the mesh's arrays from the start of the file
+	uint32_t vertexCount;
+	uint32_t indexCount;
+	int32_t matIndex;
+	int32_t texturePathLength;	// 0 for no texture
+};
+
+// After the header come the records, the materials and the texture paths back to back, then
+// each mesh's positions, texcoords, normals and indices, every array starting 16-byte aligned
+static size_t alignCacheOffset(size_t offset)
+{
+	return (offset + MeshCacheAlignment - 1) / MeshCacheAlignment * MeshCacheAlignment;
+}
+
+static size_t meshArraysSize(const MeshCacheRecord& record)
+{
+	size_t size = alignCacheOffset(sizeof(glm::vec3) * record.vertexCount);
+	size += alignCacheOffset(sizeof(glm::vec2) * record.vertexCount);
+	size += alignCacheOffset(sizeof(glm::vec3) * record.vertexCount);
+	return size + alignCacheOffset(sizeof(uint32_t) * record.indexCount);
+}
+
+static bool sourceStamp(const File::path& source, int64_t& time, uint64_t& size)
+{
+	std::error_code err;
+	auto writeTime = File::last_write_time(source, err);
+	if (err)
+		return false;
+	size = File::file_size(source, err);
+	time = writeTime.time_since_epoch().count();
+	return !err;
+}
+
+File::path MeshCache::filePath(const File::path& source)
+{
+	auto path = source;
+	path += ".zmesh";
+	return path;
+}
+
+std::optional<MeshCache::Entry> MeshCache::load(const File::path& source, uint32_t importTag,
+	std::vector<std::string>& log)
+{
+	auto path = filePath(source);
+	int64_t sourceTime;
+	uint64_t sourceSize;
+	if (!File::exists(path) || !sourceStamp(source, sourceTime, sourceSize))
+		return std::nullopt;
+
+	MappedFile file(path);
+	if (!file.valid() || file.size() < sizeof(MeshCacheHeader))
+		return std::nullopt;
+	auto base = reinterpret_cast<const uint8_t*>(file.data());
+
+	MeshCacheHeader header;
+	std::memcpy(&header, base, sizeof(header));
+	if (std::memcmp(header.magic, MeshCacheMagic, 4) != 0 || header.version != MeshCacheVersion ||
+		header.importTag != importTag || header.sourceTime != sourceTime || header.sourceSize != sourceSize ||
+		header.meshCount < 0 || header.materialCount < 0 || header.texturePathBytes < 0)
+		return std::nullopt;
+
+	size_t tableSize = sizeof(MeshCacheHeader) + sizeof(MeshCacheRecord) * header.meshCount +
+		sizeof(Material) * header.materialCount + header.texturePathBytes;
+	if (file.size() < tableSize)
+		return std::nullopt;
+
+	auto records = base + sizeof(MeshCacheHeader);
+	auto materials = records + sizeof(MeshCacheRecord) * header.meshCount;
+	auto texturePath = reinterpret_cast<const char*>(materials + sizeof(Material) * header.materialCount);
+	auto texturePathEnd = texturePath + header.texturePathBytes;
+
+	Entry entry;
+	entry.model = std::make_shared<ModelInstance>();
+	entry.model->materials().resize(header.materialCount);
+	std::memcpy(entry.model->materials().data(), materials, sizeof(Material) * header.materialCount);
+
+	for (int i = 0; i < header.meshCount; i++)
+	{
+		MeshCacheRecord record;
+		std::memcpy(&record, records + sizeof(MeshCacheRecord) * i, sizeof(record));
+		if (record.offset % MeshCacheAlignment != 0 || record.offset > file.size() ||
+			meshArraysSize(record) > file.size() - record.offset ||
+			record.texturePathLength < 0 || record.texturePathLength > texturePathEnd - texturePath)
+		{
+			log.push_back("\t[Mesh cache " + path.generic_string() + " is damaged, importing again]");
+			return std::nullopt;
+		}
+
+		// The arrays are aligned in the mapping, each lands in its vector with one bulk copy
+		auto meshData = MeshData::create();
+		auto arrays = base + record.offset;
+		auto positions = reinterpret_cast<const glm::vec3*>(arrays);
+		meshData->positions.assign(positions, positions + record.vertexCount);
+		arrays += alignCacheOffset(sizeof(glm::vec3) * record.vertexCount);
+		auto texcoords = reinterpret_cast<const glm::vec2*>(arrays);
+		meshData->texcoords.assign(texcoords, texcoords + record.vertexCount);
+		arrays += alignCacheOffset(sizeof(glm::vec2) * record.vertexCount);
+		auto normals = reinterpret_cast<const glm::vec3*>(arrays);
+		meshData->normals.assign(normals, normals + record.vertexCount);
+		arrays += alignCacheOffset(sizeof(glm::vec3) * record.vertexCount);
+		auto indices = reinterpret_cast<const uint32_t*>(arrays);
+		meshData->indices.assign(indices, indices + record.indexCount);
+
+		auto meshInstance = MeshInstance::create();
+		meshInstance->matIndex = record.matIndex;
+		meshInstance->meshData = meshData;
+		entry.model->meshInstances().push_back(meshInstance);
+
+		// Relative texture paths are stored relative to the source's directory
+		File::path texture;
+		if (record.texturePathLength > 0)
+		{
+			texture = std::string(texturePath, record.texturePathLength);
+			if (!texture.is_absolute())
+				texture = source.parent_path() / texture;
+		}
+		texturePath += record.texturePathLength;
+		entry.texturePaths.push_back(texture);
+	}
+	return entry;
+}
+
+void MeshCache::store(const File::path& source, uint32_t importTag, const Entry& entry,
+	std::vector<std::string>& log)
+{
+	auto path = filePath(source);
+	MeshCacheHeader header;
+	std::memcpy(header.magic, MeshCacheMagic, 4);
+	header.version = MeshCacheVersion;
+	header.importTag = importTag;
+	if (!sourceStamp(source, header.sourceTime, header.sourceSize))
+		return;
+
+	auto& meshInstances = entry.model->meshInstances();
+	auto& materials = entry.model->materials();
+	header.meshCount = meshInstances.size();
+	header.materialCount = materials.size();
+
+	std::string texturePaths;
+	std::vector<MeshCacheRecord> records(meshInstances.size());
+	for (size_t i = 0; i < meshInstances.size(); i++)
+	{
+		std::string texture;
+		if (!entry.texturePaths[i].empty())
+		{
+			texture = entry.texturePaths[i].is_absolute() ? entry.texturePaths[i].generic_string() :
+				entry.texturePaths[i].lexically_relative(source.parent_path()).generic_string();
+		}
+		records[i].texturePathLength = texture.size();
+		texturePaths += texture;
+	}
+	header.texturePathBytes = texturePaths.size();
+
+	size_t offset = alignCacheOffset(sizeof(MeshCacheHeader) + sizeof(MeshCacheRecord) * records.size() +
+		sizeof(Material) * materials.size() + texturePaths.size());
+	for (size_t i = 0; i < meshInstances.size(); i++)
+	{
+		const auto& meshData = meshInstances[i]->meshData;
+		records[i].offset = offset;
+		records[i].vertexCount = meshData->positions.size();
+		records[i].indexCount = meshData->indices.size();
+		records[i].matIndex = meshInstances[i]->matIndex;
+		offset += meshArraysSize(records[i]);
+	}
+
+	// Written under a temporary name first so an interrupted write never looks valid
+	auto tmpPath = path;
+	tmpPath += ".tmp";
+	{
+		std::ofstream file(tmpPath, std::ios::binary);
+		if (!file)
+		{
+			log.push_back("\t[Unable to write mesh cache " + path.generic_string() + "]");
+			return;
+		}
+		const char zeros[MeshCacheAlignment] = {};
+		auto write = [&](const void* data, size_t size) { file.write(reinterpret_cast<const char*>(data), size); };
+		auto writeAligned = [&](const void* data, size_t size)
+		{
+			write(data, size);
+			write(zeros, alignCacheOffset(size) - size);
+		};
+		write(&header, sizeof(header));
+		write(records.data(), sizeof(MeshCacheRecord) * records.size());
+		write(materials.data(), sizeof(Material) * materials.size());
+		write(texturePaths.data(), texturePaths.size());
+		write(zeros, records.empty() ? 0 : records[0].offset - static_cast<size_t>(file.tellp()));
+
+		for (const auto& meshInstance : meshInstances)
+		{
+			const auto& meshData = meshInstance->meshData;
+			writeAligned(meshData->positions.data(), sizeof(glm::vec3) * meshData->positions.size());
+			writeAligned(meshData->texcoords.data(), sizeof(glm::vec2) * meshData->texcoords.size());
+			writeAligned(meshData->normals.data(), sizeof(glm::vec3) * meshData->normals.size());
+			writeAligned(meshData->indices.data(), sizeof(uint32_t) * meshData->indices.size());
+		}
+		if (!file)
+		{
+			log.push_back("\t[Unable to write mesh cache " + path.generic_string() + "]");
+			return;
+		}
+	}
+	std::error_code err;
+	File::rename(tmpPath, path, err);
+	if (err)
+		log.push_back("\t[Unable to write mesh cache " + path.generic_string() + ": " + err.message() + "]");
+}
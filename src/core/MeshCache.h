@@ -0,0 +1,25 @@
+#pragma once
+
+#include <optional>
+
+#include "Model.h"
+#include "../util/File.h"
+
+// Imported model after post-processing, kept next to the source as <source>.zmesh. The header
+// records the source's size and write time and a tag for the import settings, so editing the
+// source or changing the importer makes the file stale and it is written again
+class MeshCache
+{
+public:
+	struct Entry
+	{
+		ModelInstancePtr model;
+		std::vector<File::path> texturePaths;	// One per mesh instance, empty if none
+	};
+
+	static File::path filePath(const File::path& source);
+
+	// Both run on import workers, so problems go to log for the caller to print in order
+	static std::optional<Entry> load(const File::path& source, uint32_t importTag, std::vector<std::string>& log);
+	static void store(const File::path& source, uint32_t importTag, const Entry& entry, std::vector<std::string>& log);
+};
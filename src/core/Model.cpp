@@ -76,5 +76,8 @@ ModelInstancePtr ModelInstance::copy() const
 	auto model = std::make_shared<ModelInstance>();
 	*model = *this;
 	model->mName = mName + "\'";
+	// Per-copy mesh instances, the MeshData and its GL buffers stay shared
+	for (auto& meshInstance : model->mMeshInstances)
+		meshInstance = std::make_shared<MeshInstance>(*meshInstance);
 	return model;
 }
@@ -0,0 +1,516 @@
+#include "PLYLoader.h"
+#include "../util/MappedFile.h"
+#include "../util/ThreadPool.h"
+#include "../util/Timer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <sstream>
+
+enum class PLYType
+{
+	Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64, Invalid
+};
+
+struct PLYProperty
+{
+	std::string name;
+	PLYType type;
+	PLYType countType = PLYType::Invalid;	// Invalid for scalars, the list length's type otherwise
+	size_t offset = 0;	// Within the record, valid as long as no list comes before
+};
+
+struct PLYElement
+{
+	std::string name;
+	size_t count;
+	std::vector<PLYProperty> properties;
+	size_t recordSize = 0;	// 0 if the element has list properties
+};
+
+struct PLYHeader
+{
+	bool bigEndian;
+	size_t dataOffset;
+	std::vector<PLYElement> elements;
+};
+
+// Decoded in chunks of this many vertices or faces per task
+const int PLYGrainSize = 1 << 16;
+
+static PLYType plyType(const std::string& name)
+{
+	const std::map<std::string, PLYType> types =
+	{
+		{ "char", PLYType::Int8 }, { "int8", PLYType::Int8 }, { "uchar", PLYType::UInt8 }, { "uint8", PLYType::UInt8 },
+		{ "short", PLYType::Int16 }, { "int16", PLYType::Int16 }, { "ushort", PLYType::UInt16 }, { "uint16", PLYType::UInt16 },
+		{ "int", PLYType::Int32 }, { "int32", PLYType::Int32 }, { "uint", PLYType::UInt32 }, { "uint32", PLYType::UInt32 },
+		{ "float", PLYType::Float32 }, { "float32", PLYType::Float32 }, { "double", PLYType::Float64 }, { "float64", PLYType::Float64 }
+	};
+	auto res = types.find(name);
+	return (res == types.end()) ? PLYType::Invalid : res->second;
+}
+
+static size_t plyTypeSize(PLYType type)
+{
+	switch (type)
+	{
+	case PLYType::Int8: case PLYType::UInt8: return 1;
+	case PLYType::Int16: case PLYType::UInt16: return 2;
+	case PLYType::Int32: case PLYType::UInt32: case PLYType::Float32: return 4;
+	case PLYType::Float64: return 8;
+	default: return 0;
+	}
+}
+
+// One value of any PLY type, converted to T. The renderer assumes a little-endian host, so
+// big-endian files are swapped
+template<typename T>
+static T plyRead(const uint8_t* data, PLYType type, bool swap)
+{
+	uint8_t bytes[8];
+	size_t size = plyTypeSize(type);
+	std::memcpy(bytes, data, size);
+	if (swap)
+		std::reverse(bytes, bytes + size);
+
+	auto as = [&](auto value)
+	{
+		std::memcpy(&value, bytes, sizeof(value));
+		return static_cast<T>(value);
+	};
+	switch (type)
+	{
+	case PLYType::Int8: return as(int8_t());
+	case PLYType::UInt8: return as(uint8_t());
+	case PLYType::Int16: return as(int16_t());
+	case PLYType::UInt16: return as(uint16_t());
+	case PLYType::Int32: return as(int32_t());
+	case PLYType::UInt32: return as(uint32_t());
+	case PLYType::Float32: return as(float());
+	case PLYType::Float64: return as(double());
+	default: return T(0);
+	}
+}
+
+static std::optional<PLYHeader> plyParseHeader(const char* data, size_t size, std::string& error)
+{
+	const char EndHeader[] = "end_header";
+	auto headerEnd = std::search(data, data + size, EndHeader, EndHeader + sizeof(EndHeader) - 1);
+	auto dataBegin = std::find(headerEnd, data + size, '\n');
+	if (dataBegin == data + size)
+	{
+		error = "header has no end_header";
+		return std::nullopt;
+	}
+
+	PLYHeader header;
+	header.dataOffset = dataBegin + 1 - data;
+	std::istringstream lines(std::string(data, headerEnd));
+	std::string line;
+	bool hasFormat = false;
+	while (std::getline(lines, line))
+	{
+		std::istringstream tokens(line);
+		std::string keyword;
+		tokens >> keyword;
+		if (keyword == "format")
+		{
+			std::string format;
+			tokens >> format;
+			if (format != "binary_little_endian" && format != "binary_big_endian")
+			{
+				error = "format " + format + " is not binary";
+				return std::nullopt;
+			}
+			header.bigEndian = (format == "binary_big_endian");
+			hasFormat = true;
+		}
+		else if (keyword == "element")
+		{
+			PLYElement element;
+			tokens >> element.name >> element.count;
+			if (!tokens)
+			{
+				error = "malformed element: " + line;
+				return std::nullopt;
+			}
+			header.elements.push_back(element);
+		}
+		else if (keyword == "property")
+		{
+			PLYProperty property;
+			std::string type;
+			tokens >> type;
+			bool isList = (type == "list");
+			if (isList)
+			{
+				std::string countType;
+				tokens >> countType >> type;
+				property.countType = plyType(countType);
+			}
+			tokens >> property.name;
+			property.type = plyType(type);
+			if (!tokens || header.elements.empty() || property.type == PLYType::Invalid ||
+				(isList && property.countType == PLYType::Invalid))
+			{
+				error = "malformed property: " + line;
+				return std::nullopt;
+			}
+			header.elements.back().properties.push_back(property);
+		}
+	}
+	if (!hasFormat)
+	{
+		error = "header has no format";
+		return std::nullopt;
+	}
+
+	for (auto& element : header.elements)
+	{
+		size_t offset = 0;
+		bool fixed = true;
+		for (auto& property : element.properties)
+		{
+			property.offset = offset;
+			fixed &= (property.countType == PLYType::Invalid);
+			offset += plyTypeSize(property.type);
+		}
+		element.recordSize = fixed ? offset : 0;
+	}
+	return header;
+}
+
+// Byte size of one property in a record, 0 if it runs past the available bytes
+static size_t plyPropertySize(const PLYProperty& property, const uint8_t* data, size_t available, bool swap)
+{
+	size_t countSize = 0, count = 1;
+	if (property.countType != PLYType::Invalid)
+	{
+		countSize = plyTypeSize(property.countType);
+		if (available < countSize)
+			return 0;
+		count = plyRead<uint32_t>(data, property.countType, swap);
+	}
+	size_t size = countSize + count * plyTypeSize(property.type);
+	return (size <= available) ? size : 0;
+}
+
+static size_t plyRecordSize(const PLYElement& element, const uint8_t* record, size_t available, bool swap)
+{
+	size_t size = 0;
+	for (const auto& property : element.properties)
+	{
+		size_t propertySize = plyPropertySize(property, record + size, available - size, swap);
+		if (propertySize == 0)
+			return 0;
+		size += propertySize;
+	}
+	return size;
+}
+
+static const PLYProperty* plyFindProperty(const PLYElement& element, std::initializer_list<const char*> names)
+{
+	for (const auto& property : element.properties)
+	{
+		for (auto name : names)
+		{
+			if (property.name == name)
+				return &property;
+		}
+	}
+	return nullptr;
+}
+
+bool PLYLoader::isBinaryPLY(const File::path& path)
+{
+	auto ext = path.extension().generic_string();
+	std::transform(ext.begin(), ext.end(), ext.begin(), [](char c) { return std::tolower(c); });
+	if (ext != ".ply")
+		return false;
+
+	std::ifstream file(path, std::ios::binary);
+	std::string line;
+	if (!std::getline(file, line) || line.compare(0, 3, "ply") != 0)
+		return false;
+	while (std::getline(file, line))
+	{
+		std::istringstream tokens(line);
+		std::string keyword, format;
+		tokens >> keyword >> format;
+		if (keyword == "comment" || keyword == "obj_info")
+			continue;
+		return keyword == "format" && format.compare(0, 7, "binary_") == 0;
+	}
+	return false;
+}
+
+ModelInstancePtr PLYLoader::load(const File::path& path, std::vector<std::string>& log, ThreadPool* pool)
+{
+	Timer timer;
+	MappedFile file(path);
+	if (!file.valid())
+	{
+		log.push_back("\t[PLY unable to map " + path.generic_string() + "]");
+		return nullptr;
+	}
+	auto data = reinterpret_cast<const uint8_t*>(file.data());
+	std::string error;
+	auto header = plyParseHeader(reinterpret_cast<const char*>(data), file.size(), error);
+	if (!header)
+	{
+		log.push_back("\t[PLY " + error + "]");
+		return nullptr;
+	}
+	bool swap = header->bigEndian;
+
+	// Locate the vertex and face data. Fixed-size elements in between are skipped in one step,
+	// others record by record; whatever follows the last one needed is never touched
+	const PLYElement* vertexElement = nullptr;
+	const PLYElement* faceElement = nullptr;
+	size_t vertexOffset = 0, faceOffset = 0;
+	size_t offset = header->dataOffset;
+	for (const auto& element : header->elements)
+	{
+		if (vertexElement && faceElement)
+			break;
+		if (element.name == "vertex")
+		{
+			vertexElement = &element;
+			vertexOffset = offset;
+		}
+		else if (element.name == "face")
+		{
+			faceElement = &element;
+			faceOffset = offset;
+		}
+		if (element.recordSize > 0)
+		{
+			if (element.count > (file.size() - offset) / element.recordSize)
+			{
+				log.push_back("\t[PLY " + element.name + " data truncated]");
+				return nullptr;
+			}
+			offset += element.count * element.recordSize;
+			continue;
+		}
+		for (size_t i = 0; i < element.count && !(vertexElement && faceElement); i++)
+		{
+			size_t size = plyRecordSize(element, data + offset, file.size() - offset, swap);
+			if (size == 0)
+			{
+				log.push_back("\t[PLY " + element.name + " data truncated]");
+				return nullptr;
+			}
+			offset += size;
+		}
+	}
+
+	if (!vertexElement || !faceElement || vertexElement->recordSize == 0)
+	{
+		log.push_back("\t[PLY needs a vertex element without lists and a face element]");
+		return nullptr;
+	}
+	if (vertexElement->count > INT_MAX || faceElement->count > INT_MAX)
+	{
+		log.push_back("\t[PLY too many vertices or faces]");
+		return nullptr;
+	}
+
+	const PLYProperty* position[3] =
+	{
+		plyFindProperty(*vertexElement, { "x" }), plyFindProperty(*vertexElement, { "y" }), plyFindProperty(*vertexElement, { "z" })
+	};
+	const PLYProperty* normal[3] =
+	{
+		plyFindProperty(*vertexElement, { "nx" }), plyFindProperty(*vertexElement, { "ny" }), plyFindProperty(*vertexElement, { "nz" })
+	};
+	const PLYProperty* texcoord[2] =
+	{
+		plyFindProperty(*vertexElement, { "u", "s", "texture_u", "texture_s" }),
+		plyFindProperty(*vertexElement, { "v", "t", "texture_v", "texture_t" })
+	};
+	const PLYProperty* faceIndices = plyFindProperty(*faceElement, { "vertex_indices", "vertex_index" });
+	if (!position[0] || !position[1] || !position[2] || !faceIndices || faceIndices->countType == PLYType::Invalid)
+	{
+		log.push_back("\t[PLY has no vertex positions or face indices]");
+		return nullptr;
+	}
+	bool hasNormals = normal[0] && normal[1] && normal[2];
+	bool hasTexcoords = texcoord[0] && texcoord[1];
+
+	// Consecutive little-endian floats are copied as a whole vector
+	auto packed = [&](const PLYProperty* const* properties, int n)
+	{
+		for (int i = 0; i < n; i++)
+		{
+			if (properties[i]->type != PLYType::Float32 ||
+				properties[i]->offset != properties[0]->offset + i * sizeof(float))
+				return false;
+		}
+		return !swap;
+	};
+	bool positionPacked = packed(position, 3);
+	bool normalPacked = hasNormals && packed(normal, 3);
+
+	// Every array is allocated once at its final size
+	auto meshData = MeshData::create();
+	size_t nVertices = vertexElement->count;
+	meshData->positions.resize(nVertices);
+	meshData->texcoords.resize(nVertices);
+	if (hasNormals)
+		meshData->normals.resize(nVertices);
+
+	std::optional<ThreadPool> localPool;
+	if (!pool)
+		pool = &localPool.emplace();
+	pool->parallelFor(static_cast<int>(nVertices), PLYGrainSize, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			const uint8_t* record = data + vertexOffset + vertexElement->recordSize * i;
+			auto& p = meshData->positions[i];
+			if (positionPacked)
+				std::memcpy(&p, record + position[0]->offset, sizeof(glm::vec3));
+			else
+			{
+				for (int c = 0; c < 3; c++)
+					p[c] = plyRead<float>(record + position[c]->offset, position[c]->type, swap);
+			}
+			if (normalPacked)
+				std::memcpy(&meshData->normals[i], record + normal[0]->offset, sizeof(glm::vec3));
+			else if (hasNormals)
+			{
+				for (int c = 0; c < 3; c++)
+					meshData->normals[i][c] = plyRead<float>(record + normal[c]->offset, normal[c]->type, swap);
+			}
+			// Flipped like Assimp's FlipUVs, so textures line up with the other importers
+			if (hasTexcoords)
+			{
+				meshData->texcoords[i] = glm::vec2(plyRead<float>(record + texcoord[0]->offset, texcoord[0]->type, swap),
+					1.0f - plyRead<float>(record + texcoord[1]->offset, texcoord[1]->type, swap));
+			}
+		}
+	});
+
+	// Scans are triangle meshes, so first assume every face is a triangle with no other list
+	// property: records then have a fixed size and decode in parallel. Anything else falls
+	// back to a serial walk that counts triangles before filling them in fan order
+	size_t nFaces = faceElement->count;
+	size_t indexSize = plyTypeSize(faceIndices->type);
+	size_t countSize = plyTypeSize(faceIndices->countType);
+	size_t triangleRecordSize = 0;
+	bool onlyIndexList = true;
+	for (const auto& property : faceElement->properties)
+	{
+		if (&property == faceIndices)
+			triangleRecordSize += countSize + 3 * indexSize;
+		else
+		{
+			onlyIndexList &= (property.countType == PLYType::Invalid);
+			triangleRecordSize += plyTypeSize(property.type);
+		}
+	}
+
+	std::atomic<bool> allTriangles(onlyIndexList && nFaces <= (file.size() - faceOffset) / triangleRecordSize);
+	std::atomic<bool> indexInRange(true);
+	if (allTriangles)
+	{
+		meshData->indices.resize(nFaces * 3);
+		pool->parallelFor(static_cast<int>(nFaces), PLYGrainSize, [&](int begin, int end)
+		{
+			bool triangles = true, inRange = true;
+			for (int i = begin; i < end && triangles; i++)
+			{
+				const uint8_t* list = data + faceOffset + triangleRecordSize * i + faceIndices->offset;
+				triangles = (plyRead<uint32_t>(list, faceIndices->countType, swap) == 3);
+				for (int j = 0; j < 3; j++)
+				{
+					uint32_t index = plyRead<uint32_t>(list + countSize + indexSize * j, faceIndices->type, swap);
+					meshData->indices[static_cast<size_t>(i) * 3 + j] = index;
+					inRange &= (index < nVertices);
+				}
+			}
+			if (!triangles)
+				allTriangles = false;
+			if (!inRange)
+				indexInRange = false;
+		});
+	}
+
+	if (!allTriangles)
+	{
+		// Calls func(list, count) with each face's index list, false if the data runs out
+		auto walkFaces = [&](auto&& func)
+		{
+			size_t cur = faceOffset;
+			for (size_t i = 0; i < nFaces; i++)
+			{
+				const uint8_t* list = nullptr;
+				size_t size = 0;
+				for (const auto& property : faceElement->properties)
+				{
+					if (&property == faceIndices)
+						list = data + cur + size;
+					size_t propertySize = plyPropertySize(property, data + cur + size, file.size() - cur - size, swap);
+					if (propertySize == 0)
+						return false;
+					size += propertySize;
+				}
+				func(list, plyRead<uint32_t>(list, faceIndices->countType, swap));
+				cur += size;
+			}
+			return true;
+		};
+
+		size_t nTriangles = 0;
+		if (!walkFaces([&](const uint8_t*, size_t count) { nTriangles += (count >= 3) ? count - 2 : 0; }))
+		{
+			log.push_back("\t[PLY face data truncated]");
+			return nullptr;
+		}
+
+		std::vector<uint32_t>().swap(meshData->indices);
+		meshData->indices.reserve(nTriangles * 3);
+		indexInRange = true;
+		walkFaces([&](const uint8_t* list, size_t count)
+		{
+			auto vertex = [&](size_t j)
+			{
+				uint32_t index = plyRead<uint32_t>(list + countSize + indexSize * j, faceIndices->type, swap);
+				if (index >= nVertices)
+					indexInRange = false;
+				return index;
+			};
+			for (size_t j = 2; j < count; j++)
+				meshData->indices.insert(meshData->indices.end(), { vertex(0), vertex(j - 1), vertex(j) });
+		});
+	}
+
+	if (!indexInRange)
+	{
+		log.push_back("\t[PLY face index out of range]");
+		return nullptr;
+	}
+	if (!hasNormals)
+		meshData->computeSmoothNormals();
+
+	log.push_back("\t[Mesh nVertices = " + std::to_string(nVertices) + ", nFaces = " +
+		std::to_string(meshData->indices.size() / 3) + "]");
+	log.push_back(std::string("\t[PLY decoded in ") + std::to_string(timer.get() * 1e-9) + " s with " +
+		std::to_string(pool->numThreads()) + " thread(s), " + (hasNormals ? "normals from file" : "normals generated") +
+		(allTriangles ? "" : ", polygons triangulated") + "]");
+
+	auto model = std::make_shared<ModelInstance>();
+	auto meshInstance = MeshInstance::create();
+	meshInstance->meshData = meshData;
+	model->meshInstances().push_back(meshInstance);
+	model->materials().push_back(Material());
+	return model;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "Model.h"
+#include "../util/File.h"
+
+class ThreadPool;
+
+// Binary PLY import for dense scans, bypassing Assimp. The file is mapped and vertices and
+// triangles are decoded straight into presized MeshData arrays in parallel chunks, so the only
+// allocations are the final mesh. Normals are generated only when the file has none; ASCII
+// files are left to Assimp
+class PLYLoader
+{
+public:
+	static bool isBinaryPLY(const File::path& path);
+
+	// Null on failure, one mesh with a single default material otherwise. Chunks run on pool
+	// when given, which may be the one the caller itself is a task of, else on a local pool
+	static ModelInstancePtr load(const File::path& path, std::vector<std::string>& log, ThreadPool* pool = nullptr);
+};
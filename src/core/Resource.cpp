@@ -1,11 +1,18 @@
 #include "Resource.h"
+#include "GLTFLoader.h"
+#include "MeshCache.h"
+#include "PLYLoader.h"
 #include "../util/Error.h"
+#include "../util/ThreadPool.h"
+#include "../util/Timer.h"
+
+#include <set>
 
 std::vector<ImagePtr> Resource::imagePool;
 std::map<File::path, int> Resource::mapPathToImageIndex;
 
 std::vector<MeshDataPtr> Resource::meshDataPool;
-std::map<File::path, ModelInstancePtr> Resource::mapPathToModelInstance;
+std::map<File::path, Resource::CachedModel> Resource::mapPathToModelInstance;
 
 ImagePtr Resource::getImageByIndex(int index)
 {
@@ -36,11 +43,37 @@ int Resource::addImage(const File::path& path, ImageDataType type)
 
 ModelInstancePtr Resource::createNewModelInstance(const File::path& path)
 {
-	auto model = std::make_shared<ModelInstance>();
+	auto imported = importModel(path);
+	return registerModel(imported);
+}
+
+Resource::ImportedModel Resource::importModel(const File::path& path, ThreadPool* pool)
+{
+	ImportedModel imported;
 	auto pathStr = path.generic_string();
+	imported.writeTime = writeTime(path);
+	imported.log.push_back("[ModelInstance loading: " + pathStr + " ...]");
+
+	// Formats with a dedicated loader skip Assimp and the mesh cache
+	bool isGLTF = GLTFLoader::isGLTF(path);
+	if (isGLTF || PLYLoader::isBinaryPLY(path))
+	{
+		if (isGLTF)
+			imported.model = GLTFLoader::load(path, imported.texturePaths, imported.log);
+		else
+		{
+			imported.model = PLYLoader::load(path, imported.log, pool);
+			if (imported.model)
+				imported.texturePaths.resize(imported.model->mMeshInstances.size());
+		}
+		if (!imported.model)
+			return imported;
+		imported.model->mPath = pathStr;
+		imported.log.push_back("\t[" + std::to_string(imported.model->mMaterials.size()) + " material(s)]");
+		imported.log.push_back("\t[" + std::to_string(imported.model->mMeshInstances.size()) + " mesh(es)]");
+		return imported;
+	}
 
-	model->mPath = pathStr;
-	Assimp::Importer importer;
 	uint32_t option = aiProcess_Triangulate
 		| aiProcess_FlipUVs
 		| aiProcess_GenSmoothNormals
@@ -53,15 +86,31 @@ ModelInstancePtr Resource::createNewModelInstance(const File::path& path)
 		//| aiProcess_ForceGenNormals
 		//| aiProcess_FindDegenerates
 		;
-	auto scene = importer.ReadFile(pathStr.c_str(), option);
 
-	Error::bracketLine<0>("ModelInstance loading: " + pathStr + " ...");
+	Timer timer;
+	if (auto cached = MeshCache::load(path, option, imported.log))
+	{
+		imported.model = cached->model;
+		imported.model->mPath = pathStr;
+		imported.texturePaths = cached->texturePaths;
+		imported.log.push_back("\t[Mesh cache " + MeshCache::filePath(path).generic_string() + " mapped in " +
+			std::to_string(timer.get() * 1e-9) + " s]");
+		imported.log.push_back("\t[" + std::to_string(imported.model->mMaterials.size()) + " material(s)]");
+		imported.log.push_back("\t[" + std::to_string(imported.model->mMeshInstances.size()) + " mesh(es)]");
+		return imported;
+	}
+
+	Assimp::Importer importer;
+	auto scene = importer.ReadFile(pathStr.c_str(), option);
 	if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
 	{
-		Error::bracketLine<0>("Assimp " + std::string(importer.GetErrorString()));
-		return nullptr;
+		imported.log.push_back("[Assimp " + std::string(importer.GetErrorString()) + "]");
+		return imported;
 	}
 
+	auto model = std::make_shared<ModelInstance>();
+	model->mPath = pathStr;
+
 	std::stack<aiNode*> stack;
 	stack.push(scene->mRootNode);
 	while (!stack.empty())
@@ -71,8 +120,10 @@ ModelInstancePtr Resource::createNewModelInstance(const File::path& path)
 		for (int i = 0; i < node->mNumMeshes; i++)
 		{
 			auto mesh = scene->mMeshes[node->mMeshes[i]];
+			File::path texturePath;
 			model->mMeshInstances.push_back(
-				createNewMeshInstance(mesh, scene, path.parent_path()));
+				createNewMeshInstance(mesh, scene, path.parent_path(), texturePath, imported.log));
+			imported.texturePaths.push_back(texturePath);
 		}
 		for (int i = 0; i < node->mNumChildren; i++)
 			stack.push(node->mChildren[i]);
@@ -87,17 +138,39 @@ ModelInstancePtr Resource::createNewModelInstance(const File::path& path)
 		mat.baseColor = *reinterpret_cast<glm::vec3*>(&albedo);
 		model->mMaterials.push_back(mat);
 	}
-	Error::line("\t[" + std::to_string(scene->mNumMaterials) + " material(s)]");
-	Error::line("\t[" + std::to_string(model->mMeshInstances.size()) + " mesh(es)]");
-	return model;
+	imported.log.push_back("\t[" + std::to_string(scene->mNumMaterials) + " material(s)]");
+	imported.log.push_back("\t[" + std::to_string(model->mMeshInstances.size()) + " mesh(es)]");
+	imported.model = model;
+	MeshCache::store(path, option, { model, imported.texturePaths }, imported.log);
+	return imported;
+}
+
+// Resolves textures through the image pool and creates the GL buffers, so must run on the GL thread
+ModelInstancePtr Resource::registerModel(ImportedModel& imported)
+{
+	for (const auto& line : imported.log)
+		Error::line(line);
+	if (!imported.model)
+		return nullptr;
+
+	auto& meshInstances = imported.model->mMeshInstances;
+	for (size_t i = 0; i < meshInstances.size(); i++)
+	{
+		if (!imported.texturePaths[i].empty())
+			meshInstances[i]->texIndex = addImage(imported.texturePaths[i], ImageDataType::Int8);
+		meshInstances[i]->meshData->createGLContext();
+		meshDataPool.push_back(meshInstances[i]->meshData);
+	}
+	mapPathToModelInstance[cacheKey(imported.model->mPath)] = { imported.model, imported.writeTime };
+	return imported.model;
 }
 
 ModelInstancePtr Resource::getModelInstanceByPath(const File::path& path)
 {
-	auto res = mapPathToModelInstance.find(path);
-	if (res == mapPathToModelInstance.end())
+	auto res = mapPathToModelInstance.find(cacheKey(path));
+	if (res == mapPathToModelInstance.end() || res->second.writeTime != writeTime(path))
 		return nullptr;
-	return res->second;
+	return res->second.model;
 }
 
 ModelInstancePtr Resource::openModelInstance(const File::path& path,
@@ -113,6 +186,82 @@ ModelInstancePtr Resource::openModelInstance(const File::path& path,
 	return newCopy;
 }
 
+void Resource::preloadModelInstances(const std::vector<File::path>& paths)
+{
+	std::vector<File::path> pending;
+	std::set<File::path> seen;
+	for (const auto& path : paths)
+	{
+		if (getModelInstanceByPath(path) == nullptr && seen.insert(cacheKey(path)).second)
+			pending.push_back(path);
+	}
+	if (pending.empty())
+		return;
+
+	Timer timer;
+	ThreadPool pool;
+	std::vector<ImportedModel> imported(pending.size());
+	pool.parallelFor(static_cast<int>(pending.size()), 1, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+			imported[i] = importModel(pending[i], &pool);
+	});
+
+	// Textures in order of first use, which is the order a serial load would add them in
+	std::vector<File::path> textures;
+	seen.clear();
+	for (const auto& model : imported)
+	{
+		for (const auto& texture : model.texturePaths)
+		{
+			if (!texture.empty() && mapPathToImageIndex.find(texture) == mapPathToImageIndex.end() &&
+				seen.insert(texture).second)
+				textures.push_back(texture);
+		}
+	}
+	std::vector<ImagePtr> images(textures.size());
+	pool.parallelFor(static_cast<int>(textures.size()), 1, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+			images[i] = Image::createFromFile(textures[i], ImageDataType::Int8);
+	});
+	for (size_t i = 0; i < textures.size(); i++)
+	{
+		if (!images[i])
+			continue;
+		mapPathToImageIndex[textures[i]] = imagePool.size();
+		imagePool.push_back(images[i]);
+	}
+
+	for (auto& model : imported)
+		registerModel(model);
+	Error::bracketLine<0>("Preloaded " + std::to_string(pending.size()) + " model(s) and " +
+		std::to_string(textures.size()) + " texture(s) in " + std::to_string(timer.get() * 1e-9) +
+		" s with " + std::to_string(pool.numThreads()) + " thread(s)");
+}
+
+size_t Resource::meshDataBytes()
+{
+	size_t bytes = 0;
+	for (const auto& meshData : meshDataPool)
+		bytes += meshData->byteSize();
+	return bytes;
+}
+
+File::path Resource::cacheKey(const File::path& path)
+{
+	std::error_code err;
+	auto absolute = File::absolute(path, err);
+	return (err ? path : absolute).lexically_normal();
+}
+
+File::file_time_type Resource::writeTime(const File::path& path)
+{
+	std::error_code err;
+	auto time = File::last_write_time(path, err);
+	return err ? File::file_time_type::min() : time;
+}
+
 void Resource::clear()
 {
 	imagePool.clear();
@@ -121,9 +270,10 @@ void Resource::clear()
 	mapPathToModelInstance.clear();
 }
 
-MeshInstancePtr Resource::createNewMeshInstance(aiMesh* mesh, const aiScene* scene, const File::path& instancePath)
+MeshInstancePtr Resource::createNewMeshInstance(aiMesh* mesh, const aiScene* scene, const File::path& instancePath,
+	File::path& texturePath, std::vector<std::string>& log)
 {
-	Error::line("\t[Mesh nVertices = " + std::to_string(mesh->mNumVertices) +
+	log.push_back("\t[Mesh nVertices = " + std::to_string(mesh->mNumVertices) +
 		", nFaces = " + std::to_string(mesh->mNumFaces) + "]");
 
 	auto meshInstance = MeshInstance::create();
@@ -158,11 +308,10 @@ MeshInstancePtr Resource::createNewMeshInstance(aiMesh* mesh, const aiScene* sce
 			std::filesystem::path path(str.C_Str());
 			if (!path.is_absolute())
 				path = instancePath / path;
-			Error::line("\t\t[Albedo texture " + path.generic_string() + "]");
-			meshInstance->texIndex = Resource::addImage(path, ImageDataType::Int8);
+			log.push_back("\t\t[Albedo texture " + path.generic_string() + "]");
+			texturePath = path;
 		}
 	}
-	meshData->createGLContext();
 	meshInstance->meshData = meshData;
 	return meshInstance;
 }
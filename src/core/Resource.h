@@ -8,6 +8,8 @@
 #include "Texture.h"
 #include "Model.h"
 
+class ThreadPool;
+
 class Resource
 {
 public:
@@ -16,15 +18,49 @@ public:
 	static int addImage(const File::path& path, ImageDataType type);
 	static std::vector<ImagePtr>& getAllImages() { return imagePool; }
 
+	// Bytes of CPU-side mesh data held once in the pool, however many instances share it
+	static size_t meshDataBytes();
+
 	static ModelInstancePtr createNewModelInstance(const File::path& path);
 	static ModelInstancePtr getModelInstanceByPath(const File::path& path);
 	static ModelInstancePtr openModelInstance(const File::path& path,
 		const glm::vec3& pos, const glm::vec3& scale = glm::vec3(1.0f), const glm::vec3& rotation = glm::vec3(0.0f));
 
+	// Imports the distinct paths not loaded yet and decodes their textures on a worker pool,
+	// then uploads and registers them on the calling thread in the order given, so image and
+	// mesh indices come out the same as loading them one by one. Later openModelInstance
+	// calls on these paths reuse the result
+	static void preloadModelInstances(const std::vector<File::path>& paths);
+
 	static void clear();
 
 private:
-	static MeshInstancePtr createNewMeshInstance(aiMesh* mesh, const aiScene* scene, const File::path& instancePath);
+	// CPU side of a model import, safe to produce on any thread. Holds one texture path per
+	// mesh instance (empty if none) and the log lines to print once registered
+	struct ImportedModel
+	{
+		ModelInstancePtr model;
+		File::file_time_type writeTime;
+		std::vector<File::path> texturePaths;
+		std::vector<std::string> log;
+	};
+
+	// Models are cached under their absolute path and reused while the file's write time is unchanged
+	struct CachedModel
+	{
+		ModelInstancePtr model;
+		File::file_time_type writeTime;
+	};
+
+	static File::path cacheKey(const File::path& path);
+	static File::file_time_type writeTime(const File::path& path);
+
+	// pool is the one the caller already runs on, if any, so loaders split work across it
+	// instead of starting their own threads
+	static ImportedModel importModel(const File::path& path, ThreadPool* pool = nullptr);
+	static ModelInstancePtr registerModel(ImportedModel& imported);
+	static MeshInstancePtr createNewMeshInstance(aiMesh* mesh, const aiScene* scene, const File::path& instancePath,
+		File::path& texturePath, std::vector<std::string>& log);
 
 private:
 	static std::vector<ImagePtr> imagePool;
@@ -32,5 +68,5 @@ private:
 
 	static std::vector<MeshDataPtr> meshDataPool;
 
-	static std::map<File::path, ModelInstancePtr> mapPathToModelInstance;
+	static std::map<File::path, CachedModel> mapPathToModelInstance;
 };
\ No newline at end of file
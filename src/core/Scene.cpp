@@ -2,7 +2,10 @@
 
 #include "../thirdparty/pugixml/pugixml.hpp"
 
+#include <map>
+#include <numeric>
 #include <sstream>
+#include <tuple>
 
 std::tuple<glm::vec3, glm::vec3, glm::vec3> loadTransform(const pugi::xml_node& node)
 {
@@ -78,6 +81,33 @@ bool Scene::load(const File::path& path)
 		// TODO: load toneMapping
 		Error::bracketLine<1>("Integrator " + integStr);
 	}
+	{
+		auto accelNode = scene.child("accelerator");
+		std::string builder(accelNode.child("builder").attribute("type").as_string());
+		if (builder == "standard")
+			bvhParam.method = BVHBuildParam::Standard;
+		else if (builder == "linear")
+			bvhParam.method = BVHBuildParam::Linear;
+		else if (builder == "gpu")
+			bvhParam.method = BVHBuildParam::LinearGPU;
+		else if (builder == "spatial")
+			bvhParam.method = BVHBuildParam::Spatial;
+		else
+			bvhParam.method = BVHBuildParam::Quick;
+		bvhParam.numThreads = accelNode.child("numThreads").attribute("value").as_int();
+		bvhParam.validate = accelNode.child("validate").attribute("value").as_bool();
+		bvhParam.compareQuick = accelNode.child("compareQuick").attribute("value").as_bool();
+		bvhParam.wideWidth = accelNode.child("wideWidth").attribute("value").as_int();
+		bvhParam.maxLeafSize = accelNode.child("maxLeafSize").attribute("value").as_int(4);
+		bvhParam.treeletPasses = accelNode.child("treeletPasses").attribute("value").as_int();
+		bvhParam.spatialBudget = accelNode.child("spatialBudget").attribute("value").as_float(0.3f);
+		bvhParam.refitThreshold = accelNode.child("refitThreshold").attribute("value").as_float(1.5f);
+		bvhParam.memoryBudget = accelNode.child("memoryBudget").attribute("value").as_int();
+		bvhCacheDir = accelNode.child("cache").attribute("path").as_string();
+		bvhShortStack = std::string(accelNode.child("traversal").attribute("type").as_string()) == "shortStack";
+		Error::bracketLine<1>("Accelerator BVH " + (builder.empty() ? std::string("quick") : builder) +
+			(bvhShortStack ? ", short-stack traversal" : ", MTBVH traversal"));
+	}
 	{
 		auto samplerNode = scene.child("sampler");
 		sampler = (std::string(samplerNode.attribute("type").as_string()) == "sobol") ? 1 : 0;
@@ -111,6 +141,11 @@ bool Scene::load(const File::path& path)
 	}
 	{
 		auto modelInstances = scene.child("modelInstances");
+		std::vector<File::path> modelPaths;
+		for (auto instance = modelInstances.first_child(); instance; instance = instance.next_sibling())
+			modelPaths.push_back(instance.attribute("path").as_string());
+		Resource::preloadModelInstances(modelPaths);
+
 		for (auto instance = modelInstances.first_child(); instance; instance = instance.next_sibling())
 		{
 			auto [model, radiance] = loadModelInstance(instance);
@@ -118,7 +153,12 @@ bool Scene::load(const File::path& path)
 				addLight(model, radiance.value());
 			else
 				addObject(model);
+			for (const auto& meshInstance : model->meshInstances())
+				meshBytesInstanced += meshInstance->meshData->byteSize();
 		}
+		meshBytes = Resource::meshDataBytes();
+		Error::bracketLine<1>("Mesh data " + std::to_string(meshBytes >> 10) + " KiB, " +
+			std::to_string(meshBytesInstanced >> 10) + " KiB referenced by instances");
 	}
 	{
 		envMap = EnvironmentMap::create(scene.child("envMap").attribute("path").as_string());
@@ -130,6 +170,29 @@ void Scene::saveToFile(const File::path& path)
 {
 }
 
+AABB transformBound(const AABB& bound, const glm::mat4& transform)
+{
+	AABB ret;
+	for (int i = 0; i < 8; i++)
+	{
+		glm::vec3 corner((i & 1) ? bound.pMax.x : bound.pMin.x,
+			(i & 2) ? bound.pMax.y : bound.pMin.y,
+			(i & 4) ? bound.pMax.z : bound.pMin.z);
+		ret.expand(AABB(glm::vec3(transform * glm::vec4(corner, 1.0f))));
+	}
+	return ret;
+}
+
+void appendTransformRows(std::vector<glm::vec4>& rows, const glm::mat4& transform)
+{
+	glm::mat4 toWorld = glm::transpose(transform);
+	glm::mat4 toObject = glm::transpose(glm::inverse(transform));
+	for (int i = 0; i < 3; i++)
+		rows.push_back(toWorld[i]);
+	for (int i = 0; i < 3; i++)
+		rows.push_back(toObject[i]);
+}
+
 void Scene::createGLContext(bool resetTextures)
 {
 	std::vector<glm::vec3> vertices;
@@ -141,40 +204,71 @@ void Scene::createGLContext(bool resetTextures)
 	lightSumPdf = 0.0f;
 	nLightTriangles = 0;
 	objPrimCount = 0;
+	blases.clear();
+	instances.clear();
 
-	uint32_t offIndVertex = 0;
 	uint32_t offIndMaterial = 0;
 
-	for (const auto& object : objects)
+	// Objects keep their meshes in object space; copies of a model share one BLAS
+	using BLASKey = std::vector<std::tuple<MeshData*, int, int>>;
+	std::map<BLASKey, int> blasIndices;
+
+	for (size_t objIndex = 0; objIndex < objects.size(); objIndex++)
 	{
+		const auto& object = objects[objIndex];
 		auto modelMat = object->materials();
 		materials.insert(materials.end(), modelMat.begin(), modelMat.end());
 
-		auto model = object->modelMatrix();
-		glm::mat3 modelInv = glm::transpose(glm::inverse(model));
-
+		BLASKey key;
 		for (const auto& meshInstance : object->meshInstances())
 		{
-			const auto& meshData = meshInstance->meshData;
-			for (const auto& v : meshData->positions)
-				vertices.push_back(model * glm::vec4(v, 1.0f));
-			for (const auto& n : meshData->normals)
-				normals.push_back(glm::normalize(modelInv * n));
-			for (const auto& t : meshData->texcoords)
-				texCoords.push_back(t);
-			for (const auto& i : meshData->indices)
-				indices.push_back(i + offIndVertex);
-			for (size_t i = 0; i < meshData->indices.size() / 3; i++)
-				matTexIndices.push_back(offIndMaterial + (meshInstance->texIndex << 16 | meshInstance->matIndex));
+			key.push_back({ meshInstance->meshData.get(), meshInstance->texIndex, meshInstance->matIndex });
 			meshInstance->globalMatIndex = (meshInstance->matIndex != -1) ?
 				meshInstance->matIndex + offIndMaterial : -1;
+		}
+
+		auto itr = blasIndices.find(key);
+		if (itr == blasIndices.end())
+		{
+			SceneBLAS blas;
+			blas.vertexBase = vertices.size();
+			blas.primBase = indices.size() / 3;
+
+			for (const auto& meshInstance : object->meshInstances())
+			{
+				const auto& meshData = meshInstance->meshData;
+				uint32_t offIndVertex = vertices.size();
+				vertices.insert(vertices.end(), meshData->positions.begin(), meshData->positions.end());
+				normals.insert(normals.end(), meshData->normals.begin(), meshData->normals.end());
+				texCoords.insert(texCoords.end(), meshData->texcoords.begin(), meshData->texcoords.end());
+				for (const auto& i : meshData->indices)
+					indices.push_back(i + offIndVertex);
+				for (size_t i = 0; i < meshData->indices.size() / 3; i++)
+					matTexIndices.push_back(meshInstance->texIndex << 16 | meshInstance->matIndex);
+			}
+			blas.vertexCount = vertices.size() - blas.vertexBase;
+			blas.primCount = indices.size() / 3 - blas.primBase;
+
+			itr = blasIndices.insert({ key, static_cast<int>(blases.size()) }).first;
+			blases.push_back(blas);
+		}
 
-			offIndVertex += meshData->positions.size();
-			objPrimCount += meshData->indices.size() / 3;
+		int primCount = blases[itr->second].primCount;
+		if (primCount > 0)
+		{
+			instances.push_back({ itr->second, static_cast<int>(objIndex), static_cast<int>(offIndMaterial), objPrimCount,
+				object->modelMatrix() });
+			objPrimCount += primCount;
 		}
 		offIndMaterial += modelMat.size();
 	}
 
+	// Light triangles are sampled in world space, so they form one BLAS under an identity
+	// instance whose primitive ids start at uObjPrimCount
+	SceneBLAS lightBLAS;
+	lightBLAS.vertexBase = vertices.size();
+	lightBLAS.primBase = indices.size() / 3;
+
 	for (const auto light : lights)
 	{
 		auto lt = light.first;
@@ -184,18 +278,25 @@ void Scene::createGLContext(bool resetTextures)
 		for (const auto& meshInstance : lt->meshInstances())
 		{
 			const auto& meshData = meshInstance->meshData;
+			uint32_t offIndVertex = vertices.size();
 			for (const auto& v : meshData->positions)
 				vertices.push_back(model * glm::vec4(v, 1.0f));
 			for (const auto& n : meshData->normals)
 				normals.push_back(glm::normalize(modelInv * n));
+			texCoords.resize(vertices.size());
 			for (const auto& i : meshData->indices)
 				indices.push_back(offIndVertex + i);
-			offIndVertex += meshData->positions.size();
+			matTexIndices.resize(indices.size() / 3, 0);
 		}
 	}
-
-	BVH bvh(vertices, indices);
-	auto bvhBuf = bvh.build();
+	lightBLAS.vertexCount = vertices.size() - lightBLAS.vertexBase;
+	lightBLAS.primCount = indices.size() / 3 - lightBLAS.primBase;
+	if (lightBLAS.primCount > 0)
+	{
+		instances.push_back({ static_cast<int>(blases.size()), -1, 0, objPrimCount, glm::mat4(1.0f) });
+		blases.push_back(lightBLAS);
+	}
+	Error::check(!instances.empty(), "[Scene] nothing to render");
 
 	Error::bracketLine<0>("Scene generating light sampling table");
 
@@ -240,14 +341,51 @@ void Scene::createGLContext(bool resetTextures)
 			nLightTriangles += meshData->indices.size() / 3;
 		}
 	}
-	auto [lightAlias, lightProb] = AliasTable::build<int32_t>(pdf);
 
 	glContext.vertex = TextureBuffered::createFromVector(vertices, TextureFormat::Col3x32f);
-	glContext.normal = TextureBuffered::createFromVector(normals, TextureFormat::Col3x32f);
-	glContext.texCoord = TextureBuffered::createFromVector(texCoords, TextureFormat::Col2x32f);
 	glContext.index = TextureBuffered::createFromVector(indices, TextureFormat::Col1x32i);
-	glContext.bound = TextureBuffered::createFromVector(bvhBuf.bounds, TextureFormat::Col3x32f);
-	glContext.hitTable = TextureBuffered::createFromVector(bvhBuf.hitTable, TextureFormat::Col3x32i);
+	auto primOrder = createAccelerator(vertices, indices);
+	glContext.vertex = nullptr;
+	glContext.index = nullptr;
+
+	// Traversal reads a triangle's corner and edges from one place instead of chasing its
+	// indices, and shading attributes are kept apart so they are only fetched on a hit
+	size_t nTriangles = indices.size() / 3;
+	std::vector<glm::vec3> triangles(nTriangles * 3);
+	std::vector<glm::vec4> triangleShading(nTriangles * 4);
+	for (size_t i = 0; i < nTriangles; i++)
+	{
+		uint32_t ia = indices[i * 3 + 0];
+		uint32_t ib = indices[i * 3 + 1];
+		uint32_t ic = indices[i * 3 + 2];
+		triangles[i * 3 + 0] = vertices[ia];
+		triangles[i * 3 + 1] = vertices[ib] - vertices[ia];
+		triangles[i * 3 + 2] = vertices[ic] - vertices[ia];
+		triangleShading[i * 4 + 0] = glm::vec4(normals[ia], texCoords[ia].x);
+		triangleShading[i * 4 + 1] = glm::vec4(normals[ib], texCoords[ib].x);
+		triangleShading[i * 4 + 2] = glm::vec4(normals[ic], texCoords[ic].x);
+		triangleShading[i * 4 + 3] = glm::vec4(texCoords[ia].y, texCoords[ib].y, texCoords[ic].y, 0.0f);
+	}
+	glContext.triangle = TextureBuffered::createFromVector(triangles, TextureFormat::Col3x32f);
+	glContext.triangleShading = TextureBuffered::createFromVector(triangleShading, TextureFormat::Col4x32f);
+
+	// Per-triangle data follows the triangles into leaf order, light triangles included
+	std::vector<uint32_t> orderedMatTexIndices(matTexIndices.size());
+	for (size_t i = 0; i < primOrder.size(); i++)
+		orderedMatTexIndices[i] = matTexIndices[primOrder[i]];
+	matTexIndices.swap(orderedMatTexIndices);
+
+	std::vector<glm::vec3> orderedLightPower(lightPower.size());
+	std::vector<float> orderedPdf(pdf.size());
+	for (int i = 0; i < lightBLAS.primCount; i++)
+	{
+		int light = primOrder[lightBLAS.primBase + i] - lightBLAS.primBase;
+		orderedLightPower[i] = lightPower[light];
+		orderedPdf[i] = pdf[light];
+	}
+	lightPower.swap(orderedLightPower);
+	auto [lightAlias, lightProb] = AliasTable::build<int32_t>(orderedPdf);
+
 	glContext.matTexIndex = TextureBuffered::createFromVector(matTexIndices, TextureFormat::Col1x32i);
 	glContext.material = TextureBuffered::createFromVector(materials, TextureFormat::Col4x32f);
 	glContext.lightPower = TextureBuffered::createFromVector(lightPower, TextureFormat::Col3x32f);
@@ -263,10 +401,329 @@ void Scene::createGLContext(bool resetTextures)
 		noiseTex = Sampler::genNoiseTexture(filmWidth, filmHeight);
 	}
 	vertexCount = vertices.size();
-	triangleCount = vertices.size() / 3;
-	boxCount = bvhBuf.bounds.size();
+	triangleCount = indices.size() / 3;
+	instancedTriangleCount = objPrimCount + nLightTriangles;
 
 	Error::bracketLine<0>("Scene GL context created");
+	Error::bracketLine<1>(std::to_string(instances.size()) + " instances of " + std::to_string(blases.size()) + " BLASes");
+}
+
+std::vector<int> Scene::createAccelerator(const std::vector<glm::vec3>& vertices, std::vector<uint32_t>& indices)
+{
+	// The TLAS goes first, sized for the instance count so it can be rebuilt in place.
+	// Collapsing never yields more wide nodes than the binary tree has interior nodes
+	int nInstances = instances.size();
+	tlasSize = nInstances * 2 - 1;
+	int tlasWideSize = std::max(nInstances - 1, 1);
+
+	bool buildOnGPU = bvhParam.method == BVHBuildParam::LinearGPU;
+	int wideWidth = buildOnGPU ? 0 : bvhParam.wideWidth;
+	auto isGPUBuilt = [&](const SceneBLAS& blas) { return buildOnGPU && blas.primCount >= 2; };
+
+	bvhStats = BVHStatistics();
+	double sumSAHCost = 0.0;
+
+	std::unique_ptr<BVHCache> cache;
+	if (!bvhCacheDir.empty())
+		cache = std::make_unique<BVHCache>(bvhCacheDir);
+
+	// CPU trees are built before the layout because spatial splits make their size unknown.
+	// Cached trees stay mapped until they are uploaded
+	std::vector<PackedBVH> cpuTrees(blases.size());
+	std::vector<PackedBVHView> cpuViews(blases.size());
+	for (size_t i = 0; i < blases.size(); i++)
+	{
+		auto& blas = blases[i];
+		if (isGPUBuilt(blas))
+		{
+			blas.treeSize = blas.primCount * 2 - 1;
+			continue;
+		}
+		BVHBuildParam param = bvhParam;
+		if (buildOnGPU)
+			param.method = BVHBuildParam::Quick;
+		param.wideWidth = wideWidth;
+
+		std::vector<glm::vec3> blasVertices(vertices.begin() + blas.vertexBase,
+			vertices.begin() + blas.vertexBase + blas.vertexCount);
+		std::vector<uint32_t> blasIndices(indices.begin() + blas.primBase * 3,
+			indices.begin() + (blas.primBase + blas.primCount) * 3);
+		for (auto& index : blasIndices)
+			index -= blas.vertexBase;
+
+		uint64_t key = 0;
+		if (cache)
+		{
+			key = BVHCache::key(blasVertices, blasIndices, param);
+			if (auto cached = cache->load(key))
+			{
+				cpuViews[i] = *cached;
+				blas.treeSize = cpuViews[i].treeSize;
+				continue;
+			}
+		}
+		cpuTrees[i] = BVH(std::move(blasVertices), std::move(blasIndices), param).build();
+		if (cache)
+			cache->store(key, cpuTrees[i]);
+		cpuViews[i] = PackedBVHView::fromPacked(cpuTrees[i]);
+		blas.treeSize = cpuViews[i].treeSize;
+	}
+
+	int nodeCount = tlasSize;
+	for (auto& blas : blases)
+	{
+		blas.nodeBase = nodeCount;
+		nodeCount += blas.treeSize;
+	}
+	auto boundBuffer = Buffer::create(sizeof(AABB) * nodeCount, nullptr);
+	int segments = hitTableSegments();
+	auto hitTableBuffer = Buffer::create(sizeof(int) * segments * nodeCount, nullptr);
+
+	std::vector<glm::vec3> wideBounds(tlasWideSize * wideWidth * 2);
+	std::vector<int> wideChildren(tlasWideSize * wideWidth, WIDE_BVH_EMPTY);
+	blasWideMaxDepth = 0;
+
+	std::vector<int> primOrder(indices.size() / 3);
+	std::iota(primOrder.begin(), primOrder.end(), 0);
+
+	// Triangles of a BLAS are stored in the order the leaves referencing them are stored,
+	// which is depth first, so that leaves address contiguous ranges and neighbouring leaves
+	// neighbouring triangle records. Collapsed CPU trees are laid out that way already; trees
+	// with one triangle per leaf, spatial splits and the GPU builder address triangles in
+	// input order and are renumbered. A reference duplicated by spatial splits keeps the slot
+	// of its first leaf. nodeInfo is segment 0 of the hit table, leaf ranges index treePrimOrder,
+	// or triangles directly when it is null. Returns the mapping from old to new leaf info
+	auto placeInLeafOrder = [&](const SceneBLAS& blas, const int* nodeInfo, const int* treePrimOrder)
+	{
+		auto treePrim = [=](int i) { return treePrimOrder ? treePrimOrder[i] : i; };
+		std::vector<int> slots(blas.primCount, -1);
+		std::vector<int> leafPrims;
+		leafPrims.reserve(blas.primCount);
+		for (int k = 0; k < blas.treeSize; k++)
+		{
+			if (nodeInfo[k] >= 0)
+				continue;
+			int first = bvhLeafFirst(nodeInfo[k]);
+			for (int i = first; i < first + bvhLeafCount(nodeInfo[k]); i++)
+			{
+				int prim = treePrim(i);
+				if (slots[prim] == -1)
+				{
+					slots[prim] = leafPrims.size();
+					leafPrims.push_back(prim);
+				}
+			}
+		}
+		for (int prim = 0; prim < blas.primCount; prim++)
+		{
+			if (slots[prim] == -1)
+			{
+				slots[prim] = leafPrims.size();
+				leafPrims.push_back(prim);
+			}
+		}
+
+		std::vector<uint32_t> blasIndices(indices.begin() + blas.primBase * 3,
+			indices.begin() + (blas.primBase + blas.primCount) * 3);
+		for (int j = 0; j < blas.primCount; j++)
+		{
+			int prim = leafPrims[j];
+			primOrder[blas.primBase + j] = blas.primBase + prim;
+			std::copy(blasIndices.begin() + prim * 3, blasIndices.begin() + prim * 3 + 3, indices.begin() + (blas.primBase + j) * 3);
+		}
+		return [=](int info) { return (info & ~BVH_LEAF_FIRST_MASK) | slots[treePrim(bvhLeafFirst(info))]; };
+	};
+
+	for (size_t i = 0; i < blases.size(); i++)
+	{
+		auto& blas = blases[i];
+		if (isGPUBuilt(blas))
+		{
+			if (gpuBVHBuilder == nullptr)
+				gpuBVHBuilder = GPUBVHBuilder::create();
+			auto gpuBVH = gpuBVHBuilder->build(glContext.vertex, glContext.index, blas.primBase, blas.primCount,
+				boundBuffer, hitTableBuffer, blas.nodeBase, segments, bvhParam.validate);
+			blas.bound = gpuBVH.rootBound;
+			bvhStats.buildTime += gpuBVH.stats.buildTime;
+			sumSAHCost += gpuBVH.stats.sahCost * blas.primCount;
+
+			if (bvhParam.validate)
+			{
+				BVHBuildParam cpuParam = bvhParam;
+				cpuParam.method = BVHBuildParam::Linear;
+				cpuParam.wideWidth = 0;
+				std::vector<glm::vec3> blasVertices(vertices.begin() + blas.vertexBase,
+					vertices.begin() + blas.vertexBase + blas.vertexCount);
+				std::vector<uint32_t> blasIndices(indices.begin() + blas.primBase * 3,
+					indices.begin() + (blas.primBase + blas.primCount) * 3);
+				for (auto& index : blasIndices)
+					index -= blas.vertexBase;
+				float cpuCost = BVH(blasVertices, blasIndices, cpuParam).build().stats.sahCost;
+				Error::bracketLine<0>("BVH validation SAH cost GPU " + std::to_string(gpuBVH.stats.sahCost) +
+					", CPU linear " + std::to_string(cpuCost) +
+					", relative difference " + std::to_string((gpuBVH.stats.sahCost - cpuCost) / cpuCost));
+			}
+
+			std::vector<int> nodeInfo(blas.treeSize);
+			hitTableBuffer->read(sizeof(int) * segments * blas.nodeBase, sizeof(int) * blas.treeSize, nodeInfo.data());
+			auto relabel = placeInLeafOrder(blas, nodeInfo.data(), nullptr);
+			for (auto& info : nodeInfo)
+				info = (info < 0) ? relabel(info) : info;
+			hitTableBuffer->write(sizeof(int) * segments * blas.nodeBase, sizeof(int) * blas.treeSize, nodeInfo.data());
+			continue;
+		}
+
+		const auto& packed = cpuViews[i];
+		boundBuffer->write(sizeof(AABB) * blas.nodeBase, sizeof(AABB) * blas.treeSize, packed.bounds);
+		auto relabel = placeInLeafOrder(blas, packed.hitTable, packed.primOrder);
+		std::vector<int> nodeInfo(packed.hitTable, packed.hitTable + blas.treeSize);
+		for (auto& info : nodeInfo)
+			info = (info < 0) ? relabel(info) : info;
+		// Short-stack traversal only reads segment 0, the node info
+		hitTableBuffer->write(sizeof(int) * segments * blas.nodeBase, sizeof(int) * blas.treeSize, nodeInfo.data());
+		hitTableBuffer->write(sizeof(int) * (segments * blas.nodeBase + blas.treeSize), sizeof(int) * (segments - 1) * blas.treeSize,
+			packed.hitTable + blas.treeSize);
+		blas.bound = packed.bounds[0];
+		bvhStats.buildTime += packed.stats.buildTime;
+		bvhStats.cachedTrees += packed.stats.cachedTrees;
+		if (!buildOnGPU && packed.stats.cachedTrees == 0)
+			bvhStats.numThreads = std::max(bvhStats.numThreads, packed.stats.numThreads);
+		sumSAHCost += packed.stats.sahCost * blas.primCount;
+
+		if (wideWidth > 0)
+		{
+			blas.wideBase = wideChildren.size() / wideWidth;
+			int wideSlots = packed.wideNodeCount * packed.wideWidth;
+			wideBounds.insert(wideBounds.end(), packed.wideBounds, packed.wideBounds + wideSlots * 2);
+			for (int j = 0; j < wideSlots; j++)
+			{
+				int child = packed.wideChildren[j];
+				wideChildren.push_back((child != WIDE_BVH_EMPTY && (child & BVH_LEAF_MASK)) ? relabel(child) : child);
+			}
+			blasWideMaxDepth = std::max(blasWideMaxDepth, packed.wideMaxDepth);
+		}
+		cpuViews[i] = PackedBVHView();
+		cpuTrees[i] = PackedBVH();
+	}
+
+	glContext.bound = TextureBuffered::createFromBuffer(boundBuffer, TextureFormat::Col3x32f);
+	glContext.hitTable = TextureBuffered::createFromBuffer(hitTableBuffer, TextureFormat::Col1x32i);
+
+	buildTLAS();
+	bvhStats.buildTime += tlas.stats.buildTime;
+
+	// Two texels of (primOffset, matOffset, primBase, nodeBase), (treeSize, wideBase) per
+	// instance, then six rows per instance: object to world, then world to object
+	std::vector<glm::ivec4> instanceInfo;
+	std::vector<glm::vec4> instanceTransforms;
+	for (const auto& instance : instances)
+	{
+		const auto& blas = blases[instance.blas];
+		instanceInfo.push_back({ instance.primOffset, instance.matOffset, blas.primBase, blas.nodeBase });
+		instanceInfo.push_back({ blas.treeSize, blas.wideBase, 0, 0 });
+		appendTransformRows(instanceTransforms, instance.transform);
+	}
+	glContext.instance = TextureBuffered::createFromVector(instanceInfo, TextureFormat::Col4x32i);
+	glContext.instanceTransform = TextureBuffered::createFromVector(instanceTransforms, TextureFormat::Col4x32f);
+	bvhStats.sahCost = static_cast<float>(sumSAHCost / (indices.size() / 3));
+	bvhStats.bytesPerTriangle = static_cast<float>(nodeCount * (sizeof(AABB) + segments * sizeof(int))) / (indices.size() / 3);
+	bvhStats.bytesPerTriangleUncompressed = static_cast<float>(nodeCount * (sizeof(AABB) + 18 * sizeof(int))) / (indices.size() / 3);
+	boxCount = nodeCount;
+
+	wideBVHWidth = 0;
+	if (wideWidth > 0)
+	{
+		std::copy(tlas.wide.bounds.begin(), tlas.wide.bounds.end(), wideBounds.begin());
+		std::copy(tlas.wide.children.begin(), tlas.wide.children.end(), wideChildren.begin());
+		int wideMaxDepth = std::max(blasWideMaxDepth, tlas.wide.maxDepth);
+
+		if ((wideWidth - 1) * wideMaxDepth + 1 > WIDE_BVH_STACK_SIZE)
+			Error::bracketLine<0>("Scene wide BVH too deep for the traversal stack, disabled");
+		else
+		{
+			glContext.wideBound = TextureBuffered::createFromVector(wideBounds, TextureFormat::Col3x32f);
+			glContext.wideChildren = TextureBuffered::createFromVector(wideChildren, TextureFormat::Col1x32i);
+			wideBVHWidth = wideWidth;
+		}
+	}
+	if (wideBVHWidth == 0)
+	{
+		// Keep the samplers bound to something valid when integrators fall back to MTBVH
+		glContext.wideBound = TextureBuffered::createFromVector(std::vector<glm::vec3>(2), TextureFormat::Col3x32f);
+		glContext.wideChildren = TextureBuffered::createFromVector(std::vector<int>{ WIDE_BVH_EMPTY }, TextureFormat::Col1x32i);
+	}
+	return primOrder;
+}
+
+std::vector<AABB> Scene::instanceBounds() const
+{
+	std::vector<AABB> bounds;
+	for (const auto& instance : instances)
+		bounds.push_back(transformBound(blases[instance.blas].bound, instance.transform));
+	return bounds;
+}
+
+void Scene::buildTLAS()
+{
+	BVHBuildParam param = bvhParam;
+	if (param.method == BVHBuildParam::LinearGPU)
+	{
+		param.method = BVHBuildParam::Quick;
+		param.wideWidth = 0;
+	}
+	// Traversal expects exactly one instance per TLAS leaf
+	param.maxLeafSize = 1;
+	tlas = BVH(instanceBounds(), param).build();
+	tlasBuildRatio = BVH::nodeAreaRatio(tlas);
+
+	glContext.bound->write(0, sizeof(AABB) * tlasSize, tlas.bounds.data());
+	glContext.hitTable->write(0, sizeof(int) * hitTableSegments() * tlasSize, tlas.hitTable.data());
+}
+
+bool Scene::refitTransforms()
+{
+	if (instances.empty())
+		return false;
+
+	// Only the instance transforms and the TLAS change; BLASes stay in object space
+	std::vector<glm::vec4> rows;
+	for (size_t i = 0; i < instances.size(); i++)
+	{
+		auto& instance = instances[i];
+		if (instance.object == -1)
+			continue;
+		glm::mat4 transform = objects[instance.object]->modelMatrix();
+		if (transform == instance.transform)
+			continue;
+		instance.transform = transform;
+
+		rows.clear();
+		appendTransformRows(rows, transform);
+		glContext.instanceTransform->write(sizeof(glm::vec4) * 6 * i, sizeof(glm::vec4) * 6, rows.data());
+	}
+
+	BVH::refit(tlas, instanceBounds());
+	float ratio = BVH::nodeAreaRatio(tlas);
+	bool rebuilt = ratio > tlasBuildRatio * bvhParam.refitThreshold;
+	if (rebuilt)
+	{
+		Error::bracketLine<0>("TLAS refit node area ratio " + std::to_string(ratio) + " over " +
+			std::to_string(tlasBuildRatio) + " after build, rebuilding");
+		buildTLAS();
+	}
+	else
+		glContext.bound->write(0, sizeof(AABB) * tlasSize, tlas.bounds.data());
+
+	if (wideBVHWidth > 0)
+	{
+		// A rebuilt TLAS that no longer fits the traversal stack needs the full path
+		if ((wideBVHWidth - 1) * std::max(blasWideMaxDepth, tlas.wide.maxDepth) + 1 > WIDE_BVH_STACK_SIZE)
+			return false;
+		glContext.wideBound->write(0, sizeof(glm::vec3) * tlas.wide.bounds.size(), tlas.wide.bounds.data());
+		if (rebuilt)
+			glContext.wideChildren->write(0, sizeof(int) * tlas.wide.children.size(), tlas.wide.children.data());
+	}
+	return true;
 }
 
 void Scene::clear()
@@ -274,6 +731,7 @@ void Scene::clear()
 	objects.clear();
 	lights.clear();
 	materials.clear();
+	meshBytes = meshBytesInstanced = 0;
 }
 
 void Scene::addObject(ModelInstancePtr object)
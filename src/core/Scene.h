@@ -1,6 +1,8 @@
 #pragma once
 
 #include "../accelerator/BVH.h"
+#include "../accelerator/BVHCache.h"
+#include "../accelerator/GPUBVH.h"
 #include "../math/AliasTable.h"
 #include "EnvironmentMap.h"
 #include "Texture.h"
@@ -11,12 +13,16 @@
 
 struct SceneGLContext
 {
-	TextureBufferedPtr vertex;
-	TextureBufferedPtr normal;
-	TextureBufferedPtr texCoord;
+	TextureBufferedPtr vertex;	// Raw geometry, only read by the GPU builder and released after it
 	TextureBufferedPtr index;
+	TextureBufferedPtr triangle;
+	TextureBufferedPtr triangleShading;
 	TextureBufferedPtr bound;
 	TextureBufferedPtr hitTable;
+	TextureBufferedPtr wideBound;
+	TextureBufferedPtr wideChildren;
+	TextureBufferedPtr instance;
+	TextureBufferedPtr instanceTransform;
 	TextureBufferedPtr matTexIndex;
 	TextureBufferedPtr material;
 	TextureBufferedPtr lightPower;
@@ -26,6 +32,29 @@ struct SceneGLContext
 	TextureBufferedPtr texUVScale;
 };
 
+// Triangles of one set of meshes, in object space, in the scene's shared geometry buffers.
+// Model instances made of the same meshes with the same per-mesh materials share one
+struct SceneBLAS
+{
+	int vertexBase;
+	int vertexCount;
+	int primBase;
+	int primCount;
+	int nodeBase = 0;
+	int treeSize = 0;
+	int wideBase = 0;
+	AABB bound;
+};
+
+struct SceneInstance
+{
+	int blas;
+	int object;	// Index into Scene::objects, -1 for the world-space light instance
+	int matOffset;
+	int primOffset;	// First scene-wide primitive id of the instance
+	glm::mat4 transform;
+};
+
 class Scene
 {
 public:
@@ -33,6 +62,7 @@ public:
 	void saveToFile(const File::path& path);
 
 	void createGLContext(bool resetTextures);
+	bool refitTransforms();
 	void clear();
 
 	void addObject(ModelInstancePtr object);
@@ -42,6 +72,10 @@ public:
 	void setCameraCurrent() { camera = previewCamera; }
 	void resetPreviewCamera() { previewCamera = originalCamera; }
 
+	// Int segments per node in the hit table, and the matching defines for intersection.glsl
+	int hitTableSegments() const { return bvhShortStack ? 1 : 6; }
+	std::string traversalDefines() const { return bvhShortStack ? "#define BVH_SHORT_STACK\n" : ""; }
+
 public:
 	std::vector<ModelInstancePtr> objects;
 	std::vector<std::pair<ModelInstancePtr, glm::vec3>> lights;
@@ -53,9 +87,22 @@ public:
 	int objPrimCount = 0;
 
 	SceneGLContext glContext;
+	BVHBuildParam bvhParam;
+	bool bvhShortStack = false;	// Nearest-first traversal with a short stack instead of MTBVH threading
+	File::path bvhCacheDir;	// Empty to always build
+	BVHStatistics bvhStats;
+	GPUBVHBuilderPtr gpuBVHBuilder;
 	int vertexCount;
 	int triangleCount;
 	int boxCount;
+	int tlasSize;
+	int instancedTriangleCount;
+	size_t meshBytes = 0;	// CPU mesh data of the distinct imported models
+	size_t meshBytesInstanced = 0;	// What it would take with one copy per model instance
+	std::vector<SceneBLAS> blases;
+	std::vector<SceneInstance> instances;
+	PackedBVH tlas;
+	int wideBVHWidth = 0;	// 0 when no wide BVH is available for traversal
 
 	Camera originalCamera;
 	Camera previewCamera;
@@ -70,4 +117,14 @@ public:
 	Texture2DPtr noiseTex;
 
 	float envRotation = 0.0f;
+
+private:
+	// Reorders each BLAS's triangles into leaf order, returning the previous index of each
+	std::vector<int> createAccelerator(const std::vector<glm::vec3>& vertices, std::vector<uint32_t>& indices);
+	std::vector<AABB> instanceBounds() const;
+	void buildTLAS();
+
+private:
+	float tlasBuildRatio = 1.0f;
+	int blasWideMaxDepth = 0;
 };
\ No newline at end of file
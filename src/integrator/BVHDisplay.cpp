@@ -15,14 +15,15 @@ void BVHDisplayIntegrator::updateUniforms(const RenderStatus& status)
 	
 	auto& sceneBuffers = scene->glContext;
 	Pipeline::bindTextureToImage(mFrameTex, 0, 0, ImageAccess::ReadWrite, TextureFormat::Col4x32f);
-	mShader->setTexture("uVertices", sceneBuffers.vertex, 1);
-	mShader->setTexture("uNormals", sceneBuffers.normal, 2);
-	mShader->setTexture("uTexCoords", sceneBuffers.texCoord, 3);
-	mShader->setTexture("uIndices", sceneBuffers.index, 4);
+	mShader->setTexture("uTriangles", sceneBuffers.triangle, 1);
+	mShader->setTexture("uTriangleShading", sceneBuffers.triangleShading, 2);
 	mShader->setTexture("uBounds", sceneBuffers.bound, 5);
 	mShader->setTexture("uHitTable", sceneBuffers.hitTable, 6);
 	mShader->setTexture("uMatTexIndices", sceneBuffers.matTexIndex, 7);
-	mShader->set1i("uBvhSize", scene->boxCount);
+	mShader->setTexture("uInstances", sceneBuffers.instance, 8);
+	mShader->setTexture("uInstanceTransforms", sceneBuffers.instanceTransform, 9);
+	mShader->set1i("uBvhSize", scene->tlasSize);
+	mShader->set1i("uNumInstances", static_cast<int>(scene->instances.size()));
 	mShader->set1f("uBvhDepth", glm::log2(static_cast<float>(scene->boxCount)));
 	mShader->set1i("uMatIndex", mMatIndex);
 
@@ -45,7 +46,7 @@ void BVHDisplayIntegrator::updateUniforms(const RenderStatus& status)
 
 void BVHDisplayIntegrator::init(Scene* scene, int width, int height, PipelinePtr ctx)
 {
-	mShader = Shader::createFromText("bvh_display.glsl", { WorkgroupSizeX, WorkgroupSizeY, 1 });
+	mShader = Shader::createFromText("bvh_display.glsl", { WorkgroupSizeX, WorkgroupSizeY, 1 }, scene->traversalDefines());
 	recreateFrameTex(width, height);
 	updateUniforms({ scene, { width, height } });
 }
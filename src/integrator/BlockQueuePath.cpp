@@ -33,10 +33,8 @@ void BlockQueuePathIntegrator::updateUniforms(const RenderStatus& status)
 	const auto& camera = scene->camera;
 	glm::mat3 camMatrix(camera.right(), camera.up(), camera.front());
 
-	mShader->setTexture("uVertices", sceneBuffers.vertex, 6);
-	mShader->setTexture("uNormals", sceneBuffers.normal, 7);
-	mShader->setTexture("uTexCoords", sceneBuffers.texCoord, 8);
-	mShader->setTexture("uIndices", sceneBuffers.index, 9);
+	mShader->setTexture("uTriangles", sceneBuffers.triangle, 6);
+	mShader->setTexture("uTriangleShading", sceneBuffers.triangleShading, 7);
 	mShader->setTexture("uBounds", sceneBuffers.bound, 10);
 	mShader->setTexture("uHitTable", sceneBuffers.hitTable, 11);
 	mShader->setTexture("uMatTexIndices", sceneBuffers.matTexIndex, 12);
@@ -52,12 +50,19 @@ void BlockQueuePathIntegrator::updateUniforms(const RenderStatus& status)
 	mShader->setTexture("uTexUVScale", sceneBuffers.texUVScale, 21);
 	mShader->setTexture("uSobolSeq", scene->sobolTex, 22);
 	mShader->setTexture("uNoiseTex", scene->noiseTex, 23);
+	mShader->setTexture("uWideBounds", sceneBuffers.wideBound, 24);
+	mShader->setTexture("uWideChildren", sceneBuffers.wideChildren, 25);
+	mShader->setTexture("uInstances", sceneBuffers.instance, 26);
+	mShader->setTexture("uInstanceTransforms", sceneBuffers.instanceTransform, 27);
 	mShader->set1i("uNumLightTriangles", scene->nLightTriangles);
 	mShader->set1i("uObjPrimCount", scene->objPrimCount);
 
 	mShader->set1f("uLightSum", scene->lightSumPdf);
 	mShader->set1f("uEnvSum", scene->envMap->sumPdf());
-	mShader->set1i("uBvhSize", scene->boxCount);
+	mShader->set1i("uBvhSize", scene->tlasSize);
+	mShader->set1i("uNumInstances", static_cast<int>(scene->instances.size()));
+	mShader->set1i("uWideBvhWidth", scene->wideBVHWidth);
+	mShader->set1i("uWideBvh", mParam.wideBVH && scene->wideBVHWidth > 0);
 	mShader->set1i("uSampleDim", scene->SampleDim);
 	mShader->set1i("uSampleNum", scene->SampleNum);
 	mShader->set1f("uEnvRotation", scene->envRotation);
@@ -87,7 +92,7 @@ void BlockQueuePathIntegrator::updateUniforms(const RenderStatus& status)
 void BlockQueuePathIntegrator::init(Scene* scene, int width, int height, PipelinePtr ctx)
 {
 	mShader = Shader::createFromText("pt_block_queue.glsl", { PrimaryBlockSizeX, PrimaryBlockSizeY, 1 },
-		"#extension GL_EXT_texture_array : enable\n");
+		"#extension GL_EXT_texture_array : enable\n" + scene->traversalDefines());
 	mImageClearShader = Shader::createFromText("util/img_clear_4x32f.glsl", { ImageOpSizeX, ImageOpSizeY, 1 });
 	recreateFrameTex(width, height);
 	updateUniforms({ scene, { width, height } });
@@ -153,6 +158,13 @@ void BlockQueuePathIntegrator::renderSettingsGUI()
 	if (ImGui::Checkbox("Russian rolette", &mParam.russianRoulette))
 		setShouldReset();
 
+	if (ImGui::Checkbox("Wide BVH", &mParam.wideBVH))
+	{
+		if (mParam.wideBVH)
+			requestWideBVH();
+		setShouldReset();
+	}
+
 	const char* samplerNames[] = { "Independent", "Sobol" };
 	if (ImGui::Combo("Sampler", &mParam.sampler, samplerNames, IM_ARRAYSIZE(samplerNames)))
 		setShouldReset();
@@ -18,10 +18,8 @@ void LightPathIntegrator::updateUniforms(const RenderStatus& status)
 {
 	auto [scene, size, level] = status;
 	auto& sceneBuffers = scene->glContext;
-	mShader->setTexture("uVertices", sceneBuffers.vertex, 2);
-	mShader->setTexture("uNormals", sceneBuffers.normal, 3);
-	mShader->setTexture("uTexCoords", sceneBuffers.texCoord, 4);
-	mShader->setTexture("uIndices", sceneBuffers.index, 5);
+	mShader->setTexture("uTriangles", sceneBuffers.triangle, 2);
+	mShader->setTexture("uTriangleShading", sceneBuffers.triangleShading, 3);
 	mShader->setTexture("uBounds", sceneBuffers.bound, 6);
 	mShader->setTexture("uHitTable", sceneBuffers.hitTable, 7);
 	mShader->setTexture("uMatTexIndices", sceneBuffers.matTexIndex, 8);
@@ -37,11 +35,18 @@ void LightPathIntegrator::updateUniforms(const RenderStatus& status)
 	mShader->setTexture("uTexUVScale", sceneBuffers.texUVScale, 17);
 	mShader->setTexture("uSobolSeq", scene->sobolTex, 18);
 	mShader->setTexture("uNoiseTex", scene->noiseTex, 19);
+	mShader->setTexture("uWideBounds", sceneBuffers.wideBound, 20);
+	mShader->setTexture("uWideChildren", sceneBuffers.wideChildren, 21);
+	mShader->setTexture("uInstances", sceneBuffers.instance, 22);
+	mShader->setTexture("uInstanceTransforms", sceneBuffers.instanceTransform, 23);
 	mShader->set1i("uNumLightTriangles", scene->nLightTriangles);
 	mShader->set1f("uLightSum", scene->lightSumPdf);
 	mShader->set1f("uEnvSum", scene->envMap->sumPdf());
 	mShader->set1i("uObjPrimCount", scene->objPrimCount);
-	mShader->set1i("uBvhSize", scene->boxCount);
+	mShader->set1i("uBvhSize", scene->tlasSize);
+	mShader->set1i("uNumInstances", static_cast<int>(scene->instances.size()));
+	mShader->set1i("uWideBvhWidth", scene->wideBVHWidth);
+	mShader->set1i("uWideBvh", mParam.wideBVH && scene->wideBVHWidth > 0);
 	mShader->set1i("uSampleDim", scene->SampleDim);
 	mShader->set1i("uSampleNum", scene->SampleNum);
 	mShader->set1f("uEnvRotation", scene->envRotation);
@@ -73,7 +78,7 @@ void LightPathIntegrator::init(Scene* scene, int width, int height, PipelinePtr
 {
 	mShader = Shader::createFromText("light_path_integ.glsl", { WorkgroupSize, 1, 1 },
 		"#extension GL_EXT_texture_array : enable\n"
-		"#extension GL_NV_shader_atomic_float : enable\n");
+		"#extension GL_NV_shader_atomic_float : enable\n" + scene->traversalDefines());
 	mImageCopyShader = Shader::createFromText("util/img_copy_1x32f_4x32f.glsl", { ImageOpSizeX, ImageOpSizeY, 1 });
 	mImageClearShader = Shader::createFromText("util/img_clear_1x32f.glsl", { ImageOpSizeX, ImageOpSizeY, 1 });
 	recreateFrameTex(width, height);
@@ -144,6 +149,13 @@ void LightPathIntegrator::renderSettingsGUI()
 	if (ImGui::Checkbox("Russian rolette", &mParam.russianRoulette))
 		setShouldReset();
 
+	if (ImGui::Checkbox("Wide BVH", &mParam.wideBVH))
+	{
+		if (mParam.wideBVH)
+			requestWideBVH();
+		setShouldReset();
+	}
+
 	if (ImGui::InputInt("Thread blocks per pass", &mParam.threadBlocksOnePass, 1, 10))
 		setShouldReset();
 
@@ -17,10 +17,8 @@ void NaivePathIntegrator::updateUniforms(const RenderStatus& status)
 
 	auto& sceneBuffers = scene->glContext;
 	Pipeline::bindTextureToImage(mFrameTex, 0, 0, ImageAccess::ReadWrite, TextureFormat::Col4x32f);
-	mShader->setTexture("uVertices", sceneBuffers.vertex, 1);
-	mShader->setTexture("uNormals", sceneBuffers.normal, 2);
-	mShader->setTexture("uTexCoords", sceneBuffers.texCoord, 3);
-	mShader->setTexture("uIndices", sceneBuffers.index, 4);
+	mShader->setTexture("uTriangles", sceneBuffers.triangle, 1);
+	mShader->setTexture("uTriangleShading", sceneBuffers.triangleShading, 2);
 	mShader->setTexture("uBounds", sceneBuffers.bound, 5);
 	mShader->setTexture("uHitTable", sceneBuffers.hitTable, 6);
 	mShader->setTexture("uMatTexIndices", sceneBuffers.matTexIndex, 7);
@@ -36,11 +34,18 @@ void NaivePathIntegrator::updateUniforms(const RenderStatus& status)
 	mShader->setTexture("uTexUVScale", sceneBuffers.texUVScale, 16);
 	mShader->setTexture("uSobolSeq", scene->sobolTex, 17);
 	mShader->setTexture("uNoiseTex", scene->noiseTex, 18);
+	mShader->setTexture("uWideBounds", sceneBuffers.wideBound, 19);
+	mShader->setTexture("uWideChildren", sceneBuffers.wideChildren, 20);
+	mShader->setTexture("uInstances", sceneBuffers.instance, 21);
+	mShader->setTexture("uInstanceTransforms", sceneBuffers.instanceTransform, 22);
 	mShader->set1i("uNumLightTriangles", scene->nLightTriangles);
 	mShader->set1f("uLightSum", scene->lightSumPdf);
 	mShader->set1f("uEnvSum", scene->envMap->sumPdf());
 	mShader->set1i("uObjPrimCount", scene->objPrimCount);
-	mShader->set1i("uBvhSize", scene->boxCount);
+	mShader->set1i("uBvhSize", scene->tlasSize);
+	mShader->set1i("uNumInstances", static_cast<int>(scene->instances.size()));
+	mShader->set1i("uWideBvhWidth", scene->wideBVHWidth);
+	mShader->set1i("uWideBvh", mParam.wideBVH && scene->wideBVHWidth > 0);
 	mShader->set1i("uSampleDim", scene->SampleDim);
 	mShader->set1i("uSampleNum", scene->SampleNum);
 	mShader->set1f("uEnvRotation", scene->envRotation);
@@ -69,7 +74,7 @@ void NaivePathIntegrator::updateUniforms(const RenderStatus& status)
 void NaivePathIntegrator::init(Scene* scene, int width, int height, PipelinePtr ctx)
 {
 	mShader = Shader::createFromText("path_integ_naive.glsl", { WorkgroupSizeX, WorkgroupSizeY, 1 },
-		"#extension GL_EXT_texture_array : enable\n");
+		"#extension GL_EXT_texture_array : enable\n" + scene->traversalDefines());
 	recreateFrameTex(width, height);
 	updateUniforms({ scene, { width, height } });
 }
@@ -125,6 +130,13 @@ void NaivePathIntegrator::renderSettingsGUI()
 	if (ImGui::Checkbox("Russian rolette", &mParam.russianRoulette))
 		setShouldReset();
 
+	if (ImGui::Checkbox("Wide BVH", &mParam.wideBVH))
+	{
+		if (mParam.wideBVH)
+			requestWideBVH();
+		setShouldReset();
+	}
+
 	const char* samplerNames[] = { "Independent", "Sobol" };
 	if (ImGui::Combo("Sampler", &mParam.sampler, samplerNames, IM_ARRAYSIZE(samplerNames)))
 		setShouldReset();
@@ -37,10 +37,8 @@ void StreamedPathIntegrator::updateUniforms(const Scene& scene, int width, int h
 	Shader* shaders[] = { mPrimaryRayShader.get(), mStreamingShader.get() };
 	for (auto shader : shaders)
 	{
-		shader->setTexture("uVertices", sceneBuffers.vertex, 6);
-		shader->setTexture("uNormals", sceneBuffers.normal, 7);
-		shader->setTexture("uTexCoords", sceneBuffers.texCoord, 8);
-		shader->setTexture("uIndices", sceneBuffers.index, 9);
+		shader->setTexture("uTriangles", sceneBuffers.triangle, 6);
+		shader->setTexture("uTriangleShading", sceneBuffers.triangleShading, 7);
 		shader->setTexture("uBounds", sceneBuffers.bound, 10);
 		shader->setTexture("uHitTable", sceneBuffers.hitTable, 11);
 		shader->setTexture("uMatTexIndices", sceneBuffers.matTexIndex, 12);
@@ -56,12 +54,15 @@ void StreamedPathIntegrator::updateUniforms(const Scene& scene, int width, int h
 		shader->setTexture("uTexUVScale", sceneBuffers.texUVScale, 21);
 		shader->setTexture("uSobolSeq", scene.sobolTex, 22);
 		shader->setTexture("uNoiseTex", scene.noiseTex, 23);
+		shader->setTexture("uInstances", sceneBuffers.instance, 24);
+		shader->setTexture("uInstanceTransforms", sceneBuffers.instanceTransform, 25);
 		shader->set1i("uNumLightTriangles", scene.nLightTriangles);
 		shader->set1i("uObjPrimCount", scene.objPrimCount);
 
 		shader->set1f("uLightSum", scene.lightSumPdf);
 		shader->set1f("uEnvSum", scene.envMap->sumPdf());
-		shader->set1i("uBvhSize", scene.boxCount);
+		shader->set1i("uBvhSize", scene.tlasSize);
+		shader->set1i("uNumInstances", static_cast<int>(scene.instances.size()));
 		shader->set1i("uSampleDim", scene.SampleDim);
 		shader->set1i("uSampleNum", scene.SampleNum);
 		shader->set1f("uEnvRotation", scene.envRotation);
@@ -92,9 +93,9 @@ void StreamedPathIntegrator::updateUniforms(const Scene& scene, int width, int h
 void StreamedPathIntegrator::init(const Scene& scene, int width, int height, PipelinePtr ctx)
 {
 	mPrimaryRayShader = Shader::createFromText("pt_streamed_primary.glsl", { PrimaryBlockSizeX, PrimaryBlockSizeY, 1 },
-		"#extension GL_EXT_texture_array : enable\n");
+		"#extension GL_EXT_texture_array : enable\n" + scene.traversalDefines());
 	mStreamingShader = Shader::createFromText("pt_streamed_streaming.glsl", { StreamingBlockSize, 1, 1 },
-		"#extension GL_EXT_texture_array : enable\n");
+		"#extension GL_EXT_texture_array : enable\n" + scene.traversalDefines());
 	mImageClearShader = Shader::createFromText("util/img_clear_4x32f.glsl", { ImageOpSizeX, ImageOpSizeY, 1 });
 	recreateFrameTex(width, height);
 	updateUniforms(scene, width, height);
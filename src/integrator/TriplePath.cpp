@@ -25,10 +25,8 @@ void TriplePathIntegrator::updateUniforms(const RenderStatus& status)
 
 	for (auto shader : shaders)
 	{
-		shader->setTexture("uVertices", sceneBuffers.vertex, 2);
-		shader->setTexture("uNormals", sceneBuffers.normal, 3);
-		shader->setTexture("uTexCoords", sceneBuffers.texCoord, 4);
-		shader->setTexture("uIndices", sceneBuffers.index, 5);
+		shader->setTexture("uTriangles", sceneBuffers.triangle, 2);
+		shader->setTexture("uTriangleShading", sceneBuffers.triangleShading, 3);
 		shader->setTexture("uBounds", sceneBuffers.bound, 6);
 		shader->setTexture("uHitTable", sceneBuffers.hitTable, 7);
 		shader->setTexture("uMatTexIndices", sceneBuffers.matTexIndex, 8);
@@ -44,11 +42,18 @@ void TriplePathIntegrator::updateUniforms(const RenderStatus& status)
 		shader->setTexture("uTexUVScale", sceneBuffers.texUVScale, 17);
 		shader->setTexture("uSobolSeq", scene->sobolTex, 18);
 		shader->setTexture("uNoiseTex", scene->noiseTex, 19);
+		shader->setTexture("uWideBounds", sceneBuffers.wideBound, 20);
+		shader->setTexture("uWideChildren", sceneBuffers.wideChildren, 21);
+		shader->setTexture("uInstances", sceneBuffers.instance, 22);
+		shader->setTexture("uInstanceTransforms", sceneBuffers.instanceTransform, 23);
 		shader->set1i("uNumLightTriangles", scene->nLightTriangles);
 		shader->set1f("uLightSum", scene->lightSumPdf);
 		shader->set1f("uEnvSum", scene->envMap->sumPdf());
 		shader->set1i("uObjPrimCount", scene->objPrimCount);
-		shader->set1i("uBvhSize", scene->boxCount);
+		shader->set1i("uBvhSize", scene->tlasSize);
+		shader->set1i("uNumInstances", static_cast<int>(scene->instances.size()));
+		shader->set1i("uWideBvhWidth", scene->wideBVHWidth);
+		shader->set1i("uWideBvh", mParam.wideBVH && scene->wideBVHWidth > 0);
 		shader->set1i("uSampleDim", scene->SampleDim);
 		shader->set1i("uSampleNum", scene->SampleNum);
 		shader->set1f("uEnvRotation", scene->envRotation);
@@ -84,10 +89,10 @@ void TriplePathIntegrator::init(Scene* scene, int width, int height, PipelinePtr
 {
 	mPTShader = Shader::createFromText("triple_path_pass_pt.glsl", { BlockSizeX, BlockSizeY, 1 },
 		"#extension GL_EXT_texture_array : enable\n"
-		"#extension GL_NV_shader_atomic_float : enable\n");
+		"#extension GL_NV_shader_atomic_float : enable\n" + scene->traversalDefines());
 	mLPTShader = Shader::createFromText("triple_path_pass_lpt.glsl", { LPTBlockSize, 1, 1 },
 		"#extension GL_EXT_texture_array : enable\n"
-		"#extension GL_NV_shader_atomic_float : enable\n");
+		"#extension GL_NV_shader_atomic_float : enable\n" + scene->traversalDefines());
 	mImageCopyShader = Shader::createFromText("util/img_copy_1x32f_4x32f.glsl", { BlockSizeX, BlockSizeY, 1 });
 	mImageClearShader = Shader::createFromText("util/img_clear_1x32f.glsl", { BlockSizeX, BlockSizeY, 1 });
 	recreateFrameTex(width, height);
@@ -165,6 +170,13 @@ void TriplePathIntegrator::renderSettingsGUI()
 	if (ImGui::Checkbox("Russian rolette", &mParam.russianRoulette))
 		setShouldReset();
 
+	if (ImGui::Checkbox("Wide BVH", &mParam.wideBVH))
+	{
+		if (mParam.wideBVH)
+			requestWideBVH();
+		setShouldReset();
+	}
+
 	const char* samplerNames[] = { "Independent", "Sobol" };
 	if (ImGui::Combo("PT Sampler", &mParam.PTSampler, samplerNames, IM_ARRAYSIZE(samplerNames)))
 		setShouldReset();
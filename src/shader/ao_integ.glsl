@@ -26,7 +26,7 @@ vec3 aoIntegTrace(Ray ray, int id, SurfaceInfo surf, inout Sampler s)
 	{
 		vec3 wi = sampleCosineWeighted(surf.ns, sample2D(s)).xyz;
 		Ray occRay = rayOffseted(pos, wi);
-		if (bvhTest(occRay, uAoCoef.x)) ao += 1.0;
+		if (bvhOccluded(occRay, uAoCoef.x)) ao += 1.0;
 	}
 	return 1.0 - ao / float(uMaxBounce);
 }
\ No newline at end of file
@@ -0,0 +1,58 @@
+@type compute
+
+@include bvh/lbvh_common.glsl
+
+layout(r32i, binding = 2) uniform iimageBuffer uValues;
+layout(rgba32i, binding = 3) uniform iimageBuffer uNodes;
+layout(r32i, binding = 4) uniform iimageBuffer uParents;
+layout(r32i, binding = 5) coherent uniform iimageBuffer uVisitCount;
+layout(r32f, binding = 6) coherent uniform imageBuffer uBounds;
+
+void storeBound(int node, vec3 pMin, vec3 pMax)
+{
+	for (int i = 0; i < 3; i++)
+	{
+		imageStore(uBounds, node * 6 + i, vec4(pMin[i]));
+		imageStore(uBounds, node * 6 + 3 + i, vec4(pMax[i]));
+	}
+}
+
+void loadBound(int node, out vec3 pMin, out vec3 pMax)
+{
+	for (int i = 0; i < 3; i++)
+	{
+		pMin[i] = imageLoad(uBounds, node * 6 + i).r;
+		pMax[i] = imageLoad(uBounds, node * 6 + 3 + i).r;
+	}
+}
+
+// Each leaf walks towards the root; the second child to arrive at a node knows both
+// children are complete and merges them, the first one stops
+void main()
+{
+	int i = invocationIndex();
+	if (i >= uNumPrims)
+		return;
+
+	int node = uNumPrims - 1 + i;
+	vec3 pMin, pMax;
+	triangleBound(imageLoad(uValues, i).r, pMin, pMax);
+	storeBound(node, pMin, pMax);
+
+	while (true)
+	{
+		int parent = imageLoad(uParents, node).r;
+		if (parent < 0)
+			break;
+		memoryBarrierImage();
+		if (imageAtomicAdd(uVisitCount, parent, 1) == 0)
+			break;
+
+		ivec4 children = imageLoad(uNodes, parent);
+		vec3 lMin, lMax, rMin, rMax;
+		loadBound(children.x, lMin, lMax);
+		loadBound(children.y, rMin, rMax);
+		storeBound(parent, min(lMin, rMin), max(lMax, rMax));
+		node = parent;
+	}
+}
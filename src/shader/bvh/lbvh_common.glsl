@@ -0,0 +1,34 @@
+@type lib
+
+uniform samplerBuffer uVertices;
+uniform isamplerBuffer uIndices;
+uniform int uNumPrims;
+uniform int uPrimBase;
+
+int invocationIndex()
+{
+	return int(gl_GlobalInvocationID.y * gl_NumWorkGroups.x * gl_WorkGroupSize.x + gl_GlobalInvocationID.x);
+}
+
+void triangleBound(int id, out vec3 pMin, out vec3 pMax)
+{
+	id += uPrimBase;
+	vec3 a = texelFetch(uVertices, texelFetch(uIndices, id * 3 + 0).r).xyz;
+	vec3 b = texelFetch(uVertices, texelFetch(uIndices, id * 3 + 1).r).xyz;
+	vec3 c = texelFetch(uVertices, texelFetch(uIndices, id * 3 + 2).r).xyz;
+	pMin = min(min(a, b), c);
+	pMax = max(max(a, b), c);
+}
+
+// Maps floats to ints whose signed order matches the float order, so extents can be
+// reduced with integer atomics
+int floatToOrderedInt(float f)
+{
+	int i = floatBitsToInt(f);
+	return (i >= 0) ? i : i ^ 0x7fffffff;
+}
+
+float orderedIntToFloat(int i)
+{
+	return intBitsToFloat((i >= 0) ? i : i ^ 0x7fffffff);
+}
@@ -0,0 +1,23 @@
+@type compute
+
+@include bvh/lbvh_common.glsl
+
+layout(r32i, binding = 0) uniform iimageBuffer uExtent;
+
+void main()
+{
+	int id = invocationIndex();
+	if (id >= uNumPrims)
+		return;
+
+	vec3 pMin, pMax;
+	triangleBound(id, pMin, pMax);
+	vec3 centroid = (pMin + pMax) * 0.5;
+
+	for (int i = 0; i < 3; i++)
+	{
+		int c = floatToOrderedInt(centroid[i]);
+		imageAtomicMin(uExtent, i, c);
+		imageAtomicMax(uExtent, i + 3, c);
+	}
+}
@@ -0,0 +1,75 @@
+@type compute
+
+@include bvh/lbvh_common.glsl
+
+layout(r32ui, binding = 1) uniform uimageBuffer uKeys;
+layout(r32i, binding = 2) uniform iimageBuffer uValues;
+layout(rgba32i, binding = 3) uniform iimageBuffer uNodes;
+layout(r32i, binding = 4) uniform iimageBuffer uParents;
+
+// Internal nodes take indices [0, n - 1), leaves [n - 1, 2n - 1) in sorted order.
+// uNodes holds (left, right, size, 0) for internal nodes and (-1, -1, ~primIndex, 0) for leaves
+
+int commonPrefix(int i, int j)
+{
+	if (j < 0 || j >= uNumPrims)
+		return -1;
+	uint ki = imageLoad(uKeys, i).r;
+	uint kj = imageLoad(uKeys, j).r;
+	if (ki == kj)
+		return 32 + 31 - findMSB(uint(i ^ j));
+	return 31 - findMSB(ki ^ kj);
+}
+
+void main()
+{
+	int i = invocationIndex();
+	if (i >= uNumPrims)
+		return;
+
+	int leaf = uNumPrims - 1 + i;
+	imageStore(uNodes, leaf, ivec4(-1, -1, ~imageLoad(uValues, i).r, 0));
+	if (i == 0)
+		imageStore(uParents, 0, ivec4(-1));
+	if (i == uNumPrims - 1)
+		return;
+
+	int d = (commonPrefix(i, i + 1) - commonPrefix(i, i - 1)) >= 0 ? 1 : -1;
+	int deltaMin = commonPrefix(i, i - d);
+
+	int lMax = 2;
+	while (commonPrefix(i, i + lMax * d) > deltaMin)
+		lMax *= 2;
+
+	int len = 0;
+	for (int t = lMax / 2; t >= 1; t /= 2)
+	{
+		if (commonPrefix(i, i + (len + t) * d) > deltaMin)
+			len += t;
+	}
+	int j = i + len * d;
+	int deltaNode = commonPrefix(i, j);
+
+	int split = 0;
+	int div = 2;
+	int t = (len + div - 1) / div;
+	while (true)
+	{
+		if (commonPrefix(i, i + (split + t) * d) > deltaNode)
+			split += t;
+		if (t == 1)
+			break;
+		div *= 2;
+		t = (len + div - 1) / div;
+	}
+	int gamma = i + split * d + min(d, 0);
+
+	int first = min(i, j);
+	int last = max(i, j);
+	int left = (first == gamma) ? uNumPrims - 1 + gamma : gamma;
+	int right = (last == gamma + 1) ? uNumPrims - 1 + gamma + 1 : gamma + 1;
+
+	imageStore(uNodes, i, ivec4(left, right, (last - first) * 2 + 1, 0));
+	imageStore(uParents, left, ivec4(i));
+	imageStore(uParents, right, ivec4(i));
+}
@@ -0,0 +1,80 @@
+@type compute
+
+@include bvh/lbvh_common.glsl
+
+layout(rgba32i, binding = 3) uniform iimageBuffer uNodes;
+layout(r32i, binding = 4) uniform iimageBuffer uParents;
+layout(r32f, binding = 5) uniform imageBuffer uOrderedBounds;
+layout(r32f, binding = 6) uniform imageBuffer uBounds;
+layout(r32i, binding = 7) uniform iimageBuffer uHitTable;
+
+uniform int uNodeBase;
+uniform int uHitTableSegments;
+
+vec3 boundCentroid(int node)
+{
+	vec3 c;
+	for (int i = 0; i < 3; i++)
+		c[i] = (imageLoad(uBounds, node * 6 + i).r + imageLoad(uBounds, node * 6 + 3 + i).r) * 0.5;
+	return c;
+}
+
+int subtreeSize(int node)
+{
+	int size = imageLoad(uNodes, node).z;
+	return (size < 0) ? 1 : size;
+}
+
+// Same child ordering as BVH::buildHitTable: for X+ the child with the larger x centroid
+// is visited first, for X- the smaller one, and so on
+bool visitLeftFirst(vec3 lc, vec3 rc, int face)
+{
+	int axis = face >> 1;
+	return ((face & 1) == 0) ? (lc[axis] > rc[axis]) : (lc[axis] < rc[axis]);
+}
+
+// Position of every node in the pre-order threading of each of the six faces, found by
+// walking to the root and adding the size of each sibling subtree visited before it.
+// Nodes are stored in their X+ threading order, the layout BVH::buildHitTable emits
+void main()
+{
+	int node = invocationIndex();
+	int treeSize = uNumPrims * 2 - 1;
+	if (node >= treeSize)
+		return;
+
+	ivec4 info = imageLoad(uNodes, node);
+	int size = subtreeSize(node);
+	int nodeInfo = (info.z < 0) ? (~info.z | int(0x80000000)) : size;
+
+	int index[6] = int[6](0, 0, 0, 0, 0, 0);
+	int child = node;
+	int parent = imageLoad(uParents, child).r;
+	while (parent >= 0)
+	{
+		ivec4 children = imageLoad(uNodes, parent);
+		int sibling = (children.x == child) ? children.y : children.x;
+		vec3 lc = boundCentroid(children.x);
+		vec3 rc = boundCentroid(children.y);
+		int siblingSize = subtreeSize(sibling);
+
+		for (int face = 0; face < 6; face++)
+		{
+			bool leftFirst = visitLeftFirst(lc, rc, face);
+			bool visitedFirst = (child == children.x) == leftFirst;
+			index[face] += visitedFirst ? 1 : 1 + siblingSize;
+		}
+		child = parent;
+		parent = imageLoad(uParents, child).r;
+	}
+
+	for (int i = 0; i < 6; i++)
+		imageStore(uOrderedBounds, (uNodeBase + index[0]) * 6 + i, imageLoad(uBounds, node * 6 + i));
+
+	int tableBase = uNodeBase * uHitTableSegments;
+	imageStore(uHitTable, tableBase + index[0], ivec4(nodeInfo));
+	if (uHitTableSegments == 1)
+		return;
+	for (int face = 1; face < 6; face++)
+		imageStore(uHitTable, tableBase + face * treeSize + index[face], ivec4(index[0]));
+}
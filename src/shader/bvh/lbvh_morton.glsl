@@ -0,0 +1,54 @@
+@type compute
+
+@include bvh/lbvh_common.glsl
+
+layout(r32i, binding = 0) uniform iimageBuffer uExtent;
+layout(r32ui, binding = 1) uniform uimageBuffer uKeys;
+layout(r32i, binding = 2) uniform iimageBuffer uValues;
+
+uniform int uSortSize;
+
+uint expandBits(uint v)
+{
+	v &= 0x3ffu;
+	v = (v | v << 16) & 0x030000ffu;
+	v = (v | v << 8) & 0x0300f00fu;
+	v = (v | v << 4) & 0x030c30c3u;
+	v = (v | v << 2) & 0x09249249u;
+	return v;
+}
+
+void main()
+{
+	int id = invocationIndex();
+	if (id >= uSortSize)
+		return;
+
+	// Padding keys sort behind every real primitive
+	if (id >= uNumPrims)
+	{
+		imageStore(uKeys, id, uvec4(0xffffffffu));
+		imageStore(uValues, id, ivec4(-1));
+		return;
+	}
+
+	vec3 extMin, extMax;
+	for (int i = 0; i < 3; i++)
+	{
+		extMin[i] = orderedIntToFloat(imageLoad(uExtent, i).r);
+		extMax[i] = orderedIntToFloat(imageLoad(uExtent, i + 3).r);
+	}
+	vec3 extent = extMax - extMin;
+	vec3 scale = vec3(
+		extent.x > 0.0 ? 1.0 / extent.x : 0.0,
+		extent.y > 0.0 ? 1.0 / extent.y : 0.0,
+		extent.z > 0.0 ? 1.0 / extent.z : 0.0);
+
+	vec3 pMin, pMax;
+	triangleBound(id, pMin, pMax);
+	vec3 p = clamp(((pMin + pMax) * 0.5 - extMin) * scale * 1024.0, vec3(0.0), vec3(1023.0));
+	uvec3 q = uvec3(p);
+
+	imageStore(uKeys, id, uvec4((expandBits(q.x) << 2) | (expandBits(q.y) << 1) | expandBits(q.z)));
+	imageStore(uValues, id, ivec4(id));
+}
@@ -0,0 +1,37 @@
+@type compute
+
+@include bvh/lbvh_common.glsl
+
+layout(r32ui, binding = 1) uniform uimageBuffer uKeys;
+layout(r32i, binding = 2) uniform iimageBuffer uValues;
+
+uniform int uSortSize;
+uniform int uStage;
+uniform int uPass;
+
+// One compare-exchange step of a bitonic sort; each invocation owns one pair
+void main()
+{
+	int t = invocationIndex();
+	if (t >= uSortSize / 2)
+		return;
+
+	int i = (t / uPass) * uPass * 2 + (t % uPass);
+	int j = i + uPass;
+	bool ascending = (i & uStage) == 0;
+
+	uint ki = imageLoad(uKeys, i).r;
+	uint kj = imageLoad(uKeys, j).r;
+	int vi = imageLoad(uValues, i).r;
+	int vj = imageLoad(uValues, j).r;
+
+	// Ties are ordered by primitive index so the result doesn't depend on scheduling
+	bool greater = (ki > kj) || (ki == kj && uint(vi) > uint(vj));
+	if (greater == ascending)
+	{
+		imageStore(uKeys, i, uvec4(kj));
+		imageStore(uKeys, j, uvec4(ki));
+		imageStore(uValues, i, ivec4(vj));
+		imageStore(uValues, j, ivec4(vi));
+	}
+}
@@ -2,7 +2,6 @@
 
 layout(rgba32f, binding = 0) uniform image2D uFrame;
 
-uniform isamplerBuffer uMatTexIndices;
 uniform int uMatIndex;
 uniform float uBvhDepth;
 uniform bool uCheckDepth;
@@ -27,7 +26,7 @@ void main()
 
 	float maxDepth;
 	int primId = bvhDebug(ray, maxDepth);
-	int matId = texelFetch(uMatTexIndices, primId).r & 0xffff;
+	int matId = (primId != -1) ? triangleMatTexIndex(primId) & 0xffff : -1;
 	if (matId == uMatIndex && primId != -1) result = vec3(1.0, 1.0, 0.2);
 	else result = vec3(maxDepth / uBvhDepth * 0.2);
 
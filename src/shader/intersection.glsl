@@ -1,14 +1,38 @@
 @type lib
 @include math.glsl
 
-uniform samplerBuffer uVertices;
-uniform samplerBuffer uNormals;
-uniform samplerBuffer uTexCoords;
-uniform isamplerBuffer uIndices;
+// Three texels per triangle for intersection: a, b - a, c - a in object space. Four for
+// shading, fetched only on the final hit: (na, ua), (nb, ub), (nc, uc), (va, vb, vc).
+// Both follow the index order Scene::createGLContext leaves, which is leaf order per BLAS
+uniform samplerBuffer uTriangles;
+uniform samplerBuffer uTriangleShading;
+// Per BLAS triangle, material-texture index relative to its instance's matOffset
+uniform isamplerBuffer uMatTexIndices;
 uniform samplerBuffer uBounds;
 uniform isamplerBuffer uHitTable;
 uniform int uBvhSize;
 
+uniform isamplerBuffer uInstances;
+uniform samplerBuffer uInstanceTransforms;
+uniform int uNumInstances;
+
+uniform samplerBuffer uWideBounds;
+uniform isamplerBuffer uWideChildren;
+uniform int uWideBvhWidth;
+uniform bool uWideBvh;
+
+const int WideBvhStackSize = 64;
+const int WideBvhMaxWidth = 8;
+
+// BVH_SHORT_STACK is defined by Scene::traversalDefines. That mode walks trees nearest child
+// first with a small stack and only keeps hit table segment 0
+#ifdef BVH_SHORT_STACK
+const int HitTableSegments = 1;
+const int ShortStackSize = 8;
+#else
+const int HitTableSegments = 6;
+#endif
+
 struct Ray
 {
 	vec3 ori;
@@ -60,13 +84,11 @@ struct HitInfo
 	float dist;
 };
 
-HitInfo intersectTriangle(vec3 a, vec3 b, vec3 c, Ray ray)
+HitInfo intersectTriangle(vec3 a, vec3 ab, vec3 ac, Ray ray)
 {
 	HitInfo ret;
 	const float eps = 1e-6;
 
-	vec3 ab = b - a;
-	vec3 ac = c - a;
 	vec3 o = ray.ori;
 	vec3 d = ray.dir;
 
@@ -108,57 +130,175 @@ HitInfo intersectTriangle(vec3 a, vec3 b, vec3 c, Ray ray)
 	return ret;
 }
 
+// id indexes the shared triangle buffers, rays are in the owning BLAS's object space
 HitInfo intersectTriangle(int id, Ray ray)
 {
-	int ia = texelFetch(uIndices, id * 3 + 0).r;
-	int ib = texelFetch(uIndices, id * 3 + 1).r;
-	int ic = texelFetch(uIndices, id * 3 + 2).r;
+	vec3 a = texelFetch(uTriangles, id * 3 + 0).xyz;
+	vec3 ab = texelFetch(uTriangles, id * 3 + 1).xyz;
+	vec3 ac = texelFetch(uTriangles, id * 3 + 2).xyz;
+	return intersectTriangle(a, ab, ac, ray);
+}
+
+// Occlusion form of the test above: no hit record, and the distance is compared against
+// (0, tMax) while still scaled by the determinant, which saves the division
+bool triangleOccludes(int id, Ray ray, float tMax)
+{
+	const float eps = 1e-6;
+
+	vec3 a = texelFetch(uTriangles, id * 3 + 0).xyz;
+	vec3 ab = texelFetch(uTriangles, id * 3 + 1).xyz;
+	vec3 ac = texelFetch(uTriangles, id * 3 + 2).xyz;
+
+	vec3 p = cross(ray.dir, ac);
+	float det = dot(ab, p);
+	if (abs(det) < eps)
+		return false;
+
+	vec3 ao = ray.ori - a;
+	if (det < 0)
+	{
+		ao = -ao;
+		det = -det;
+	}
 
-	vec3 a = texelFetch(uVertices, ia).xyz;
-	vec3 b = texelFetch(uVertices, ib).xyz;
-	vec3 c = texelFetch(uVertices, ic).xyz;
-	return intersectTriangle(a, b, c, ray);
+	float u = dot(ao, p);
+	if (u < 0.0 || u > det)
+		return false;
+
+	vec3 q = cross(ao, ab);
+	float v = dot(ray.dir, q);
+	if (v < 0.0 || u + v > det)
+		return false;
+
+	float tDet = dot(ac, q);
+	return tDet > 0.0 && tDet < tMax * det;
 }
 
-vec3 triangleSampleUniform(int id, vec2 u)
+// Scene-wide primitive ids are given out per instance: instance i owns the range starting at
+// its primOffset, and local primitive j of it lives at primBase + j in the shared buffers
+struct Instance
 {
-	int ia = texelFetch(uIndices, id * 3 + 0).r;
-	int ib = texelFetch(uIndices, id * 3 + 1).r;
-	int ic = texelFetch(uIndices, id * 3 + 2).r;
+	int primOffset;
+	int matOffset;
+	int primBase;
+	int nodeBase;
+	int treeSize;
+	int wideBase;
+};
 
-	vec3 a = texelFetch(uVertices, ia).xyz;
-	vec3 b = texelFetch(uVertices, ib).xyz;
-	vec3 c = texelFetch(uVertices, ic).xyz;
+Instance getInstance(int index)
+{
+	ivec4 a = texelFetch(uInstances, index * 2 + 0);
+	ivec4 b = texelFetch(uInstances, index * 2 + 1);
+
+	Instance ret;
+	ret.primOffset = a.x;
+	ret.matOffset = a.y;
+	ret.primBase = a.z;
+	ret.nodeBase = a.w;
+	ret.treeSize = b.x;
+	ret.wideBase = b.y;
+	return ret;
+}
 
-	return sampleTriangleUniform(a, b, c, u);
+int instanceOfPrim(int id)
+{
+	int l = 0, r = uNumInstances - 1;
+	while (l < r)
+	{
+		int m = (l + r + 1) >> 1;
+		if (texelFetch(uInstances, m * 2).x <= id)
+			l = m;
+		else
+			r = m - 1;
+	}
+	return l;
 }
 
-float triangleArea(int id)
+vec3 instancePoint(int instance, vec3 p)
 {
-	int ia = texelFetch(uIndices, id * 3 + 0).r;
-	int ib = texelFetch(uIndices, id * 3 + 1).r;
-	int ic = texelFetch(uIndices, id * 3 + 2).r;
+	vec4 hp = vec4(p, 1.0);
+	return vec3(
+		dot(texelFetch(uInstanceTransforms, instance * 6 + 0), hp),
+		dot(texelFetch(uInstanceTransforms, instance * 6 + 1), hp),
+		dot(texelFetch(uInstanceTransforms, instance * 6 + 2), hp));
+}
 
-	vec3 a = texelFetch(uVertices, ia).xyz;
-	vec3 b = texelFetch(uVertices, ib).xyz;
-	vec3 c = texelFetch(uVertices, ic).xyz;
+vec3 instanceNormal(int instance, vec3 n)
+{
+	return normalize(
+		texelFetch(uInstanceTransforms, instance * 6 + 3).xyz * n.x +
+		texelFetch(uInstanceTransforms, instance * 6 + 4).xyz * n.y +
+		texelFetch(uInstanceTransforms, instance * 6 + 5).xyz * n.z);
+}
 
+// Object space ray of an instance. Its direction stays normalized, so distances along it
+// are the world space ones multiplied by scale
+Ray instanceRay(int instance, Ray ray, out float scale)
+{
+	vec4 r0 = texelFetch(uInstanceTransforms, instance * 6 + 3);
+	vec4 r1 = texelFetch(uInstanceTransforms, instance * 6 + 4);
+	vec4 r2 = texelFetch(uInstanceTransforms, instance * 6 + 5);
+
+	vec4 ori = vec4(ray.ori, 1.0);
+	vec3 dir = vec3(dot(r0.xyz, ray.dir), dot(r1.xyz, ray.dir), dot(r2.xyz, ray.dir));
+	scale = length(dir);
+	return makeRay(vec3(dot(r0, ori), dot(r1, ori), dot(r2, ori)), dir / scale);
+}
+
+// Position of a scene-wide primitive in the shared triangle buffers
+int triangleSlot(int id, out int instance)
+{
+	instance = instanceOfPrim(id);
+	Instance inst = getInstance(instance);
+	return inst.primBase + id - inst.primOffset;
+}
+
+void triangleVertices(int id, out vec3 a, out vec3 b, out vec3 c)
+{
+	int instance;
+	int tri = triangleSlot(id, instance);
+
+	vec3 oa = texelFetch(uTriangles, tri * 3 + 0).xyz;
+	a = instancePoint(instance, oa);
+	b = instancePoint(instance, oa + texelFetch(uTriangles, tri * 3 + 1).xyz);
+	c = instancePoint(instance, oa + texelFetch(uTriangles, tri * 3 + 2).xyz);
+}
+
+int triangleMatTexIndex(int id)
+{
+	int instance = instanceOfPrim(id);
+	Instance inst = getInstance(instance);
+	return texelFetch(uMatTexIndices, inst.primBase + id - inst.primOffset).r + inst.matOffset;
+}
+
+vec3 triangleSampleUniform(int id, vec2 u)
+{
+	vec3 a, b, c;
+	triangleVertices(id, a, b, c);
+	return sampleTriangleUniform(a, b, c, u);
+}
+
+float triangleArea(int id)
+{
+	vec3 a, b, c;
+	triangleVertices(id, a, b, c);
 	return triangleArea(a, b, c);
 }
 
 vec3 triangleNormalShad(int id, vec3 p)
 {
-	int ia = texelFetch(uIndices, id * 3 + 0).r;
-	int ib = texelFetch(uIndices, id * 3 + 1).r;
-	int ic = texelFetch(uIndices, id * 3 + 2).r;
+	int instance;
+	int tri = triangleSlot(id, instance);
 
-	vec3 a = texelFetch(uVertices, ia).xyz;
-	vec3 b = texelFetch(uVertices, ib).xyz;
-	vec3 c = texelFetch(uVertices, ic).xyz;
+	vec3 oa = texelFetch(uTriangles, tri * 3 + 0).xyz;
+	vec3 a = instancePoint(instance, oa);
+	vec3 b = instancePoint(instance, oa + texelFetch(uTriangles, tri * 3 + 1).xyz);
+	vec3 c = instancePoint(instance, oa + texelFetch(uTriangles, tri * 3 + 2).xyz);
 
-	vec3 na = texelFetch(uNormals, ia).xyz;
-	vec3 nb = texelFetch(uNormals, ib).xyz;
-	vec3 nc = texelFetch(uNormals, ic).xyz;
+	vec3 na = texelFetch(uTriangleShading, tri * 4 + 0).xyz;
+	vec3 nb = texelFetch(uTriangleShading, tri * 4 + 1).xyz;
+	vec3 nc = texelFetch(uTriangleShading, tri * 4 + 2).xyz;
 
 	vec3 pa = a - p;
 	vec3 pb = b - p;
@@ -169,19 +309,13 @@ vec3 triangleNormalShad(int id, vec3 p)
 	float lb = length(cross(pc, pa)) * areaInv;
 	float lc = 1.0 - la - lb;
 
-	return normalize(na * la + nb * lb + nc * lc);
+	return instanceNormal(instance, na * la + nb * lb + nc * lc);
 }
 
 vec3 triangleNormalGeom(int id)
 {
-	int ia = texelFetch(uIndices, id * 3 + 0).r;
-	int ib = texelFetch(uIndices, id * 3 + 1).r;
-	int ic = texelFetch(uIndices, id * 3 + 2).r;
-
-	vec3 a = texelFetch(uVertices, ia).xyz;
-	vec3 b = texelFetch(uVertices, ib).xyz;
-	vec3 c = texelFetch(uVertices, ic).xyz;
-
+	vec3 a, b, c;
+	triangleVertices(id, a, b, c);
 	return normalize(cross(c - a, c - b));
 }
 
@@ -189,21 +323,26 @@ SurfaceInfo triangleSurfaceInfo(int id, vec3 p)
 {
 	SurfaceInfo ret;
 
-	int ia = texelFetch(uIndices, id * 3 + 0).r;
-	int ib = texelFetch(uIndices, id * 3 + 1).r;
-	int ic = texelFetch(uIndices, id * 3 + 2).r;
+	int instance;
+	int tri = triangleSlot(id, instance);
+
+	vec3 oa = texelFetch(uTriangles, tri * 3 + 0).xyz;
+	vec3 a = instancePoint(instance, oa);
+	vec3 b = instancePoint(instance, oa + texelFetch(uTriangles, tri * 3 + 1).xyz);
+	vec3 c = instancePoint(instance, oa + texelFetch(uTriangles, tri * 3 + 2).xyz);
 
-	vec3 a = texelFetch(uVertices, ia).xyz;
-	vec3 b = texelFetch(uVertices, ib).xyz;
-	vec3 c = texelFetch(uVertices, ic).xyz;
+	vec4 sa = texelFetch(uTriangleShading, tri * 4 + 0);
+	vec4 sb = texelFetch(uTriangleShading, tri * 4 + 1);
+	vec4 sc = texelFetch(uTriangleShading, tri * 4 + 2);
+	vec3 tv = texelFetch(uTriangleShading, tri * 4 + 3).xyz;
 
-	vec3 na = texelFetch(uNormals, ia).xyz;
-	vec3 nb = texelFetch(uNormals, ib).xyz;
-	vec3 nc = texelFetch(uNormals, ic).xyz;
+	vec3 na = sa.xyz;
+	vec3 nb = sb.xyz;
+	vec3 nc = sc.xyz;
 
-	vec2 ta = texelFetch(uTexCoords, ia).xy;
-	vec2 tb = texelFetch(uTexCoords, ib).xy;
-	vec2 tc = texelFetch(uTexCoords, ic).xy;
+	vec2 ta = vec2(sa.w, tv.x);
+	vec2 tb = vec2(sb.w, tv.y);
+	vec2 tc = vec2(sc.w, tv.z);
 
 	vec3 pa = a - p;
 	vec3 pb = b - p;
@@ -214,7 +353,7 @@ SurfaceInfo triangleSurfaceInfo(int id, vec3 p)
 	float lb = length(cross(pc, pa)) * areaInv;
 	float lc = 1.0 - la - lb;
 
-	ret.ns = normalize(na * la + nb * lb + nc * lc);
+	ret.ns = instanceNormal(instance, na * la + nb * lb + nc * lc);
 	ret.ng = normalize(cross(pa, pb));
 	ret.uv = ta * la + tb * lb + tc * lc;
 
@@ -223,11 +362,9 @@ SurfaceInfo triangleSurfaceInfo(int id, vec3 p)
 	return ret;
 }
 
-bool boxHit(int id, Ray ray, out float tMin)
+bool boxHit(vec3 pMin, vec3 pMax, Ray ray, out float tMin)
 {
 	float tMax;
-	vec3 pMin = texelFetch(uBounds, id * 2 + 0).xyz;
-	vec3 pMax = texelFetch(uBounds, id * 2 + 1).xyz;
 
 	const float eps = 1e-6;
 	vec3 o = ray.ori;
@@ -328,35 +465,331 @@ bool boxHit(int id, Ray ray, out float tMin)
 	return false;
 }
 
+bool boxHit(int id, Ray ray, out float tMin)
+{
+	vec3 pMin = texelFetch(uBounds, id * 2 + 0).xyz;
+	vec3 pMax = texelFetch(uBounds, id * 2 + 1).xyz;
+	return boxHit(pMin, pMax, ray, tMin);
+}
+
+// Trees are packed one after another, the TLAS first. For a tree starting at node nodeBase,
+// its uHitTable segment 0 holds per node info (a leaf, or subtree size) and segments 1-5
+// map threading positions to nodes; face 0 threads nodes in storage order
+int hitTableNode(int nodeBase, int treeSize, int face, int k)
+{
+	return (face == 0) ? k : texelFetch(uHitTable, nodeBase * HitTableSegments + face * treeSize + k).r;
+}
+
+int hitTableInfo(int nodeBase, int node)
+{
+	return texelFetch(uHitTable, nodeBase * HitTableSegments + node).r;
+}
+
+// Threading for a ray; without segments 1-5 only the storage order is available
+int threadingFace(vec3 dir)
+{
+#ifdef BVH_SHORT_STACK
+	return 0;
+#else
+	return cubemapFace(-dir);
+#endif
+}
+
+int hitTableMiss(int nodeInfo, int k)
+{
+	return k + ((nodeInfo < 0) ? 1 : nodeInfo);
+}
+
+// Leaves are BVH_LEAF_MASK | (count - 1) << 28 | first, a range of the tree's triangles.
+// TLAS leaves always hold a single instance
+int leafFirst(int nodeInfo)
+{
+	return nodeInfo & 0x0fffffff;
+}
+
+int leafCount(int nodeInfo)
+{
+	return ((nodeInfo >> 28) & 7) + 1;
+}
+
+// Closest hit among a BLAS leaf's triangles, in the instance's object space
+int leafHit(Instance inst, int nodeInfo, Ray objRay, inout float objDist)
+{
+	int closest = -1;
+	int first = leafFirst(nodeInfo);
+	for (int i = first; i < first + leafCount(nodeInfo); i++)
+	{
+		HitInfo hInfo = intersectTriangle(inst.primBase + i, objRay);
+		if (hInfo.hit && hInfo.dist < objDist)
+		{
+			objDist = hInfo.dist;
+			closest = inst.primOffset + i;
+		}
+	}
+	return closest;
+}
+
+bool leafTest(Instance inst, int nodeInfo, Ray objRay, float objDist)
+{
+	int first = leafFirst(nodeInfo);
+	for (int i = first; i < first + leafCount(nodeInfo); i++)
+	{
+		if (triangleOccludes(inst.primBase + i, objRay, objDist))
+			return true;
+	}
+	return false;
+}
+
+bool wideChildHit(int node, int slot, Ray ray, out float tMin)
+{
+	int id = node * uWideBvhWidth + slot;
+	vec3 pMin = texelFetch(uWideBounds, id * 2 + 0).xyz;
+	vec3 pMax = texelFetch(uWideBounds, id * 2 + 1).xyz;
+	return boxHit(pMin, pMax, ray, tMin);
+}
+
+int wideBlasHit(int instance, Ray ray, inout float dist)
+{
+	Instance inst = getInstance(instance);
+	float scale;
+	Ray objRay = instanceRay(instance, ray, scale);
+	float objDist = dist * scale;
+	int closest = -1;
+
+	int stack[WideBvhStackSize];
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top > 0)
+	{
+		int node = inst.wideBase + stack[--top];
+
+		int hitChildren[WideBvhMaxWidth];
+		float hitDists[WideBvhMaxWidth];
+		int hitCount = 0;
+
+		for (int i = 0; i < uWideBvhWidth; i++)
+		{
+			int child = texelFetch(uWideChildren, node * uWideBvhWidth + i).r;
+			if (child == -1)
+				break;
+
+			float boxDist;
+			if (!wideChildHit(node, i, objRay, boxDist) || boxDist > objDist)
+				continue;
+
+			if (child < 0)
+			{
+				int primIndex = leafHit(inst, child, objRay, objDist);
+				if (primIndex != -1)
+					closest = primIndex;
+				continue;
+			}
+
+			// Keep hit children sorted far to near so the nearest is popped first
+			int j = hitCount++;
+			while (j > 0 && hitDists[j - 1] < boxDist)
+			{
+				hitDists[j] = hitDists[j - 1];
+				hitChildren[j] = hitChildren[j - 1];
+				j--;
+			}
+			hitDists[j] = boxDist;
+			hitChildren[j] = child;
+		}
+
+		for (int i = 0; i < hitCount; i++)
+			stack[top++] = hitChildren[i];
+	}
+	if (closest != -1)
+		dist = objDist / scale;
+	return closest;
+}
+
+bool wideBlasTest(int instance, Ray ray, float dist)
+{
+	Instance inst = getInstance(instance);
+	float scale;
+	Ray objRay = instanceRay(instance, ray, scale);
+	float objDist = dist * scale;
+
+	int stack[WideBvhStackSize];
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top > 0)
+	{
+		int node = inst.wideBase + stack[--top];
+
+		for (int i = 0; i < uWideBvhWidth; i++)
+		{
+			int child = texelFetch(uWideChildren, node * uWideBvhWidth + i).r;
+			if (child == -1)
+				break;
+
+			float boxDist;
+			if (!wideChildHit(node, i, objRay, boxDist) || boxDist > objDist)
+				continue;
+
+			if (child < 0)
+			{
+				if (leafTest(inst, child, objRay, objDist))
+					return true;
+			}
+			else
+				stack[top++] = child;
+		}
+	}
+	return false;
+}
+
+int wideBvhHit(Ray ray, out float dist)
+{
+	dist = 1e8;
+	int closest = -1;
+
+	int stack[WideBvhStackSize];
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top > 0)
+	{
+		int node = stack[--top];
+
+		int hitChildren[WideBvhMaxWidth];
+		float hitDists[WideBvhMaxWidth];
+		int hitCount = 0;
+
+		for (int i = 0; i < uWideBvhWidth; i++)
+		{
+			int child = texelFetch(uWideChildren, node * uWideBvhWidth + i).r;
+			if (child == -1)
+				break;
+
+			float boxDist;
+			if (!wideChildHit(node, i, ray, boxDist) || boxDist > dist)
+				continue;
+
+			if (child < 0)
+			{
+				int primIndex = wideBlasHit(leafFirst(child), ray, dist);
+				if (primIndex != -1)
+					closest = primIndex;
+				continue;
+			}
+
+			int j = hitCount++;
+			while (j > 0 && hitDists[j - 1] < boxDist)
+			{
+				hitDists[j] = hitDists[j - 1];
+				hitChildren[j] = hitChildren[j - 1];
+				j--;
+			}
+			hitDists[j] = boxDist;
+			hitChildren[j] = child;
+		}
+
+		for (int i = 0; i < hitCount; i++)
+			stack[top++] = hitChildren[i];
+	}
+	return closest;
+}
+
+bool wideBvhTest(Ray ray, float dist)
+{
+	int stack[WideBvhStackSize];
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top > 0)
+	{
+		int node = stack[--top];
+
+		for (int i = 0; i < uWideBvhWidth; i++)
+		{
+			int child = texelFetch(uWideChildren, node * uWideBvhWidth + i).r;
+			if (child == -1)
+				break;
+
+			float boxDist;
+			if (!wideChildHit(node, i, ray, boxDist) || boxDist > dist)
+				continue;
+
+			if (child < 0)
+			{
+				if (wideBlasTest(leafFirst(child), ray, dist))
+					return true;
+			}
+			else
+				stack[top++] = child;
+		}
+	}
+	return false;
+}
+
+int blasDebug(int instance, Ray ray, inout float dist, inout float maxDepth)
+{
+	Instance inst = getInstance(instance);
+	float scale;
+	Ray objRay = instanceRay(instance, ray, scale);
+	float objDist = dist * scale;
+	int closest = -1;
+	int face = threadingFace(objRay.dir);
+
+	int k = 0;
+	while (k != inst.treeSize)
+	{
+		int nodeIndex = hitTableNode(inst.nodeBase, inst.treeSize, face, k);
+		int nodeInfo = hitTableInfo(inst.nodeBase, nodeIndex);
+
+		float boxDist;
+		bool bHit = boxHit(inst.nodeBase + nodeIndex, objRay, boxDist);
+		if (!bHit || (bHit && boxDist > objDist))
+		{
+			k = hitTableMiss(nodeInfo, k);
+			continue;
+		}
+
+		if (nodeInfo < 0)
+		{
+			int primIndex = leafHit(inst, nodeInfo, objRay, objDist);
+			if (primIndex != -1)
+				closest = primIndex;
+		}
+		maxDepth += 1.0;
+		k++;
+	}
+	if (closest != -1)
+		dist = objDist / scale;
+	return closest;
+}
+
 int bvhDebug(Ray ray, out float maxDepth)
 {
 	float dist = 1e8;
 	int closest = -1;
 	maxDepth = 0.0f;
-	int tableOffset = cubemapFace(-ray.dir) * uBvhSize;
+	int face = threadingFace(ray.dir);
 
 	int k = 0;
 	while (k != uBvhSize)
 	{
-		int nodeIndex = texelFetch(uHitTable, tableOffset + k).r;
-		int primIndex = texelFetch(uHitTable, tableOffset + k).g;
+		int nodeIndex = hitTableNode(0, uBvhSize, face, k);
+		int nodeInfo = hitTableInfo(0, nodeIndex);
 
 		float boxDist;
 		bool bHit = boxHit(nodeIndex, ray, boxDist);
 		if (!bHit || (bHit && boxDist > dist))
 		{
-			k = texelFetch(uHitTable, tableOffset + k).b;
+			k = hitTableMiss(nodeInfo, k);
 			continue;
 		}
 
-		if (primIndex >= 0)
+		if (nodeInfo < 0)
 		{
-			HitInfo hInfo = intersectTriangle(primIndex, ray);
-			if (hInfo.hit && hInfo.dist < dist)
-			{
-				dist = hInfo.dist;
+			int primIndex = blasDebug(leafFirst(nodeInfo), ray, dist, maxDepth);
+			if (primIndex != -1)
 				closest = primIndex;
-			}
 		}
 		maxDepth += 1.0;
 		k++;
@@ -364,71 +797,321 @@ int bvhDebug(Ray ray, out float maxDepth)
 	return closest;
 }
 
-bool bvhTest(Ray ray, float dist)
+#ifdef BVH_SHORT_STACK
+struct ShortStack
+{
+	int nodes[ShortStackSize];
+	float dists[ShortStackSize];
+	int top;
+	int threadEnd;	// While not -1, the overflowed subtree ending here is walked in storage order
+};
+
+// First node to visit, -1 if the root box is missed
+int shortStackBegin(int nodeBase, Ray ray, float dist, out ShortStack st)
+{
+	st.top = 0;
+	st.threadEnd = -1;
+	float boxDist;
+	return (boxHit(nodeBase, ray, boxDist) && boxDist <= dist) ? 0 : -1;
+}
+
+// Boxes are tested by the parent, except within an overflowed subtree
+bool shortStackVisit(int threadEnd, int nodeBase, int k, Ray ray, float dist)
+{
+	if (threadEnd == -1)
+		return true;
+	float boxDist;
+	return boxHit(nodeBase + k, ray, boxDist) && boxDist <= dist;
+}
+
+int shortStackPop(inout ShortStack st, float dist)
+{
+	while (st.top > 0)
+	{
+		st.top--;
+		if (st.dists[st.top] <= dist)
+			return st.nodes[st.top];
+	}
+	return -1;
+}
+
+// Next node after k, -1 when done. Both children of an interior node are tested and the
+// nearer one entered, the other one pushed. When the stack is full the node's subtree is
+// walked in storage order with subtree sizes as skip links, which needs no stack at all
+int shortStackNext(inout ShortStack st, int nodeBase, int k, int nodeInfo, bool visited, Ray ray, float dist)
+{
+	if (st.threadEnd != -1)
+	{
+		int next = (visited && nodeInfo >= 0) ? k + 1 : hitTableMiss(nodeInfo, k);
+		if (next != st.threadEnd)
+			return next;
+		st.threadEnd = -1;
+		return shortStackPop(st, dist);
+	}
+	if (nodeInfo < 0)
+		return shortStackPop(st, dist);
+
+	int left = k + 1;
+	int right = hitTableMiss(hitTableInfo(nodeBase, left), left);
+	float leftDist, rightDist;
+	bool leftHit = boxHit(nodeBase + left, ray, leftDist) && leftDist <= dist;
+	bool rightHit = boxHit(nodeBase + right, ray, rightDist) && rightDist <= dist;
+
+	if (leftHit && rightHit)
+	{
+		if (st.top == ShortStackSize)
+		{
+			st.threadEnd = k + nodeInfo;
+			return left;
+		}
+		bool leftFirst = leftDist <= rightDist;
+		st.nodes[st.top] = leftFirst ? right : left;
+		st.dists[st.top] = leftFirst ? rightDist : leftDist;
+		st.top++;
+		return leftFirst ? left : right;
+	}
+	if (leftHit)
+		return left;
+	if (rightHit)
+		return right;
+	return shortStackPop(st, dist);
+}
+
+bool blasTest(int instance, Ray ray, float dist)
+{
+	Instance inst = getInstance(instance);
+	float scale;
+	Ray objRay = instanceRay(instance, ray, scale);
+	float objDist = dist * scale;
+
+	ShortStack st;
+	int k = shortStackBegin(inst.nodeBase, objRay, objDist, st);
+	while (k != -1)
+	{
+		int nodeInfo = hitTableInfo(inst.nodeBase, k);
+		bool visited = shortStackVisit(st.threadEnd, inst.nodeBase, k, objRay, objDist);
+		if (visited && nodeInfo < 0)
+		{
+			if (leafTest(inst, nodeInfo, objRay, objDist)) return true;
+		}
+		k = shortStackNext(st, inst.nodeBase, k, nodeInfo, visited, objRay, objDist);
+	}
+	return false;
+}
+
+// Occlusion-only entry point for shadow and visibility rays: returns at the first triangle
+// hit in (0, dist) without recording it or touching shading data
+bool bvhOccluded(Ray ray, float dist)
+{
+	if (uWideBvh)
+		return wideBvhTest(ray, dist);
+
+	ShortStack st;
+	int k = shortStackBegin(0, ray, dist, st);
+	while (k != -1)
+	{
+		int nodeInfo = hitTableInfo(0, k);
+		bool visited = shortStackVisit(st.threadEnd, 0, k, ray, dist);
+		if (visited && nodeInfo < 0)
+		{
+			if (blasTest(leafFirst(nodeInfo), ray, dist)) return true;
+		}
+		k = shortStackNext(st, 0, k, nodeInfo, visited, ray, dist);
+	}
+	return false;
+}
+
+// Closest hit inside one instance; dist is the world space distance both ways
+int blasHit(int instance, Ray ray, inout float dist)
+{
+	Instance inst = getInstance(instance);
+	float scale;
+	Ray objRay = instanceRay(instance, ray, scale);
+	float objDist = dist * scale;
+	int closest = -1;
+
+	ShortStack st;
+	int k = shortStackBegin(inst.nodeBase, objRay, objDist, st);
+	while (k != -1)
+	{
+		int nodeInfo = hitTableInfo(inst.nodeBase, k);
+		bool visited = shortStackVisit(st.threadEnd, inst.nodeBase, k, objRay, objDist);
+		if (visited && nodeInfo < 0)
+		{
+			int primIndex = leafHit(inst, nodeInfo, objRay, objDist);
+			if (primIndex != -1)
+				closest = primIndex;
+		}
+		k = shortStackNext(st, inst.nodeBase, k, nodeInfo, visited, objRay, objDist);
+	}
+	if (closest != -1)
+		dist = objDist / scale;
+	return closest;
+}
+
+int bvhHit(Ray ray, out float dist)
+{
+	if (uWideBvh)
+		return wideBvhHit(ray, dist);
+
+	dist = 1e8;
+	int closest = -1;
+
+	ShortStack st;
+	int k = shortStackBegin(0, ray, dist, st);
+	while (k != -1)
+	{
+		int nodeInfo = hitTableInfo(0, k);
+		bool visited = shortStackVisit(st.threadEnd, 0, k, ray, dist);
+		if (visited && nodeInfo < 0)
+		{
+			int primIndex = blasHit(leafFirst(nodeInfo), ray, dist);
+			if (primIndex != -1)
+				closest = primIndex;
+		}
+		k = shortStackNext(st, 0, k, nodeInfo, visited, ray, dist);
+	}
+	return closest;
+}
+#else
+bool blasTest(int instance, Ray ray, float dist)
+{
+	Instance inst = getInstance(instance);
+	float scale;
+	Ray objRay = instanceRay(instance, ray, scale);
+	float objDist = dist * scale;
+	int face = cubemapFace(-objRay.dir);
+
+	int k = 0;
+	while (k != inst.treeSize)
+	{
+		int nodeIndex = hitTableNode(inst.nodeBase, inst.treeSize, face, k);
+		int nodeInfo = hitTableInfo(inst.nodeBase, nodeIndex);
+
+		float boxDist;
+		bool bHit = boxHit(inst.nodeBase + nodeIndex, objRay, boxDist);
+		if (!bHit || (bHit && boxDist > objDist))
+		{
+			k = hitTableMiss(nodeInfo, k);
+			continue;
+		}
+
+		if (nodeInfo < 0)
+		{
+			if (leafTest(inst, nodeInfo, objRay, objDist)) return true;
+		}
+		k++;
+	}
+	return false;
+}
+
+// Occlusion-only entry point for shadow and visibility rays: returns at the first triangle
+// hit in (0, dist) without recording it or touching shading data
+bool bvhOccluded(Ray ray, float dist)
 {
-	int tableOffset = cubemapFace(-ray.dir) * uBvhSize;
+	if (uWideBvh)
+		return wideBvhTest(ray, dist);
+
+	int face = cubemapFace(-ray.dir);
 	int k = 0;
 
 	while (k != uBvhSize)
 	{
-		int nodeIndex = texelFetch(uHitTable, tableOffset + k).r;
-		int primIndex = texelFetch(uHitTable, tableOffset + k).g;
+		int nodeIndex = hitTableNode(0, uBvhSize, face, k);
+		int nodeInfo = hitTableInfo(0, nodeIndex);
 
 		float boxDist;
 		bool bHit = boxHit(nodeIndex, ray, boxDist);
 		if (!bHit || (bHit && boxDist > dist))
 		{
-			k = texelFetch(uHitTable, tableOffset + k).b;
+			k = hitTableMiss(nodeInfo, k);
 			continue;
 		}
 
-		if (primIndex >= 0)
+		if (nodeInfo < 0)
 		{
-			HitInfo hInfo = intersectTriangle(primIndex, ray);
-			if (hInfo.hit && hInfo.dist < dist) return true;
+			if (blasTest(leafFirst(nodeInfo), ray, dist)) return true;
 		}
 		k++;
 	}
 	return false;
 }
 
+// Closest hit inside one instance; dist is the world space distance both ways
+int blasHit(int instance, Ray ray, inout float dist)
+{
+	Instance inst = getInstance(instance);
+	float scale;
+	Ray objRay = instanceRay(instance, ray, scale);
+	float objDist = dist * scale;
+	int closest = -1;
+	int face = cubemapFace(-objRay.dir);
+
+	int k = 0;
+	while (k != inst.treeSize)
+	{
+		int nodeIndex = hitTableNode(inst.nodeBase, inst.treeSize, face, k);
+		int nodeInfo = hitTableInfo(inst.nodeBase, nodeIndex);
+
+		float boxDist;
+		bool bHit = boxHit(inst.nodeBase + nodeIndex, objRay, boxDist);
+		if (!bHit || (bHit && boxDist > objDist))
+		{
+			k = hitTableMiss(nodeInfo, k);
+			continue;
+		}
+
+		if (nodeInfo < 0)
+		{
+			int primIndex = leafHit(inst, nodeInfo, objRay, objDist);
+			if (primIndex != -1)
+				closest = primIndex;
+		}
+		k++;
+	}
+	if (closest != -1)
+		dist = objDist / scale;
+	return closest;
+}
+
 int bvhHit(Ray ray, out float dist)
 {
+	if (uWideBvh)
+		return wideBvhHit(ray, dist);
+
 	dist = 1e8;
 	int closest = -1;
-	int tableOffset = cubemapFace(-ray.dir) * uBvhSize;
+	int face = cubemapFace(-ray.dir);
 
 	int k = 0;
 	while (k != uBvhSize)
 	{
-		int nodeIndex = texelFetch(uHitTable, tableOffset + k).r;
-		int primIndex = texelFetch(uHitTable, tableOffset + k).g;
+		int nodeIndex = hitTableNode(0, uBvhSize, face, k);
+		int nodeInfo = hitTableInfo(0, nodeIndex);
 
 		float boxDist;
 		bool bHit = boxHit(nodeIndex, ray, boxDist);
 		if (!bHit || (bHit && boxDist > dist))
 		{
-			k = texelFetch(uHitTable, tableOffset + k).b;
+			k = hitTableMiss(nodeInfo, k);
 			continue;
 		}
 
-		if (primIndex >= 0)
+		if (nodeInfo < 0)
 		{
-			HitInfo hInfo = intersectTriangle(primIndex, ray);
-			if (hInfo.hit && hInfo.dist < dist)
-			{
-				dist = hInfo.dist;
+			int primIndex = blasHit(leafFirst(nodeInfo), ray, dist);
+			if (primIndex != -1)
 				closest = primIndex;
-			}
 		}
 		k++;
 	}
 	return closest;
 }
+#endif
 
 bool visible(vec3 x, vec3 y)
 {
 	float dist = distance(x, y) - 2e-5;
 	vec3 wi = normalize(y - x);
-	return !bvhTest(makeRay(x + wi * 1e-5, wi), dist);
+	return !bvhOccluded(makeRay(x + wi * 1e-5, wi), dist);
 }
\ No newline at end of file
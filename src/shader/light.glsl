@@ -123,13 +123,8 @@ LightLiSample lightSampleLi(int id, vec3 x, vec2 u)
 {
 	int triId = id + uObjPrimCount;
 
-	int ia = texelFetch(uIndices, triId * 3 + 0).r;
-	int ib = texelFetch(uIndices, triId * 3 + 1).r;
-	int ic = texelFetch(uIndices, triId * 3 + 2).r;
-
-	vec3 a = texelFetch(uVertices, ia).xyz;
-	vec3 b = texelFetch(uVertices, ib).xyz;
-	vec3 c = texelFetch(uVertices, ic).xyz;
+	vec3 a, b, c;
+	triangleVertices(triId, a, b, c);
 
 	vec3 y = sampleTriangleUniform(a, b, c, u);
 	vec3 wi = normalize(y - x);
@@ -144,10 +139,11 @@ LightLiSample lightSampleLi(int id, vec3 x, vec2 u)
 	float pdf = dist * dist / (triangleArea(a, b, c) * cosTheta);
 
 	float testDist = dist - 1e-4 - 1e-6;
-	if (bvhTest(lightRay, testDist) || pdf < 1e-8)
+	if (pdf < 1e-8 || bvhOccluded(lightRay, testDist))
 		return InvalidLiSample;
 
-	vec3 weight = lightLe(id, y, -wi);
+	// The facing test lightLe would repeat is the cosTheta one above
+	vec3 weight = texelFetch(uLightPower, id).rgb / triangleArea(a, b, c) * 0.5f * PiInv;
 
 	float pdfSample = luminance(texelFetch(uLightPower, id).rgb) / uLightSum;
 	pdf *= pdfSample;
@@ -212,7 +208,7 @@ LightLiSample envSampleLi(vec3 x, vec4 u)
 
 	Ray ray = rayOffseted(x, wi);
 	float dist = 1e8;
-	if (bvhTest(ray, dist) || pdf == 0.0)
+	if (pdf == 0.0 || bvhOccluded(ray, dist))
 		return InvalidLiSample;
 
 	return makeLightLiSample(wi, envLe(wi) / pdf, pdf);
@@ -13,7 +13,6 @@ vec3 BUGVAL = vec3(0.0);
 
 uniform samplerBuffer uMaterials;
 uniform isamplerBuffer uMatTypes;
-uniform isamplerBuffer uMatTexIndices;
 
 uniform int uNumTextures;
 uniform sampler2DArray uTextures;
@@ -90,7 +89,7 @@ void lightIntegTrace(inout Sampler s)
 		vec3 pos = rayPoint(ray, dist);
 		SurfaceInfo surf = triangleSurfaceInfo(id, pos);
 
-		int matTexId = texelFetch(uMatTexIndices, id).r;
+		int matTexId = triangleMatTexIndex(id);
 		int matId = matTexId & 0x0000ffff;
 		int texId = matTexId >> 16;
 
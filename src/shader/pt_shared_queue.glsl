@@ -14,7 +14,6 @@ vec3 BUGVAL;
 
 uniform samplerBuffer uMaterials;
 uniform isamplerBuffer uMatTypes;
-uniform isamplerBuffer uMatTexIndices;
 
 uniform int uNumTextures;
 uniform sampler2DArray uTextures;
@@ -110,7 +109,7 @@ void extendPath(QueueItem item, inout Sampler s)
 
 	SurfaceInfo surf = triangleSurfaceInfo(id, pos);
 
-	int matTexId = texelFetch(uMatTexIndices, id).r;
+	int matTexId = triangleMatTexIndex(id);
 	int matId = matTexId & 0x0000ffff;
 	int texId = matTexId >> 16;
 
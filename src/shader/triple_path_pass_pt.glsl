@@ -13,7 +13,6 @@ vec3 BUGVAL = vec3(0.0);
 
 uniform samplerBuffer uMaterials;
 uniform isamplerBuffer uMatTypes;
-uniform isamplerBuffer uMatTexIndices;
 
 uniform int uNumTextures;
 uniform sampler2DArray uTextures;
@@ -86,7 +85,7 @@ vec3 traceCameraPath(Ray ray, inout Sampler s)
 		if (bounce > 1)
 			surf = triangleSurfaceInfo(id, pos);
 
-		int matTexId = texelFetch(uMatTexIndices, id).r;
+		int matTexId = triangleMatTexIndex(id);
 		int matId = matTexId & 0x0000ffff;
 		int texId = matTexId >> 16;
 
@@ -0,0 +1,589 @@
+// Headless BVH quality report. Loads a scene XML, flattens every object and light into world
+// space and builds one tree over it with each CPU builder, using the scene's <accelerator>
+// settings otherwise. For each tree it reports SAH cost, EPO, node counts, the leaf depth
+// histogram and memory footprint, then replays the MTBVH walks of intersection.glsl on the
+// CPU over fixed ray sets: closest hit for primary and random rays, and the any-hit walk of
+// bvhOccluded for shadow rays, which are reported separately. Results are written as JSON.
+//
+//   BVHAnalysis <scene.xml> [output.json = bvh_analysis.json] [rays per axis = 256]
+//               [builders = standard,quick,linear,spatial]
+//
+// Meshes are uploaded while the scene loads, so a hidden window provides a GL context.
+
+#include "../core/Scene.h"
+#include "../accelerator/BVHIntersector.h"
+
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <sstream>
+
+const float Pi = 3.141592653589793f;
+
+struct TraversalStats
+{
+	int64_t rays = 0;
+	int64_t hits = 0;
+	int64_t nodesVisited = 0;
+	int64_t leavesVisited = 0;
+	int64_t trianglesTested = 0;
+};
+
+struct Mesh
+{
+	std::vector<glm::vec3> vertices;
+	std::vector<uint32_t> indices;
+	AABB bound;
+	int lightPrimBase = 0;	// Light triangles are appended after all objects
+
+	glm::vec3 vertex(int prim, int i) const { return vertices[indices[prim * 3 + i]]; }
+};
+
+// Ports of the tests in intersection.glsl, kept branch for branch so the replay makes the
+// same decisions as the shader
+bool boxHit(const AABB& box, const Ray& ray, float& tMin)
+{
+	float tMax;
+	const float eps = 1e-6f;
+	glm::vec3 o = ray.ori, d = ray.dir, pMin = box.pMin, pMax = box.pMax;
+
+	for (int a = 0; a < 3; a++)
+	{
+		int b = (a + 1) % 3, c = (a + 2) % 3;
+		if (std::abs(d[a]) > 1.0f - eps)
+		{
+			if (o[b] > pMin[b] && o[b] < pMax[b] && o[c] > pMin[c] && o[c] < pMax[c])
+			{
+				float dInv = 1.0f / d[a];
+				float ta = (pMin[a] - o[a]) * dInv;
+				float tb = (pMax[a] - o[a]) * dInv;
+				tMin = std::min(ta, tb);
+				tMax = std::max(ta, tb);
+				return tMax >= 0.0f && tMax >= tMin;
+			}
+			return false;
+		}
+	}
+
+	glm::vec3 dInv = 1.0f / d;
+	glm::vec3 vta = (pMin - o) * dInv;
+	glm::vec3 vtb = (pMax - o) * dInv;
+	glm::vec3 vtMin = glm::min(vta, vtb);
+	glm::vec3 vtMax = glm::max(vta, vtb);
+	glm::vec3 dt = vtMax - vtMin;
+
+	float tyz = vtMax.z - vtMin.y;
+	float tzx = vtMax.x - vtMin.z;
+	float txy = vtMax.y - vtMin.x;
+
+	if (std::abs(d.x) < eps && dt.y + dt.z > tyz)
+	{
+		tMin = std::max(vtMin.y, vtMin.z);
+		tMax = std::min(vtMax.y, vtMax.z);
+		return tMax >= 0.0f && tMax >= tMin;
+	}
+	if (std::abs(d.y) < eps && dt.z + dt.x > tzx)
+	{
+		tMin = std::max(vtMin.z, vtMin.x);
+		tMax = std::min(vtMax.z, vtMax.x);
+		return tMax >= 0.0f && tMax >= tMin;
+	}
+	if (std::abs(d.z) < eps && dt.x + dt.y > txy)
+	{
+		tMin = std::max(vtMin.x, vtMin.y);
+		tMax = std::min(vtMax.x, vtMax.y);
+		return tMax >= 0.0f && tMax >= tMin;
+	}
+	if (dt.y + dt.z > tyz && dt.z + dt.x > tzx && dt.x + dt.y > txy)
+	{
+		tMin = std::max(std::max(vtMin.x, vtMin.y), vtMin.z);
+		tMax = std::min(std::min(vtMax.x, vtMax.y), vtMax.z);
+		return tMax >= 0.0f && tMax >= tMin;
+	}
+	return false;
+}
+
+bool intersectTriangle(const glm::vec3& a, const glm::vec3& b, const glm::vec3& c, const Ray& ray, float& dist)
+{
+	const float eps = 1e-6f;
+	glm::vec3 ab = b - a, ac = c - a;
+	glm::vec3 p = glm::cross(ray.dir, ac);
+	float det = glm::dot(ab, p);
+	if (std::abs(det) < eps)
+		return false;
+
+	glm::vec3 ao = ray.ori - a;
+	if (det < 0.0f)
+	{
+		ao = -ao;
+		det = -det;
+	}
+	float u = glm::dot(ao, p);
+	if (u < 0.0f || u > det)
+		return false;
+
+	glm::vec3 q = glm::cross(ao, ab);
+	float v = glm::dot(ray.dir, q);
+	if (v < 0.0f || u + v > det)
+		return false;
+
+	dist = glm::dot(ac, q) / det;
+	return dist > 0.0f;
+}
+
+int cubemapFace(const glm::vec3& dir)
+{
+	glm::vec3 v = glm::abs(dir);
+	int maxDim = (v.x > v.y) ? (v.x > v.z ? 0 : 2) : (v.y > v.z ? 1 : 2);
+	return maxDim * 2 + (dir[maxDim] > 0.0f ? 0 : 1);
+}
+
+// The MTBVH loop of bvhHit/blasHit over a single tree, or of bvhOccluded with anyHit, which
+// returns at the first triangle closer than dist
+bool traceMTBVH(const PackedBVH& bvh, const Mesh& mesh, const Ray& ray, TraversalStats& stats, float dist = 1e8f,
+	bool anyHit = false)
+{
+	int treeSize = bvh.bounds.size();
+	const int* hitTable = bvh.hitTable.data();
+	int face = cubemapFace(-ray.dir);
+	bool hit = false;
+
+	int k = 0;
+	while (k != treeSize)
+	{
+		int node = (face == 0) ? k : hitTable[face * treeSize + k];
+		int nodeInfo = hitTable[node];
+		stats.nodesVisited++;
+
+		float boxDist;
+		if (!boxHit(bvh.bounds[node], ray, boxDist) || boxDist > dist)
+		{
+			k += (nodeInfo < 0) ? 1 : nodeInfo;
+			continue;
+		}
+		if (nodeInfo < 0)
+		{
+			stats.leavesVisited++;
+			int first = bvhLeafFirst(nodeInfo);
+			for (int i = first; i < first + bvhLeafCount(nodeInfo); i++)
+			{
+				int prim = bvh.primOrder[i];
+				float triDist;
+				stats.trianglesTested++;
+				if (intersectTriangle(mesh.vertex(prim, 0), mesh.vertex(prim, 1), mesh.vertex(prim, 2), ray, triDist) &&
+					triDist < dist)
+				{
+					dist = triDist;
+					hit = true;
+					if (anyHit)
+						break;
+				}
+			}
+			if (hit && anyHit)
+				break;
+		}
+		k++;
+	}
+	stats.rays++;
+	stats.hits += hit;
+	return hit;
+}
+
+// Area of a triangle clipped to a box, by Sutherland-Hodgman against the six slabs
+float clippedArea(const glm::vec3& va, const glm::vec3& vb, const glm::vec3& vc, const AABB& box)
+{
+	std::vector<glm::vec3> poly = { va, vb, vc }, clipped;
+	for (int plane = 0; plane < 6 && !poly.empty(); plane++)
+	{
+		int dim = plane / 2;
+		bool isMax = plane & 1;
+		float bound = isMax ? box.pMax[dim] : box.pMin[dim];
+		auto inside = [&](const glm::vec3& p) { return isMax ? p[dim] <= bound : p[dim] >= bound; };
+
+		clipped.clear();
+		for (size_t i = 0; i < poly.size(); i++)
+		{
+			const glm::vec3& p = poly[i];
+			const glm::vec3& q = poly[(i + 1) % poly.size()];
+			if (inside(p))
+				clipped.push_back(p);
+			if (inside(p) != inside(q))
+				clipped.push_back(p + (q - p) * ((bound - p[dim]) / (q[dim] - p[dim])));
+		}
+		poly.swap(clipped);
+	}
+	glm::vec3 sum(0.0f);
+	for (size_t i = 1; i + 1 < poly.size(); i++)
+		sum += glm::cross(poly[i] - poly[0], poly[i + 1] - poly[0]);
+	return 0.5f * glm::length(sum);
+}
+
+bool overlaps(const AABB& a, const AABB& b)
+{
+	for (int i = 0; i < 3; i++)
+	{
+		if (a.pMin[i] > b.pMax[i] || b.pMin[i] > a.pMax[i])
+			return false;
+	}
+	return true;
+}
+
+// End-point overlap [Aila et al. 2013]: for every node, the surface area of triangles outside
+// its subtree that still lies inside its box, weighted like the SAH and normalized by the
+// total triangle area. Subtrees are contiguous in storage order, which the query skips over
+float computeEPO(const PackedBVH& bvh, const Mesh& mesh)
+{
+	int treeSize = bvh.bounds.size();
+	const int* sizeIndices = bvh.hitTable.data();
+	auto isLeaf = [&](int k) { return sizeIndices[k] < 0; };
+	auto subtreeSize = [&](int k) { return isLeaf(k) ? 1 : sizeIndices[k]; };
+
+	float totalArea = 0.0f;
+	for (size_t i = 0; i < mesh.indices.size() / 3; i++)
+		totalArea += 0.5f * glm::length(glm::cross(mesh.vertex(i, 1) - mesh.vertex(i, 0), mesh.vertex(i, 2) - mesh.vertex(i, 0)));
+	if (totalArea <= 0.0f)
+		return 0.0f;
+
+	// Spatial splits reference a triangle from several leaves, so visits are stamped
+	std::vector<int> stamp(mesh.indices.size() / 3, -1);
+	double epo = 0.0;
+	for (int n = 0; n < treeSize; n++)
+	{
+		const AABB& box = bvh.bounds[n];
+		for (int m = n; m < n + subtreeSize(n); m++)
+		{
+			if (!isLeaf(m))
+				continue;
+			int first = bvhLeafFirst(sizeIndices[m]);
+			for (int i = first; i < first + bvhLeafCount(sizeIndices[m]); i++)
+				stamp[bvh.primOrder[i]] = n;
+		}
+
+		double area = 0.0;
+		int k = 0;
+		while (k < treeSize)
+		{
+			if (k == n || !overlaps(bvh.bounds[k], box))
+			{
+				k += subtreeSize(k);
+				continue;
+			}
+			if (isLeaf(k))
+			{
+				int first = bvhLeafFirst(sizeIndices[k]);
+				for (int i = first; i < first + bvhLeafCount(sizeIndices[k]); i++)
+				{
+					int prim = bvh.primOrder[i];
+					if (stamp[prim] == n)
+						continue;
+					stamp[prim] = n;
+					area += clippedArea(mesh.vertex(prim, 0), mesh.vertex(prim, 1), mesh.vertex(prim, 2), box);
+				}
+			}
+			k++;
+		}
+		epo += area * (isLeaf(n) ? bvhLeafCount(sizeIndices[n]) : 1);
+	}
+	return static_cast<float>(epo / totalArea);
+}
+
+Mesh flattenScene(const Scene& scene)
+{
+	Mesh mesh;
+	auto append = [&](const ModelInstancePtr& model)
+	{
+		glm::mat4 transform = model->modelMatrix();
+		for (const auto& meshInstance : model->meshInstances())
+		{
+			const auto& meshData = meshInstance->meshData;
+			uint32_t offset = mesh.vertices.size();
+			for (const auto& p : meshData->positions)
+			{
+				mesh.vertices.push_back(glm::vec3(transform * glm::vec4(p, 1.0f)));
+				mesh.bound.expand(AABB(mesh.vertices.back()));
+			}
+			for (auto i : meshData->indices)
+				mesh.indices.push_back(i + offset);
+		}
+	};
+	for (const auto& object : scene.objects)
+		append(object);
+	mesh.lightPrimBase = mesh.indices.size() / 3;
+	for (const auto& light : scene.lights)
+		append(light.first);
+	return mesh;
+}
+
+// Pinhole rays through pixel centers, then as many rays with uniform origins in the scene
+// bound and uniform directions, from a fixed seed
+std::pair<std::vector<Ray>, std::vector<Ray>> generateRays(const Scene& scene, const Mesh& mesh, int raysPerAxis)
+{
+	const Camera& camera = scene.camera;
+	float tanFOV = glm::tan(glm::radians(camera.FOV() * 0.5f));
+
+	std::vector<Ray> primary;
+	for (int y = 0; y < raysPerAxis; y++)
+	{
+		for (int x = 0; x < raysPerAxis; x++)
+		{
+			glm::vec2 ndc = (glm::vec2(x, y) + 0.5f) / static_cast<float>(raysPerAxis) * 2.0f - 1.0f;
+			glm::vec3 dir = camera.right() * ndc.x * camera.aspect() * tanFOV + camera.up() * ndc.y * tanFOV + camera.front();
+			primary.push_back({ camera.pos(), glm::normalize(dir) });
+		}
+	}
+
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+	std::vector<Ray> random;
+	for (size_t i = 0; i < primary.size(); i++)
+	{
+		glm::vec3 u(uniform(rng), uniform(rng), uniform(rng));
+		glm::vec3 ori = mesh.bound.pMin + (mesh.bound.pMax - mesh.bound.pMin) * u;
+		float z = 1.0f - 2.0f * uniform(rng);
+		float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+		float phi = 2.0f * Pi * uniform(rng);
+		random.push_back({ ori, glm::vec3(r * std::cos(phi), r * std::sin(phi), z) });
+	}
+	return { primary, random };
+}
+
+struct ShadowRays
+{
+	std::vector<Ray> rays;
+	std::vector<float> tMax;
+};
+
+// From every primary hit on an object, one ray towards a uniform point on a random light
+// triangle with the offsets lightSampleLi uses, or along a uniform direction when the scene
+// has no light triangles. Hits are found once so that every builder replays the same rays
+ShadowRays generateShadowRays(const Mesh& mesh, const std::vector<Ray>& primary)
+{
+	BVHBuildParam param;
+	param.wideWidth = 0;
+	BVHIntersector intersector(BVH(mesh.vertices, mesh.indices, param).build(), mesh.vertices, mesh.indices);
+
+	std::mt19937 rng(2);
+	std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+	int nLights = mesh.indices.size() / 3 - mesh.lightPrimBase;
+	const float offset = 1e-4f;
+
+	ShadowRays shadow;
+	for (const auto& ray : primary)
+	{
+		RayHit hit = intersector.intersect(ray);
+		if (hit.prim == -1 || hit.prim >= mesh.lightPrimBase)
+			continue;
+		glm::vec3 p = ray.ori + ray.dir * hit.dist;
+
+		if (nLights == 0)
+		{
+			float z = 1.0f - 2.0f * uniform(rng);
+			float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+			float phi = 2.0f * Pi * uniform(rng);
+			glm::vec3 dir(r * std::cos(phi), r * std::sin(phi), z);
+			shadow.rays.push_back({ p + dir * offset, dir });
+			shadow.tMax.push_back(1e8f);
+			continue;
+		}
+		int light = mesh.lightPrimBase + std::min(static_cast<int>(uniform(rng) * nLights), nLights - 1);
+		float r = std::sqrt(uniform(rng));
+		float s = uniform(rng);
+		glm::vec3 y = mesh.vertex(light, 0) * (1.0f - r) + mesh.vertex(light, 1) * (r * (1.0f - s)) +
+			mesh.vertex(light, 2) * (r * s);
+		float dist = glm::length(y - p);
+		if (dist < offset * 2.0f)
+			continue;
+		glm::vec3 dir = (y - p) / dist;
+		shadow.rays.push_back({ p + dir * offset, dir });
+		shadow.tMax.push_back(dist - offset - 1e-6f);
+	}
+	return shadow;
+}
+
+std::string traversalJSON(const TraversalStats& stats)
+{
+	double n = std::max<int64_t>(stats.rays, 1);
+	std::stringstream ss;
+	ss << "{ \"rays\": " << stats.rays << ", \"hitRate\": " << stats.hits / n <<
+		", \"nodesVisitedPerRay\": " << stats.nodesVisited / n <<
+		", \"leavesVisitedPerRay\": " << stats.leavesVisited / n <<
+		", \"trianglesTestedPerRay\": " << stats.trianglesTested / n << " }";
+	return ss.str();
+}
+
+template<typename T>
+std::string arrayJSON(const std::vector<T>& values)
+{
+	std::stringstream ss;
+	ss << "[";
+	for (size_t i = 0; i < values.size(); i++)
+		ss << (i ? ", " : "") << values[i];
+	ss << "]";
+	return ss.str();
+}
+
+std::string analyze(const std::string& name, const BVHBuildParam& param, const Mesh& mesh,
+	const std::vector<Ray>& primary, const std::vector<Ray>& random, const ShadowRays& shadow)
+{
+	auto bvh = BVH(mesh.vertices, mesh.indices, param).build();
+	int treeSize = bvh.bounds.size();
+	const int* sizeIndices = bvh.hitTable.data();
+
+	// Depths follow storage order, where both children come after their parent
+	std::vector<int> depth(treeSize, 0);
+	std::vector<int> depthHistogram, leafSizeHistogram(BVH_MAX_LEAF_SIZE + 1, 0);
+	int nLeaves = 0;
+	double sumLeafDepth = 0.0;
+	for (int k = 0; k < treeSize; k++)
+	{
+		if (sizeIndices[k] < 0)
+		{
+			nLeaves++;
+			sumLeafDepth += depth[k];
+			if (depth[k] >= static_cast<int>(depthHistogram.size()))
+				depthHistogram.resize(depth[k] + 1, 0);
+			depthHistogram[depth[k]]++;
+			leafSizeHistogram[bvhLeafCount(sizeIndices[k])]++;
+			continue;
+		}
+		int rch = k + 1 + ((sizeIndices[k + 1] < 0) ? 1 : sizeIndices[k + 1]);
+		depth[k + 1] = depth[rch] = depth[k] + 1;
+	}
+
+	Timer timer;
+	float epo = computeEPO(bvh, mesh);
+	double epoTime = timer.get() * 1e-9;
+
+	timer.reset();
+	TraversalStats primaryStats, randomStats;
+	for (const auto& ray : primary)
+		traceMTBVH(bvh, mesh, ray, primaryStats);
+	for (const auto& ray : random)
+		traceMTBVH(bvh, mesh, ray, randomStats);
+	double traceTime = timer.get() * 1e-9;
+
+	timer.reset();
+	TraversalStats shadowStats;
+	for (size_t i = 0; i < shadow.rays.size(); i++)
+		traceMTBVH(bvh, mesh, shadow.rays[i], shadowStats, shadow.tMax[i], true);
+	double shadowTime = timer.get() * 1e-9;
+
+	size_t boundBytes = bvh.bounds.size() * sizeof(AABB);
+	size_t hitTableBytes = bvh.hitTable.size() * sizeof(int);
+	size_t primOrderBytes = bvh.primOrder.size() * sizeof(int);
+	size_t wideBytes = bvh.wide.bounds.size() * sizeof(glm::vec3) + bvh.wide.children.size() * sizeof(int);
+	int nTriangles = mesh.indices.size() / 3;
+
+	std::printf("%-10s build %.3f s, SAH %.3f, EPO %.3f, %d nodes, %.2f nodes/ray, %.2f tris/ray (EPO %.1f s, replay %.1f s)\n",
+		name.c_str(), bvh.stats.buildTime, bvh.stats.sahCost, epo, treeSize,
+		static_cast<double>(primaryStats.nodesVisited) / std::max<int64_t>(primaryStats.rays, 1),
+		static_cast<double>(primaryStats.trianglesTested) / std::max<int64_t>(primaryStats.rays, 1), epoTime, traceTime);
+	std::printf("%-10s shadow %.2f nodes/ray, %.2f tris/ray, %.1f%% occluded, %.3f Mrays/s replayed\n", "",
+		static_cast<double>(shadowStats.nodesVisited) / std::max<int64_t>(shadowStats.rays, 1),
+		static_cast<double>(shadowStats.trianglesTested) / std::max<int64_t>(shadowStats.rays, 1),
+		100.0 * shadowStats.hits / std::max<int64_t>(shadowStats.rays, 1), shadowStats.rays / std::max(shadowTime, 1e-9) * 1e-6);
+
+	std::stringstream ss;
+	ss << "\t\t{\n";
+	ss << "\t\t\t\"builder\": \"" << name << "\",\n";
+	ss << "\t\t\t\"buildTime\": " << bvh.stats.buildTime << ",\n";
+	ss << "\t\t\t\"numThreads\": " << bvh.stats.numThreads << ",\n";
+	ss << "\t\t\t\"sahCost\": " << bvh.stats.sahCost << ",\n";
+	ss << "\t\t\t\"epo\": " << epo << ",\n";
+	ss << "\t\t\t\"nodes\": " << treeSize << ",\n";
+	ss << "\t\t\t\"interiorNodes\": " << treeSize - nLeaves << ",\n";
+	ss << "\t\t\t\"leaves\": " << nLeaves << ",\n";
+	ss << "\t\t\t\"maxDepth\": " << depthHistogram.size() - 1 << ",\n";
+	ss << "\t\t\t\"meanLeafDepth\": " << sumLeafDepth / std::max(nLeaves, 1) << ",\n";
+	ss << "\t\t\t\"leafDepthHistogram\": " << arrayJSON(depthHistogram) << ",\n";
+	ss << "\t\t\t\"leafSizeHistogram\": " << arrayJSON(leafSizeHistogram) << ",\n";
+	ss << "\t\t\t\"memory\": { \"bounds\": " << boundBytes << ", \"hitTable\": " << hitTableBytes <<
+		", \"primOrder\": " << primOrderBytes << ", \"wide\": " << wideBytes <<
+		", \"bytesPerTriangle\": " << static_cast<double>(boundBytes + hitTableBytes) / nTriangles << " },\n";
+	ss << "\t\t\t\"traversal\": {\n";
+	ss << "\t\t\t\t\"primary\": " << traversalJSON(primaryStats) << ",\n";
+	ss << "\t\t\t\t\"random\": " << traversalJSON(randomStats) << ",\n";
+	ss << "\t\t\t\t\"shadow\": " << traversalJSON(shadowStats) << ",\n";
+	ss << "\t\t\t\t\"primaryRandomMraysPerSecond\": " << (primaryStats.rays + randomStats.rays) / std::max(traceTime, 1e-9) * 1e-6 << ",\n";
+	ss << "\t\t\t\t\"shadowMraysPerSecond\": " << shadowStats.rays / std::max(shadowTime, 1e-9) * 1e-6 << "\n";
+	ss << "\t\t\t}\n";
+	ss << "\t\t}";
+	return ss.str();
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		std::cerr << "usage: BVHAnalysis <scene.xml> [output.json] [rays per axis] [builders]\n";
+		return 1;
+	}
+	File::path scenePath = argv[1];
+	File::path outputPath = (argc > 2) ? argv[2] : "bvh_analysis.json";
+	int raysPerAxis = (argc > 3) ? std::atoi(argv[3]) : 256;
+	std::string builderList = (argc > 4) ? argv[4] : "standard,quick,linear,spatial";
+
+	if (glfwInit() != GLFW_TRUE)
+		Error::exit("failed to init GLFW");
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	glfwWindowHint(GLFW_VISIBLE, false);
+	auto window = glfwCreateWindow(1, 1, "BVHAnalysis", nullptr, nullptr);
+	glfwMakeContextCurrent(window);
+	if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+		Error::exit("failed to init GLAD");
+
+	Scene scene;
+	if (!scene.load(scenePath))
+		Error::exit("failed to load " + scenePath.generic_string());
+	Mesh mesh = flattenScene(scene);
+	Error::check(!mesh.indices.empty(), "[BVHAnalysis] scene has no triangles");
+	auto [primary, random] = generateRays(scene, mesh, raysPerAxis);
+	auto shadow = generateShadowRays(mesh, primary);
+
+	const std::pair<const char*, int> builders[] =
+	{
+		{ "standard", BVHBuildParam::Standard },
+		{ "quick", BVHBuildParam::Quick },
+		{ "linear", BVHBuildParam::Linear },
+		{ "spatial", BVHBuildParam::Spatial }
+	};
+
+	std::vector<std::string> results;
+	std::stringstream list(builderList);
+	std::string name;
+	while (std::getline(list, name, ','))
+	{
+		auto itr = std::find_if(std::begin(builders), std::end(builders), [&](const auto& b) { return name == b.first; });
+		if (itr == std::end(builders))
+		{
+			Error::bracketLine<0>("Unknown builder " + name + ", skipped");
+			continue;
+		}
+		BVHBuildParam param = scene.bvhParam;
+		param.method = itr->second;
+		results.push_back(analyze(name, param, mesh, primary, random, shadow));
+	}
+
+	std::ofstream file(outputPath);
+	file << std::setprecision(8);
+	file << "{\n";
+	file << "\t\"scene\": \"" << scenePath.generic_string() << "\",\n";
+	file << "\t\"triangles\": " << mesh.indices.size() / 3 << ",\n";
+	file << "\t\"vertices\": " << mesh.vertices.size() << ",\n";
+	file << "\t\"maxLeafSize\": " << scene.bvhParam.maxLeafSize << ",\n";
+	file << "\t\"treeletPasses\": " << scene.bvhParam.treeletPasses << ",\n";
+	file << "\t\"raysPerAxis\": " << raysPerAxis << ",\n";
+	file << "\t\"builders\": [\n";
+	for (size_t i = 0; i < results.size(); i++)
+		file << results[i] << (i + 1 < results.size() ? ",\n" : "\n");
+	file << "\t]\n";
+	file << "}\n";
+	Error::check(file.good(), "[BVHAnalysis] unable to write " + outputPath.generic_string());
+	Error::bracketLine<0>("Analysis written to " + outputPath.generic_string());
+
+	glfwDestroyWindow(window);
+	glfwTerminate();
+	return 0;
+}
@@ -0,0 +1,229 @@
+// Headless micro-benchmark of the CPU BVH builders, reporting triangles per second of
+// the core build (excluding hit table threading and wide collapse), then rays per second
+// of BVHIntersector: single rays on one thread and on the pool, and batches. Built on its
+// own together with src/accelerator; the builders' log goes to stderr, results to stdout.
+//
+//   BVHBenchmark [triangles = 1000000] [repeats = 5] [threads = 0]
+
+#include "../accelerator/BVHIntersector.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <limits>
+#include <random>
+
+#include "../util/Timer.h"
+
+const float Pi = 3.141592653589793f;
+
+// A noisy tessellated sphere plus a uniform soup of small triangles, so that both well
+// distributed and clustered centroids are exercised
+void generateMesh(int nTriangles, std::vector<glm::vec3>& vertices, std::vector<uint32_t>& indices)
+{
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+	int nSphere = nTriangles / 2;
+	int res = std::max(static_cast<int>(std::sqrt(nSphere / 2)), 2);
+	for (int i = 0; i <= res; i++)
+	{
+		for (int j = 0; j <= res; j++)
+		{
+			float theta = Pi * i / res;
+			float phi = 2.0f * Pi * j / res;
+			float radius = 10.0f + 0.2f * uniform(rng);
+			vertices.push_back(radius * glm::vec3(std::sin(theta) * std::cos(phi), std::sin(theta) * std::sin(phi), std::cos(theta)));
+		}
+	}
+	for (int i = 0; i < res; i++)
+	{
+		for (int j = 0; j < res; j++)
+		{
+			uint32_t a = i * (res + 1) + j, b = a + 1, c = a + res + 1, d = c + 1;
+			indices.insert(indices.end(), { a, b, c, b, d, c });
+		}
+	}
+
+	while (indices.size() / 3 < static_cast<size_t>(nTriangles))
+	{
+		glm::vec3 p = glm::vec3(uniform(rng), uniform(rng), uniform(rng)) * 40.0f - 20.0f;
+		glm::vec3 d = glm::vec3(uniform(rng), uniform(rng), uniform(rng)) * 0.2f;
+		uint32_t base = vertices.size();
+		vertices.insert(vertices.end(), { p, p + glm::vec3(d.x, 0.0f, d.z), p + glm::vec3(0.0f, d.y, d.x) });
+		indices.insert(indices.end(), { base, base + 1, base + 2 });
+	}
+}
+
+// Pinhole rays from outside the sphere across its silhouette, and rays with uniform origins in
+// the mesh bound and uniform directions
+void generateRays(int nRays, std::vector<Ray>& coherent, std::vector<Ray>& incoherent)
+{
+	std::mt19937 rng(2);
+	std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+	int res = static_cast<int>(std::sqrt(nRays));
+	for (int y = 0; y < res; y++)
+	{
+		for (int x = 0; x < res; x++)
+		{
+			glm::vec2 ndc = (glm::vec2(x, y) + 0.5f) / static_cast<float>(res) * 2.0f - 1.0f;
+			coherent.push_back({ glm::vec3(0.0f, 0.0f, -40.0f), glm::normalize(glm::vec3(ndc.x * 0.3f, ndc.y * 0.3f, 1.0f)) });
+		}
+	}
+	while (incoherent.size() < coherent.size())
+	{
+		float z = 1.0f - 2.0f * uniform(rng);
+		float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+		float phi = 2.0f * Pi * uniform(rng);
+		glm::vec3 ori = glm::vec3(uniform(rng), uniform(rng), uniform(rng)) * 40.0f - 20.0f;
+		incoherent.push_back({ ori, glm::vec3(r * std::cos(phi), r * std::sin(phi), z) });
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	int nTriangles = (argc > 1) ? std::atoi(argv[1]) : 1000000;
+	int nRepeats = (argc > 2) ? std::atoi(argv[2]) : 5;
+	int nThreads = (argc > 3) ? std::atoi(argv[3]) : 0;
+
+	std::vector<glm::vec3> vertices;
+	std::vector<uint32_t> indices;
+	generateMesh(nTriangles, vertices, indices);
+	nTriangles = indices.size() / 3;
+
+	struct Method
+	{
+		const char* name;
+		int method;
+		int maxTriangles;	// The full-sweep build is far slower, keep it to smaller meshes
+	};
+	const Method methods[] =
+	{
+		{ "standard", BVHBuildParam::Standard, 1 << 20 },
+		{ "quick", BVHBuildParam::Quick, std::numeric_limits<int>::max() },
+		{ "linear", BVHBuildParam::Linear, std::numeric_limits<int>::max() }
+	};
+
+	std::printf("%d triangles, best of %d\n", nTriangles, nRepeats);
+	for (const auto& method : methods)
+	{
+		if (nTriangles > method.maxTriangles)
+			continue;
+		BVHBuildParam param;
+		param.method = method.method;
+		param.numThreads = nThreads;
+		param.wideWidth = 0;
+		param.maxLeafSize = 1;
+
+		double best = std::numeric_limits<double>::max();
+		BVHStatistics stats;
+		for (int i = 0; i < nRepeats; i++)
+		{
+			stats = BVH(vertices, indices, param).build().stats;
+			best = std::min(best, stats.buildTime);
+		}
+		std::printf("%-10s %2d thread(s) %10.4f s %10.3f Mtris/s  SAH %.3f\n", method.name, stats.numThreads,
+			best, nTriangles / best * 1e-6, stats.sahCost);
+	}
+
+	// Traversal over a tree built with the default settings, as scenes use it
+	BVHBuildParam param;
+	param.numThreads = nThreads;
+	param.wideWidth = 0;
+	BVHIntersector intersector(BVH(vertices, indices, param).build(), vertices, indices);
+
+	std::vector<Ray> coherent, incoherent;
+	generateRays(1 << 18, coherent, incoherent);
+	ThreadPool pool(nThreads);
+
+	// Shadow rays from the coherent hits towards a point light, kept in pixel order
+	std::vector<RayHit> primaryHits;
+	intersector.intersect(coherent, primaryHits, pool);
+	std::vector<Ray> shadow;
+	std::vector<float> shadowDist;
+	const glm::vec3 lightPos(30.0f, 30.0f, -30.0f);
+	const float shadowOffset = 1e-3f;
+	for (size_t i = 0; i < coherent.size(); i++)
+	{
+		if (primaryHits[i].prim == -1)
+			continue;
+		glm::vec3 p = coherent[i].ori + coherent[i].dir * primaryHits[i].dist;
+		float dist = glm::length(lightPos - p);
+		glm::vec3 dir = (lightPos - p) / dist;
+		shadow.push_back({ p + dir * shadowOffset, dir });
+		shadowDist.push_back(dist - 2.0f * shadowOffset);
+	}
+
+	auto measure = [&](const char* name, const char* mode, int threads, int nRays, const std::function<int()>& trace)
+	{
+		double best = std::numeric_limits<double>::max();
+		int nHits = 0;
+		for (int i = 0; i < nRepeats; i++)
+		{
+			Timer timer;
+			nHits = trace();
+			best = std::min(best, timer.get() * 1e-9);
+		}
+		std::printf("%-10s %-7s %2d thread(s) %10.4f s %10.3f Mrays/s  hit %.3f\n", name, mode, threads,
+			best, nRays / best * 1e-6, static_cast<double>(nHits) / nRays);
+	};
+
+	std::printf("%d primary and %d shadow rays, %d-wide triangle tests and packets\n", static_cast<int>(coherent.size()),
+		static_cast<int>(shadow.size()), BVHIntersector::SimdWidth);
+
+	struct RaySet
+	{
+		const char* name;
+		const std::vector<Ray>& rays;
+	};
+	const RaySet raySets[] = { { "coherent", coherent }, { "incoherent", incoherent } };
+
+	for (const auto& raySet : raySets)
+	{
+		int nRays = raySet.rays.size();
+		auto traceSingle = [&](int begin, int end)
+		{
+			int hits = 0;
+			for (int j = begin; j < end; j++)
+				hits += intersector.intersect(raySet.rays[j]).prim != -1;
+			return hits;
+		};
+		measure(raySet.name, "single", 1, nRays, [&]() { return traceSingle(0, nRays); });
+		measure(raySet.name, "single", pool.numThreads(), nRays, [&]()
+		{
+			std::atomic<int> hits(0);
+			pool.parallelFor(nRays, 4096, [&](int begin, int end) { hits += traceSingle(begin, end); });
+			return hits.load();
+		});
+		measure(raySet.name, "batch", pool.numThreads(), nRays, [&]()
+		{
+			std::vector<RayHit> hits;
+			intersector.intersect(raySet.rays, hits, pool);
+			return static_cast<int>(std::count_if(hits.begin(), hits.end(), [](const RayHit& hit) { return hit.prim != -1; }));
+		});
+	}
+
+	int nShadow = shadow.size();
+	measure("shadow", "single", pool.numThreads(), nShadow, [&]()
+	{
+		std::atomic<int> hits(0);
+		pool.parallelFor(nShadow, 4096, [&](int begin, int end)
+		{
+			int blocked = 0;
+			for (int j = begin; j < end; j++)
+				blocked += intersector.occluded(shadow[j], shadowDist[j]);
+			hits += blocked;
+		});
+		return hits.load();
+	});
+	measure("shadow", "batch", pool.numThreads(), nShadow, [&]()
+	{
+		std::vector<uint8_t> blocked;
+		intersector.occluded(shadow, shadowDist, blocked, pool);
+		return static_cast<int>(std::count(blocked.begin(), blocked.end(), 1));
+	});
+	return 0;
+}
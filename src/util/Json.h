@@ -0,0 +1,312 @@
+#pragma once
+
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Small read-only JSON document, enough for scene and asset descriptions. Lookups of missing
+// keys or indices return a null value, so optional fields read as their defaults
+class JsonValue
+{
+public:
+    enum class Type { Null, Bool, Number, String, Array, Object };
+
+    Type type() const { return mType; }
+    bool isNull() const { return mType == Type::Null; }
+    bool isNumber() const { return mType == Type::Number; }
+    bool isString() const { return mType == Type::String; }
+    bool isArray() const { return mType == Type::Array; }
+    bool isObject() const { return mType == Type::Object; }
+
+    bool has(const std::string& key) const { return mObject.find(key) != mObject.end(); }
+    size_t size() const { return isArray() ? mArray.size() : mObject.size(); }
+
+    const JsonValue& operator [] (const std::string& key) const
+    {
+        auto res = mObject.find(key);
+        return (res == mObject.end()) ? null() : res->second;
+    }
+
+    const JsonValue& operator [] (size_t index) const
+    {
+        return (index < mArray.size()) ? mArray[index] : null();
+    }
+
+    bool asBool(bool def = false) const { return (mType == Type::Bool) ? mBool : def; }
+    double asNumber(double def = 0.0) const { return isNumber() ? mNumber : def; }
+    float asFloat(float def = 0.0f) const { return isNumber() ? static_cast<float>(mNumber) : def; }
+    int asInt(int def = 0) const { return isNumber() ? static_cast<int>(mNumber) : def; }
+    const std::string& asString() const { return mString; }
+
+    static std::optional<JsonValue> parse(const char* begin, const char* end)
+    {
+        Parser parser{ begin, end };
+        JsonValue value;
+        if (!parser.parseValue(value, 0))
+            return std::nullopt;
+        parser.skipSpace();
+        if (parser.cur != end)
+            return std::nullopt;
+        return value;
+    }
+
+    static std::optional<JsonValue> parse(const std::string& text)
+    {
+        return parse(text.data(), text.data() + text.size());
+    }
+
+private:
+    static const JsonValue& null()
+    {
+        static const JsonValue value;
+        return value;
+    }
+
+    struct Parser
+    {
+        const char* cur;
+        const char* end;
+
+        static const int MaxDepth = 256;
+
+        void skipSpace()
+        {
+            while (cur != end && (*cur == ' ' || *cur == '\t' || *cur == '\n' || *cur == '\r'))
+                cur++;
+        }
+
+        bool match(const char* literal)
+        {
+            const char* p = cur;
+            for (; *literal; literal++, p++)
+            {
+                if (p == end || *p != *literal)
+                    return false;
+            }
+            cur = p;
+            return true;
+        }
+
+        bool parseValue(JsonValue& value, int depth)
+        {
+            skipSpace();
+            if (cur == end || depth > MaxDepth)
+                return false;
+
+            switch (*cur)
+            {
+            case 'n':
+                value.mType = Type::Null;
+                return match("null");
+            case 't':
+                value.mType = Type::Bool;
+                value.mBool = true;
+                return match("true");
+            case 'f':
+                value.mType = Type::Bool;
+                value.mBool = false;
+                return match("false");
+            case '"':
+                value.mType = Type::String;
+                return parseString(value.mString);
+            case '[':
+                value.mType = Type::Array;
+                return parseArray(value, depth);
+            case '{':
+                value.mType = Type::Object;
+                return parseObject(value, depth);
+            default:
+                value.mType = Type::Number;
+                return parseNumber(value.mNumber);
+            }
+        }
+
+        bool parseNumber(double& number)
+        {
+            // strtod wants a terminated string, numbers are short so copy the candidate out
+            const char* p = cur;
+            auto numberChar = [](char c)
+            {
+                return std::isdigit(static_cast<unsigned char>(c)) || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+            };
+            while (p != end && numberChar(*p))
+                p++;
+            if (p == cur)
+                return false;
+            std::string str(cur, p);
+            char* parsedEnd;
+            number = std::strtod(str.c_str(), &parsedEnd);
+            if (parsedEnd != str.c_str() + str.size())
+                return false;
+            cur = p;
+            return true;
+        }
+
+        static bool hexDigit(char c, uint32_t& digit)
+        {
+            if (c >= '0' && c <= '9')
+                digit = c - '0';
+            else if (c >= 'a' && c <= 'f')
+                digit = c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                digit = c - 'A' + 10;
+            else
+                return false;
+            return true;
+        }
+
+        bool parseCodeUnit(uint32_t& unit)
+        {
+            unit = 0;
+            for (int i = 0; i < 4; i++, cur++)
+            {
+                uint32_t digit;
+                if (cur == end || !hexDigit(*cur, digit))
+                    return false;
+                unit = unit << 4 | digit;
+            }
+            return true;
+        }
+
+        static void appendUTF8(std::string& str, uint32_t code)
+        {
+            if (code < 0x80)
+                str += static_cast<char>(code);
+            else if (code < 0x800)
+            {
+                str += static_cast<char>(0xc0 | code >> 6);
+                str += static_cast<char>(0x80 | (code & 0x3f));
+            }
+            else if (code < 0x10000)
+            {
+                str += static_cast<char>(0xe0 | code >> 12);
+                str += static_cast<char>(0x80 | (code >> 6 & 0x3f));
+                str += static_cast<char>(0x80 | (code & 0x3f));
+            }
+            else
+            {
+                str += static_cast<char>(0xf0 | code >> 18);
+                str += static_cast<char>(0x80 | (code >> 12 & 0x3f));
+                str += static_cast<char>(0x80 | (code >> 6 & 0x3f));
+                str += static_cast<char>(0x80 | (code & 0x3f));
+            }
+        }
+
+        bool parseString(std::string& str)
+        {
+            cur++;
+            while (cur != end && *cur != '"')
+            {
+                if (*cur != '\\')
+                {
+                    str += *cur++;
+                    continue;
+                }
+                if (++cur == end)
+                    return false;
+                char escape = *cur++;
+                switch (escape)
+                {
+                case '"': str += '"'; break;
+                case '\\': str += '\\'; break;
+                case '/': str += '/'; break;
+                case 'b': str += '\b'; break;
+                case 'f': str += '\f'; break;
+                case 'n': str += '\n'; break;
+                case 'r': str += '\r'; break;
+                case 't': str += '\t'; break;
+                case 'u':
+                {
+                    uint32_t code;
+                    if (!parseCodeUnit(code))
+                        return false;
+                    // A high surrogate followed by an escaped low one makes a single code point
+                    if (code >= 0xd800 && code < 0xdc00 && end - cur >= 6 && cur[0] == '\\' && cur[1] == 'u')
+                    {
+                        cur += 2;
+                        uint32_t low;
+                        if (!parseCodeUnit(low) || low < 0xdc00 || low >= 0xe000)
+                            return false;
+                        code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                    }
+                    appendUTF8(str, code);
+                    break;
+                }
+                default:
+                    return false;
+                }
+            }
+            if (cur == end)
+                return false;
+            cur++;
+            return true;
+        }
+
+        bool parseArray(JsonValue& value, int depth)
+        {
+            cur++;
+            skipSpace();
+            if (cur != end && *cur == ']')
+            {
+                cur++;
+                return true;
+            }
+            while (true)
+            {
+                value.mArray.emplace_back();
+                if (!parseValue(value.mArray.back(), depth + 1))
+                    return false;
+                skipSpace();
+                if (cur == end)
+                    return false;
+                if (*cur++ == ']')
+                    return true;
+                if (cur[-1] != ',')
+                    return false;
+            }
+        }
+
+        bool parseObject(JsonValue& value, int depth)
+        {
+            cur++;
+            skipSpace();
+            if (cur != end && *cur == '}')
+            {
+                cur++;
+                return true;
+            }
+            while (true)
+            {
+                skipSpace();
+                std::string key;
+                if (cur == end || *cur != '"' || !parseString(key))
+                    return false;
+                skipSpace();
+                if (cur == end || *cur++ != ':')
+                    return false;
+                if (!parseValue(value.mObject[key], depth + 1))
+                    return false;
+                skipSpace();
+                if (cur == end)
+                    return false;
+                if (*cur++ == '}')
+                    return true;
+                if (cur[-1] != ',')
+                    return false;
+            }
+        }
+    };
+
+private:
+    Type mType = Type::Null;
+    bool mBool = false;
+    double mNumber = 0.0;
+    std::string mString;
+    std::vector<JsonValue> mArray;
+    std::map<std::string, JsonValue> mObject;
+};
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+
+#include "File.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only memory mapping of a whole file; valid() is false if it couldn't be mapped
+class MappedFile
+{
+public:
+    MappedFile(const File::path& path)
+    {
+#ifdef _WIN32
+        mFile = CreateFileW(path.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (mFile == INVALID_HANDLE_VALUE)
+            return;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(mFile, &size) || size.QuadPart == 0)
+            return;
+        mMapping = CreateFileMappingW(mFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mMapping == nullptr)
+            return;
+        mData = MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0);
+        if (mData != nullptr)
+            mSize = static_cast<size_t>(size.QuadPart);
+#else
+        mFile = open(path.c_str(), O_RDONLY);
+        if (mFile == -1)
+            return;
+        struct stat st;
+        if (fstat(mFile, &st) != 0 || st.st_size == 0)
+            return;
+        void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, mFile, 0);
+        if (data == MAP_FAILED)
+            return;
+        mData = data;
+        mSize = static_cast<size_t>(st.st_size);
+#endif
+    }
+
+    ~MappedFile()
+    {
+#ifdef _WIN32
+        if (mData != nullptr)
+            UnmapViewOfFile(mData);
+        if (mMapping != nullptr)
+            CloseHandle(mMapping);
+        if (mFile != INVALID_HANDLE_VALUE)
+            CloseHandle(mFile);
+#else
+        if (mData != nullptr)
+            munmap(mData, mSize);
+        if (mFile != -1)
+            close(mFile);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator = (const MappedFile&) = delete;
+
+    bool valid() const { return mData != nullptr; }
+    const void* data() const { return mData; }
+    size_t size() const { return mSize; }
+
+private:
+    void* mData = nullptr;
+    size_t mSize = 0;
+#ifdef _WIN32
+    HANDLE mFile = INVALID_HANDLE_VALUE;
+    HANDLE mMapping = nullptr;
+#else
+    int mFile = -1;
+#endif
+};
+
+using MappedFilePtr = std::shared_ptr<MappedFile>;
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+    ThreadPool(int numThreads = 0)
+    {
+        if (numThreads <= 0)
+            numThreads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        for (int i = 0; i < numThreads; i++)
+            mWorkers.emplace_back([this]() { workerLoop(); });
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mTaskCond.notify_all();
+        for (auto& worker : mWorkers)
+            worker.join();
+    }
+
+    void enqueue(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mTasks.push(std::move(task));
+            mPending++;
+        }
+        mTaskCond.notify_one();
+    }
+
+    // Blocks until every task enqueued so far, and every task those enqueue, has finished
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mIdleCond.wait(lock, [this]() { return mPending == 0; });
+    }
+
+    // Splits [0, count) into chunks of grainSize and runs func(begin, end) on each.
+    // Safe to call from inside a task: the caller keeps executing queued tasks while it waits
+    template<typename Func>
+    void parallelFor(int count, int grainSize, Func&& func)
+    {
+        int numChunks = (count + grainSize - 1) / grainSize;
+        if (numChunks <= 1)
+        {
+            func(0, count);
+            return;
+        }
+        std::atomic<int> remaining(numChunks - 1);
+        for (int i = 1; i < numChunks; i++)
+        {
+            enqueue([&, i]()
+            {
+                func(i * grainSize, std::min(count, (i + 1) * grainSize));
+                remaining--;
+            });
+        }
+        func(0, grainSize);
+
+        while (remaining > 0)
+        {
+            if (!runPendingTask())
+                std::this_thread::yield();
+        }
+    }
+
+    int numThreads() const { return static_cast<int>(mWorkers.size()); }
+
+private:
+    bool runPendingTask()
+    {
+        std::function<void()> task;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mTasks.empty())
+                return false;
+            task = std::move(mTasks.front());
+            mTasks.pop();
+        }
+        finishTask(task);
+        return true;
+    }
+
+    void workerLoop()
+    {
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mTaskCond.wait(lock, [this]() { return mStop || !mTasks.empty(); });
+                if (mStop && mTasks.empty())
+                    return;
+                task = std::move(mTasks.front());
+                mTasks.pop();
+            }
+            finishTask(task);
+        }
+    }
+
+    void finishTask(std::function<void()>& task)
+    {
+        task();
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (--mPending == 0)
+            mIdleCond.notify_all();
+    }
+
+private:
+    std::vector<std::thread> mWorkers;
+    std::queue<std::function<void()>> mTasks;
+    std::mutex mMutex;
+    std::condition_variable mTaskCond;
+    std::condition_variable mIdleCond;
+    int mPending = 0;
+    bool mStop = false;
+};